@@ -0,0 +1,210 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "log.h"
+#include "main.h"
+
+/* keep libc includes before linux headers for musl compatibility */
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <linux/tcp.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Traffic budget for metered interfaces
+ *
+ * Account the IP packets and bytes of all probes of an interface (including
+ * gateway and trace probes) per day or month. The probe interval is
+ * stretched so that the rest of the budget lasts until the end of the
+ * period, and when it's used up no more probes are sent until the next one.
+ *
+ * The sizes are those of IPv4 packets, without link layer overhead. A TCP
+ * check is SYN, SYN-ACK, ACK and the FIN handshake after closing, with the
+ * TCP options Linux uses (MSS, SACK, timestamps, window scaling on SYN).
+ * Retransmitted SYNs and the RST of a refused connect are read from the
+ * socket before it is closed.
+ */
+
+#define BUDGET_ICMP_BYTES 28 /* IP + ICMP echo header */
+#define BUDGET_SYN_BYTES  60 /* IP + TCP header + 20 bytes options */
+#define BUDGET_TCP_BYTES  52 /* IP + TCP header + timestamps */
+#define BUDGET_RST_BYTES  40 /* IP + TCP header */
+#define BUDGET_MIN_PROBES 10 /* before the measured cost is used */
+
+/* SYN-ACK, ACK, FIN, FIN-ACK, ACK after a successful connect */
+#define BUDGET_TCP_REPLY_PACKETS 5
+#define BUDGET_TCP_REPLY_BYTES	 (BUDGET_SYN_BYTES + 4 * BUDGET_TCP_BYTES)
+
+static time_t budget_period_end(bool month, time_t now)
+{
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	tm.tm_hour = 0;
+	tm.tm_min = 0;
+	tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	if (month) {
+		tm.tm_mday = 1;
+		tm.tm_mon++;
+	} else {
+		tm.tm_mday++;
+	}
+	return mktime(&tm);
+}
+
+static uint64_t budget_used(struct ping_intf* pi)
+{
+	return pi->conf_budget_packets ? pi->budget.used_packets
+								   : pi->budget.used_bytes;
+}
+
+static void budget_add(struct ping_intf* pi, unsigned int packets,
+					   unsigned int bytes)
+{
+	pi->budget.used_packets += packets;
+	pi->budget.used_bytes += bytes;
+}
+
+/* a probe has been sent */
+void budget_sent(struct ping_intf* pi)
+{
+	if (pi->conf_budget == 0) {
+		return;
+	}
+	pi->budget.probes++;
+	budget_add(pi, 1,
+			   pi->conf_proto == TCP ? BUDGET_SYN_BYTES : BUDGET_ICMP_BYTES);
+}
+
+/* a probe has been answered */
+void budget_reply(struct ping_intf* pi)
+{
+	if (pi->conf_budget == 0) {
+		return;
+	}
+	if (pi->conf_proto == TCP) {
+		budget_add(pi, BUDGET_TCP_REPLY_PACKETS, BUDGET_TCP_REPLY_BYTES);
+	} else {
+		budget_add(pi, 1, BUDGET_ICMP_BYTES);
+	}
+}
+
+/* a TCP check socket is about to be closed. the SYN and, if connected, the
+ * handshake have been accounted already, add retransmissions and what was
+ * received for a failed connect */
+void budget_tcp_close(struct ping_intf* pi, int fd, bool connected)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	if (pi->conf_budget == 0 || pi->conf_proto != TCP || fd <= 0) {
+		return;
+	}
+	memset(&info, 0, sizeof(info));
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+		return;
+	}
+	budget_add(pi, info.tcpi_total_retrans,
+			   info.tcpi_total_retrans * BUDGET_SYN_BYTES);
+	/* tcpi_segs_in is only there since Linux 4.2 */
+	if (!connected
+		&& len >= offsetof(struct tcp_info, tcpi_segs_in)
+					  + sizeof(info.tcpi_segs_in)) {
+		budget_add(pi, info.tcpi_segs_in,
+				   info.tcpi_segs_in * BUDGET_RST_BYTES);
+	}
+}
+
+/* an additional ICMP packet has been sent or received */
+void budget_icmp(struct ping_intf* pi)
+{
+	if (pi->conf_budget != 0) {
+		budget_add(pi, 1, BUDGET_ICMP_BYTES);
+	}
+}
+
+/* returns false when the budget is used up, starts new periods */
+bool budget_allow(struct ping_intf* pi)
+{
+	struct budget_state* bs = &pi->budget;
+
+	if (pi->conf_budget == 0) {
+		return true;
+	}
+
+	time_t now = clock_time();
+	if (bs->period_end == 0) {
+		bs->period_end = budget_period_end(pi->conf_budget_month, now);
+	} else if (now >= bs->period_end) {
+		bs->period_end = budget_period_end(pi->conf_budget_month, now);
+		bs->used_packets = 0;
+		bs->used_bytes = 0;
+		bs->probes = 0;
+		if (bs->exhausted) {
+			LOG_NOTI("Budget of '%s' available again", pi->name);
+			bs->exhausted = false;
+			scripts_run_budget(pi);
+		}
+	}
+
+	if (!bs->exhausted && budget_used(pi) >= pi->conf_budget) {
+		LOG_NOTI("Budget of '%s' exhausted, no probes until %s", pi->name,
+				 pi->conf_budget_month ? "next month" : "tomorrow");
+		bs->exhausted = true;
+		scripts_run_budget(pi);
+	}
+	return !bs->exhausted;
+}
+
+/* interval for the next probe, stretched to stay within the budget */
+int budget_interval(struct ping_intf* pi)
+{
+	struct budget_state* bs = &pi->budget;
+	uint64_t used = budget_used(pi);
+
+	bs->interval = pi->conf_interval;
+	if (pi->conf_budget == 0 || bs->period_end == 0 || bs->exhausted
+		|| used >= pi->conf_budget) {
+		return bs->interval;
+	}
+
+	/* cost of one probe, until measured assume every probe is answered */
+	double cost;
+	if (bs->probes >= BUDGET_MIN_PROBES) {
+		cost = (double)used / bs->probes;
+	} else if (pi->conf_budget_packets) {
+		cost = pi->conf_proto == TCP ? 1 + BUDGET_TCP_REPLY_PACKETS : 2;
+	} else {
+		cost = pi->conf_proto == TCP
+				   ? BUDGET_SYN_BYTES + BUDGET_TCP_REPLY_BYTES
+				   : 2 * BUDGET_ICMP_BYTES;
+	}
+
+	double probes_left = (pi->conf_budget - used) / cost;
+	double ms = (bs->period_end - clock_time()) * 1000.0 / probes_left;
+	if (ms > bs->interval) {
+		bs->interval = ms < INT_MAX ? (int)ms : INT_MAX;
+	}
+	if (pi->compare != NULL) {
+		/* stay aligned with the rounds of the group, skip some */
+		long long n = ((long long)bs->interval + pi->conf_interval - 1)
+					  / pi->conf_interval * pi->conf_interval;
+		bs->interval = n < INT_MAX ? n : INT_MAX;
+	}
+	return bs->interval;
+}
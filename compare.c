@@ -0,0 +1,268 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "log.h"
+#include "main.h"
+#include <libubox/blobmsg.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Compare groups
+ *
+ * Interfaces with the same "compare" option send their probes at the same
+ * time (at multiples of the interval, see ping.c), so their RTTs are measured
+ * under the same conditions. The results of each round are paired and the
+ * distribution of the RTT difference of every pair of interfaces is kept.
+ * A round is evaluated when the next one starts.
+ */
+
+#define COMPARE_MAX_MEMBERS 8
+#define COMPARE_MAX_PAIRS	(COMPARE_MAX_MEMBERS * (COMPARE_MAX_MEMBERS - 1) / 2)
+#define COMPARE_WINDOW		100
+
+/* last RTT differences of two members a and b (a - b) */
+struct compare_pair {
+	int diff[COMPARE_WINDOW]; /* in ms */
+	unsigned int idx;
+	unsigned int cnt;
+	unsigned int lost; /* rounds where only one of them got a reply */
+};
+
+struct compare_group {
+	struct list_head list;
+	char name[MAX_IFNAME_LEN];
+	long long round; /* due time of the current round, in ms */
+	struct ping_intf* members[COMPARE_MAX_MEMBERS];
+	int num;
+	struct compare_pair pairs[COMPARE_MAX_PAIRS];
+};
+
+static LIST_HEAD(groups);
+
+/* index of pair a, b with a < b */
+static int compare_pair_idx(int a, int b)
+{
+	return a * (2 * COMPARE_MAX_MEMBERS - a - 1) / 2 + (b - a - 1);
+}
+
+static struct compare_group* compare_group_get(const char* name)
+{
+	struct compare_group* g;
+
+	list_for_each_entry(g, &groups, list) {
+		if (strcmp(g->name, name) == 0) {
+			return g;
+		}
+	}
+
+	g = calloc(1, sizeof(*g));
+	if (g == NULL) {
+		return NULL;
+	}
+	strncpy(g->name, name, MAX_IFNAME_LEN - 1);
+	list_add_tail(&g->list, &groups);
+	return g;
+}
+
+void compare_join(struct ping_intf* pi)
+{
+	if (pi->compare != NULL || pi->conf_compare[0] == '\0') {
+		return;
+	}
+
+	struct compare_group* g = compare_group_get(pi->conf_compare);
+	if (g == NULL) {
+		return;
+	}
+
+	int slot = -1;
+	for (int i = 0; i < COMPARE_MAX_MEMBERS; i++) {
+		if (g->members[i] == NULL) {
+			slot = i;
+			break;
+		}
+	}
+	if (slot < 0) {
+		LOG_ERR("Compare group '%s' full, not adding '%s'", g->name, pi->name);
+		return;
+	}
+
+	for (int i = 0; i < COMPARE_MAX_MEMBERS; i++) {
+		struct ping_intf* other = g->members[i];
+		if (other == NULL) {
+			continue;
+		}
+		if (strcmp(other->conf_hostname, pi->conf_hostname) != 0
+			|| other->conf_proto != pi->conf_proto) {
+			LOG_WARN("Compare group '%s': '%s' and '%s' probe different "
+					 "targets",
+					 g->name, pi->name, other->name);
+		}
+		/* statistics of the slot may be from a previous member */
+		int idx = i < slot ? compare_pair_idx(i, slot)
+						   : compare_pair_idx(slot, i);
+		memset(&g->pairs[idx], 0, sizeof(g->pairs[idx]));
+	}
+
+	g->members[slot] = pi;
+	g->num++;
+	pi->compare = g;
+	pi->compare_round = -1;
+	pi->compare_rtt = -1;
+}
+
+void compare_leave(struct ping_intf* pi)
+{
+	struct compare_group* g = pi->compare;
+	if (g == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < COMPARE_MAX_MEMBERS; i++) {
+		if (g->members[i] == pi) {
+			g->members[i] = NULL;
+			g->num--;
+		}
+	}
+	pi->compare = NULL;
+
+	if (g->num == 0) {
+		list_del(&g->list);
+		free(g);
+	}
+}
+
+static void compare_pair_add(struct compare_pair* p, int diff)
+{
+	p->diff[p->idx] = diff;
+	p->idx = (p->idx + 1) % COMPARE_WINDOW;
+	if (p->cnt < COMPARE_WINDOW) {
+		p->cnt++;
+	}
+}
+
+/* pair the results of all members which took part in the current round */
+static void compare_evaluate(struct compare_group* g)
+{
+	for (int a = 0; a < COMPARE_MAX_MEMBERS; a++) {
+		struct ping_intf* pa = g->members[a];
+		if (pa == NULL || pa->compare_round != g->round) {
+			continue;
+		}
+		for (int b = a + 1; b < COMPARE_MAX_MEMBERS; b++) {
+			struct ping_intf* pb = g->members[b];
+			if (pb == NULL || pb->compare_round != g->round) {
+				continue;
+			}
+			struct compare_pair* p = &g->pairs[compare_pair_idx(a, b)];
+			if (pa->compare_rtt >= 0 && pb->compare_rtt >= 0) {
+				compare_pair_add(p, pa->compare_rtt - pb->compare_rtt);
+			} else if (pa->compare_rtt >= 0 || pb->compare_rtt >= 0) {
+				p->lost++;
+			}
+		}
+	}
+}
+
+/* pi sends the probe of the round which is due at round (ms) */
+void compare_round(struct ping_intf* pi, long long round)
+{
+	struct compare_group* g = pi->compare;
+
+	if (round > g->round) {
+		compare_evaluate(g);
+		g->round = round;
+	}
+	pi->compare_round = round;
+	pi->compare_rtt = -1;
+}
+
+void compare_reply(struct ping_intf* pi, unsigned int rtt)
+{
+	pi->compare_rtt = rtt;
+}
+
+static int compare_cmp_int(const void* a, const void* b)
+{
+	int x = *(const int*)a;
+	int y = *(const int*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void compare_pair_blob(struct blob_buf* b, struct ping_intf* pa,
+							  struct ping_intf* pb, struct compare_pair* p)
+{
+	int diffs[COMPARE_WINDOW];
+	double sum = 0, sum_sq = 0;
+	unsigned int faster = 0;
+
+	void* tbl = blobmsg_open_table(b, NULL);
+	blobmsg_add_string(b, "a", pa->name);
+	blobmsg_add_string(b, "b", pb->name);
+	blobmsg_add_u32(b, "count", p->cnt);
+	blobmsg_add_u32(b, "lost", p->lost);
+
+	if (p->cnt > 0) {
+		for (unsigned int i = 0; i < p->cnt; i++) {
+			diffs[i] = p->diff[i];
+			sum += p->diff[i];
+			sum_sq += (double)p->diff[i] * p->diff[i];
+			if (p->diff[i] < 0) {
+				faster++;
+			}
+		}
+		qsort(diffs, p->cnt, sizeof(diffs[0]), compare_cmp_int);
+
+		double mean = sum / p->cnt;
+		double var = sum_sq / p->cnt - mean * mean;
+		blobmsg_add_double(b, "mean", mean);
+		blobmsg_add_double(b, "stddev", var > 0 ? sqrt(var) : 0);
+		blobmsg_add_u32(b, "p10", diffs[(p->cnt - 1) * 10 / 100]);
+		blobmsg_add_u32(b, "p50", diffs[(p->cnt - 1) * 50 / 100]);
+		blobmsg_add_u32(b, "p90", diffs[(p->cnt - 1) * 90 / 100]);
+		blobmsg_add_u32(b, "a_faster", faster * 100 / p->cnt);
+	}
+	blobmsg_close_table(b, tbl);
+}
+
+/* add RTT difference statistics of all groups to ubus reply */
+void compare_blob(struct blob_buf* b)
+{
+	struct compare_group* g;
+
+	list_for_each_entry(g, &groups, list) {
+		void* grp = blobmsg_open_table(b, g->name);
+		void* arr = blobmsg_open_array(b, "members");
+		for (int i = 0; i < COMPARE_MAX_MEMBERS; i++) {
+			if (g->members[i] != NULL) {
+				blobmsg_add_string(b, NULL, g->members[i]->name);
+			}
+		}
+		blobmsg_close_array(b, arr);
+
+		arr = blobmsg_open_array(b, "pairs");
+		for (int i = 0; i < COMPARE_MAX_MEMBERS; i++) {
+			for (int j = i + 1; j < COMPARE_MAX_MEMBERS; j++) {
+				if (g->members[i] != NULL && g->members[j] != NULL) {
+					compare_pair_blob(b, g->members[i], g->members[j],
+									  &g->pairs[compare_pair_idx(i, j)]);
+				}
+			}
+		}
+		blobmsg_close_array(b, arr);
+		blobmsg_close_table(b, grp);
+	}
+}
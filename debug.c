@@ -0,0 +1,187 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "main.h"
+#include <libubox/blobmsg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Event loop health instrumentation
+ *
+ * How late timeouts fire (loop lag), how long callbacks take, I/O operations
+ * per probe and the longest stall. Collecting is just a clock read and some
+ * counters, the expensive part is only done when the ubus debug method is
+ * called.
+ */
+
+#define DEBUG_BUCKETS 7 /* 10us, 100us, 1ms, 10ms, 100ms, 1s, +Inf */
+
+struct debug_hist {
+	unsigned int cnt;
+	unsigned long long total_us;
+	unsigned int max_us;
+	unsigned int hist[DEBUG_BUCKETS];
+};
+
+static struct debug_hist lag;
+static struct debug_hist cbs[__DBG_CB_MAX];
+static unsigned long io_cnt[__DBG_IO_MAX];
+static unsigned long err_cnt[__DBG_ERR_MAX];
+
+static struct {
+	unsigned int us;
+	char cause[MAX_HOSTNAME_LEN + 16];
+	time_t time;
+} stall;
+
+static const char* cb_names[__DBG_CB_MAX] = {
+	[DBG_CB_SEND] = "send",		  [DBG_CB_RECV] = "receive",
+	[DBG_CB_RESOLVE] = "resolve", [DBG_CB_UBUS] = "ubus",
+	[DBG_CB_SCRIPT] = "script",
+};
+
+static const char* io_names[__DBG_IO_MAX] = {
+	[DBG_IO_PROBE] = "probes",	 [DBG_IO_SEND] = "send",
+	[DBG_IO_RECV] = "receive",	 [DBG_IO_CONNECT] = "connect",
+	[DBG_IO_RESOLVE] = "resolve", [DBG_IO_FORK] = "fork",
+};
+
+const char* debug_err_names[__DBG_ERR_MAX] = {
+	[DBG_ERR_SEND] = "send",
+	[DBG_ERR_RECV] = "receive",
+	[DBG_ERR_CONNECT] = "connect",
+	[DBG_ERR_UNKNOWN_ID] = "unknown_id",
+};
+
+static long long debug_now_us(void)
+{
+	struct timespec ts;
+	/* always the real clock, this measures the real loop */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void debug_hist_add(struct debug_hist* h, long long us)
+{
+	int i = 0;
+	long long bound = 10;
+
+	if (us < 0) {
+		us = 0;
+	}
+	while (i < DEBUG_BUCKETS - 1 && us > bound) {
+		bound *= 10;
+		i++;
+	}
+	h->hist[i]++;
+	h->cnt++;
+	h->total_us += us;
+	if (us > h->max_us) {
+		h->max_us = us;
+	}
+}
+
+/* call first in uloop timeout callbacks */
+void debug_timeout_lag(struct uloop_timeout* t)
+{
+	/* uloop keeps the deadline in monotonic time */
+	long long deadline = (long long)t->time.tv_sec * 1000000 + t->time.tv_usec;
+	debug_hist_add(&lag, debug_now_us() - deadline);
+}
+
+void debug_cb_start(long long* start)
+{
+	*start = debug_now_us();
+}
+
+/* name is the interface or host the callback was working on, for stalls */
+void debug_cb_end(enum debug_cb cb, long long start, const char* name)
+{
+	long long us = debug_now_us() - start;
+
+	debug_hist_add(&cbs[cb], us);
+	if (us > stall.us) {
+		stall.us = us;
+		stall.time = time(NULL);
+		snprintf(stall.cause, sizeof(stall.cause), "%s %s", cb_names[cb],
+				 name != NULL ? name : "");
+	}
+}
+
+void debug_io(enum debug_io io)
+{
+	io_cnt[io]++;
+}
+
+/* per packet errors are counted instead of logged, also from workers */
+void debug_error(enum debug_err err)
+{
+	__atomic_fetch_add(&err_cnt[err], 1, __ATOMIC_RELAXED);
+}
+
+unsigned long debug_error_count(enum debug_err err)
+{
+	return __atomic_load_n(&err_cnt[err], __ATOMIC_RELAXED);
+}
+
+static void debug_hist_blob(struct blob_buf* b, const char* name,
+							struct debug_hist* h)
+{
+	void* tbl = blobmsg_open_table(b, name);
+	blobmsg_add_u32(b, "count", h->cnt);
+	blobmsg_add_u32(b, "avg_us", h->cnt > 0 ? h->total_us / h->cnt : 0);
+	blobmsg_add_u32(b, "max_us", h->max_us);
+	void* arr = blobmsg_open_array(b, "histogram");
+	for (int i = 0; i < DEBUG_BUCKETS; i++) {
+		blobmsg_add_u32(b, NULL, h->hist[i]);
+	}
+	blobmsg_close_array(b, arr);
+	blobmsg_close_table(b, tbl);
+}
+
+/* add all debug information to ubus reply */
+void debug_blob(struct blob_buf* b)
+{
+	debug_hist_blob(b, "loop_lag", &lag);
+
+	void* tbl = blobmsg_open_table(b, "callbacks");
+	for (int i = 0; i < __DBG_CB_MAX; i++) {
+		debug_hist_blob(b, cb_names[i], &cbs[i]);
+	}
+	blobmsg_close_table(b, tbl);
+
+	tbl = blobmsg_open_table(b, "per_probe");
+	blobmsg_add_u64(b, io_names[DBG_IO_PROBE], io_cnt[DBG_IO_PROBE]);
+	for (int i = DBG_IO_PROBE + 1; i < __DBG_IO_MAX; i++) {
+		blobmsg_add_double(b, io_names[i],
+						   io_cnt[DBG_IO_PROBE] > 0
+							   ? (double)io_cnt[i] / io_cnt[DBG_IO_PROBE]
+							   : 0);
+	}
+	blobmsg_close_table(b, tbl);
+
+	tbl = blobmsg_open_table(b, "errors");
+	for (int i = 0; i < __DBG_ERR_MAX; i++) {
+		blobmsg_add_u64(b, debug_err_names[i], debug_error_count(i));
+	}
+	blobmsg_close_table(b, tbl);
+
+	tbl = blobmsg_open_table(b, "longest_stall");
+	blobmsg_add_u32(b, "duration_us", stall.us);
+	blobmsg_add_string(b, "cause", stall.cause);
+	blobmsg_add_u64(b, "time", stall.time);
+	blobmsg_close_table(b, tbl);
+}
@@ -0,0 +1,199 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "log.h"
+#include "main.h"
+
+/* keep libc includes before linux headers for musl compatibility */
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Gateway probing
+ *
+ * Besides the (slow) probes to the configured host, ping the gateway of the
+ * default route of the interface at a high rate from a separate socket. When
+ * the gateway stops answering, the local link is broken and the interface
+ * goes OFFLINE right away, without waiting for the timeout of the host.
+ *
+ * Only a gateway which has answered can fail, so gateways which don't answer
+ * ping at all are ignored. After a failure, replies of the host don't make
+ * the interface ONLINE again until the gateway answers, otherwise a gateway
+ * which rate limits ICMP would make it flap. If the host answers more than a
+ * timeout after the failure and the gateway still doesn't, the gateway is
+ * ignored until it answers again.
+ */
+
+static void gateway_send_cb(struct uloop_timeout* t)
+{
+	struct ping_intf* pi
+		= container_of(t, struct ping_intf, gateway.timeout_send);
+	struct gateway_state* gw = &pi->gateway;
+
+	debug_timeout_lag(t);
+	uloop_timeout_set(t, pi->conf_gw_interval);
+	if (!budget_allow(pi)) {
+		/* the gateway timeout must not fire either */
+		uloop_timeout_cancel(&gw->timeout_down);
+		return;
+	}
+
+	/* the gateway may have changed, e.g. after DHCP */
+	uint32_t addr = netlink_default_gateway(pi->device);
+	if (addr == 0) {
+		return;
+	}
+	if (addr != gw->addr) {
+		struct in_addr in = {.s_addr = addr};
+		LOG_INF("Probing gateway %s of '%s'", inet_ntoa(in), pi->name);
+		gw->addr = addr;
+	}
+
+	if (gw->reply_pending && gw->up && pi->state != DOWN) {
+		/* lost a probe, find out where the problem is before the gateway
+		 * timeout makes the interface OFFLINE */
+		trace_start(pi);
+	}
+	if (probe_io->icmp_echo_send(gw->ufd.fd, gw->addr, gw->cnt_sent)) {
+		gw->reply_pending = true;
+		gw->cnt_sent++;
+		clock_now(CLOCK_MONOTONIC, &gw->time_sent);
+		budget_icmp(pi);
+	}
+}
+
+static void gateway_down_cb(struct uloop_timeout* t)
+{
+	struct ping_intf* pi
+		= container_of(t, struct ping_intf, gateway.timeout_down);
+	struct gateway_state* gw = &pi->gateway;
+	struct in_addr in = {.s_addr = gw->addr};
+
+	debug_timeout_lag(t);
+	gw->up = false;
+	gw->cnt_fail++;
+	LOG_NOTI("Gateway %s of '%s' not answering", inet_ntoa(in), pi->name);
+
+	if (pi->state != DOWN) {
+		gw->failed = true;
+		gw->host_ok = false;
+		clock_now(CLOCK_MONOTONIC, &gw->time_failed);
+		trace_start(pi);
+		state_change(OFFLINE, pi);
+	}
+}
+
+static void gateway_fd_cb(struct uloop_fd* fd,
+						  __attribute__((unused)) unsigned int events)
+{
+	struct ping_intf* pi = container_of(fd, struct ping_intf, gateway.ufd);
+	struct gateway_state* gw = &pi->gateway;
+	struct timespec now;
+
+	/* raw sockets get all ICMP, also replies to the other sockets */
+	if (probe_io->icmp_echo_receive(fd->fd) != fd->fd) {
+		return;
+	}
+
+	budget_icmp(pi);
+	clock_now(CLOCK_MONOTONIC, &now);
+	gw->last_rtt = timespec_diff_ms(gw->time_sent, now);
+	gw->reply_pending = false;
+	if (!gw->up) {
+		LOG_INF("Gateway of '%s' answering", pi->name);
+		gw->up = true;
+	}
+	if (gw->failed) {
+		gw->failed = false;
+		if (gw->host_ok && pi->state == OFFLINE) {
+			/* the host answered meanwhile */
+			state_change(slo_state(pi), pi);
+		}
+	}
+	uloop_timeout_set(&gw->timeout_down, pi->conf_gw_timeout);
+}
+
+void gateway_start(struct ping_intf* pi)
+{
+	struct gateway_state* gw = &pi->gateway;
+
+	if (pi->conf_gw_interval <= 0 || gw->ufd.fd > 0) {
+		return;
+	}
+	if (pi->device[0] == '\0') {
+		LOG_ERR("No device for gateway probing on '%s'", pi->name);
+		return;
+	}
+
+	int fd = probe_io->icmp_init(pi->device);
+	if (fd < 0) {
+		return;
+	}
+	gw->ufd.fd = fd;
+	gw->ufd.cb = gateway_fd_cb;
+	if (uloop_fd_add(&gw->ufd, ULOOP_READ) < 0) {
+		LOG_ERR("Could not add uloop fd %d for '%s'", fd, pi->name);
+		close(fd);
+		gw->ufd.fd = 0;
+		return;
+	}
+
+	gw->addr = 0;
+	gw->up = false;
+	gw->reply_pending = false;
+	gw->failed = false;
+	gw->timeout_send.cb = gateway_send_cb;
+	gw->timeout_down.cb = gateway_down_cb;
+	uloop_timeout_set(&gw->timeout_send, 0);
+}
+
+void gateway_stop(struct ping_intf* pi)
+{
+	struct gateway_state* gw = &pi->gateway;
+
+	uloop_timeout_cancel(&gw->timeout_send);
+	uloop_timeout_cancel(&gw->timeout_down);
+	if (gw->ufd.fd > 0) {
+		uloop_fd_delete(&gw->ufd);
+		close(gw->ufd.fd);
+		gw->ufd.fd = 0;
+	}
+	gw->up = false;
+	gw->failed = false;
+}
+
+/* called for replies of the host: true while they must not end the OFFLINE
+ * state the failed gateway caused */
+bool gateway_failed(struct ping_intf* pi)
+{
+	struct gateway_state* gw = &pi->gateway;
+	struct timespec now;
+
+	if (!gw->failed) {
+		return false;
+	}
+	clock_now(CLOCK_MONOTONIC, &now);
+	if (timespec_diff_ms(gw->time_failed, now) > pi->conf_timeout) {
+		LOG_NOTI("Gateway of '%s' still not answering but host is, "
+				 "ignoring it",
+				 pi->name);
+		gw->failed = false;
+		return false;
+	}
+	gw->host_ok = true;
+	return true;
+}
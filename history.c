@@ -0,0 +1,240 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "history.h"
+#include "log.h"
+#include "main.h"
+#include <endian.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Append-only log of probe results and state changes, see history.h for the
+ * format. Records are collected in memory and written in batches, either
+ * when the batch is full or by a periodic flush, to reduce flash wear.
+ */
+
+#define HISTORY_BATCH 512 /* records, 4kB */
+
+static int fd = -1;
+static const char* path;
+static off_t file_size;
+static unsigned long max_size; /* in bytes */
+static int flush_interval;	   /* in sec */
+
+static struct history_header hdr;
+static bool hdr_dirty;
+
+static struct history_record batch[HISTORY_BATCH];
+static int batch_len;
+
+/* time of the last record in ms, 0 when the next one needs a HIST_BASE */
+static uint64_t last_time;
+
+static struct uloop_timeout timeout_flush;
+
+static uint64_t history_now(void)
+{
+	struct timespec ts;
+	clock_now(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool history_open(void)
+{
+	struct history_header old;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		LOG_ERR("History: could not open '%s'", path);
+		return false;
+	}
+
+	/* continue an existing file if it's valid, keeping its name table */
+	file_size = lseek(fd, 0, SEEK_END);
+	if (file_size >= (off_t)sizeof(old)
+		&& pread(fd, &old, sizeof(old), 0) == sizeof(old)
+		&& le32toh(old.magic) == HISTORY_MAGIC
+		&& le16toh(old.version) == HISTORY_VERSION) {
+		/* drop incomplete record at the end, e.g. after power loss */
+		file_size -= (file_size - sizeof(old)) % sizeof(struct history_record);
+		memcpy(hdr.names, old.names, sizeof(hdr.names));
+		hdr.time_start = old.time_start;
+		hdr_dirty = false;
+	} else {
+		hdr.time_start = htole64(history_now());
+		file_size = sizeof(hdr);
+		hdr_dirty = true;
+	}
+
+	hdr.magic = htole32(HISTORY_MAGIC);
+	hdr.version = htole16(HISTORY_VERSION);
+	hdr.record_size = htole16(sizeof(struct history_record));
+	last_time = 0;
+	return true;
+}
+
+/* keep one old file, the report tool can read both */
+static void history_rotate(void)
+{
+	char old[MAX_HOSTNAME_LEN + 3];
+
+	LOG_INF("History: rotating '%s'", path);
+	close(fd);
+	snprintf(old, sizeof(old), "%s.1", path);
+	rename(path, old);
+
+	/* new file keeps the name table so the interface indices stay valid */
+	history_open();
+}
+
+static void history_flush(void)
+{
+	if (fd < 0) {
+		return;
+	}
+
+	size_t len = batch_len * sizeof(struct history_record);
+
+	if (hdr_dirty) {
+		if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+			LOG_ERR("History: could not write header");
+			return;
+		}
+		hdr_dirty = false;
+	}
+
+	if (len > 0) {
+		ssize_t ret = pwrite(fd, batch, len, file_size);
+		if (ret != (ssize_t)len) {
+			LOG_ERR("History: write failed");
+			/* next write continues at a record boundary */
+			last_time = 0;
+		} else {
+			file_size += len;
+		}
+	}
+	batch_len = 0;
+
+	/* rotate when the next full batch would not fit anymore */
+	if (file_size + sizeof(batch) > max_size) {
+		history_rotate();
+	}
+}
+
+static void history_append(uint32_t time_delta, int intf,
+						   enum history_type type, uint16_t value)
+{
+	struct history_record* r = &batch[batch_len++];
+	r->time_delta = htole32(time_delta);
+	r->intf = intf;
+	r->type = type;
+	r->value = htole16(value);
+}
+
+/* returns index in name table, adding the interface if necessary */
+static int history_intf_index(struct ping_intf* pi)
+{
+	if (pi->hist_idx > 0) {
+		return pi->hist_idx - 1;
+	}
+
+	for (int i = 0; i < HISTORY_MAX_NAMES; i++) {
+		if (hdr.names[i][0] == '\0') {
+			strncpy(hdr.names[i], pi->name, HISTORY_NAME_LEN - 1);
+			hdr_dirty = true;
+		}
+		if (strncmp(hdr.names[i], pi->name, HISTORY_NAME_LEN - 1) == 0) {
+			pi->hist_idx = i + 1;
+			return i;
+		}
+	}
+
+	LOG_ERR("History: no space for interface '%s'", pi->name);
+	return -1;
+}
+
+static void history_write(int idx, enum history_type type,
+						  unsigned int value)
+{
+	/* make room for up to two records before deciding on HIST_BASE, as
+	 * flushing can start a new file */
+	if (batch_len >= HISTORY_BATCH - 1) {
+		history_flush();
+	}
+
+	uint64_t now = history_now();
+	if (last_time == 0 || now < last_time || now - last_time > UINT32_MAX) {
+		history_append(now >> 16, 0, HIST_BASE, now & 0xffff);
+		last_time = now;
+	}
+
+	history_append(now - last_time, idx, type,
+				   value > UINT16_MAX ? UINT16_MAX : value);
+	last_time = now;
+}
+
+void history_add(struct ping_intf* pi, enum history_type type,
+				 unsigned int value)
+{
+	if (fd < 0) {
+		return;
+	}
+
+	int idx = history_intf_index(pi);
+	if (idx >= 0) {
+		history_write(idx, type, value);
+	}
+}
+
+/* uloop timeout callback for writing out collected records */
+static void uto_flush_cb(struct uloop_timeout* t)
+{
+	history_flush();
+	uloop_timeout_set(t, flush_interval * 1000);
+}
+
+bool history_init(const char* file, int size_kb, int flush_sec)
+{
+	path = file;
+	max_size = (unsigned long)(size_kb > 0 ? size_kb : 1024) * 1024;
+	flush_interval = flush_sec > 0 ? flush_sec : 300;
+
+	if (!history_open()) {
+		return false;
+	}
+	/* the time since the last record is a gap in the history */
+	history_write(0, HIST_START, 0);
+
+	timeout_flush.cb = uto_flush_cb;
+	uloop_timeout_set(&timeout_flush, flush_interval * 1000);
+
+	LOG_INF("History: writing to '%s'", path);
+	return true;
+}
+
+void history_finish(void)
+{
+	if (fd < 0) {
+		return;
+	}
+	uloop_timeout_cancel(&timeout_flush);
+	history_flush();
+	close(fd);
+	fd = -1;
+}
@@ -0,0 +1,63 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef _PINGCHECK_HISTORY_H
+#define _PINGCHECK_HISTORY_H
+
+#include <stdint.h>
+
+/*
+ * On-disk format of the probe history, shared by the daemon and
+ * pingcheck-report. All values are little endian.
+ *
+ * The file starts with a header containing the interface name table,
+ * followed by fixed size records. The time of each record is stored as the
+ * difference in ms to the previous record. A HIST_BASE record sets the
+ * absolute time, it is written as the first record after opening the file
+ * and whenever the difference does not fit or the clock went backwards.
+ *
+ * A HIST_START record is written each time pingcheck starts. The time since
+ * the record before it is time pingcheck was not running, so the states of
+ * all interfaces are unknown from then on, until they change again.
+ */
+
+#define HISTORY_MAGIC	  0x4b484350 /* "PCHK" */
+#define HISTORY_VERSION	  1
+#define HISTORY_MAX_NAMES 32
+#define HISTORY_NAME_LEN  16
+
+struct history_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint64_t time_start; /* unix time in ms when file was created */
+	char names[HISTORY_MAX_NAMES][HISTORY_NAME_LEN];
+} __attribute__((packed));
+
+enum history_type {
+	HIST_BASE,	/* absolute time in ms: time_delta << 16 | value */
+	HIST_SENT,	/* probe sent */
+	HIST_REPLY, /* reply received, value is RTT in ms */
+	HIST_STATE, /* state change, value is enum online_state */
+	HIST_START, /* pingcheck started, intf and value are not used */
+};
+
+struct history_record {
+	uint32_t time_delta; /* ms since previous record */
+	uint8_t intf;		 /* index into names of header */
+	uint8_t type;		 /* enum history_type */
+	uint16_t value;
+} __attribute__((packed));
+
+#endif
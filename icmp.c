@@ -12,15 +12,18 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
+#include "log.h"
 #include "main.h"
 
 /* keep libc includes before linux headers for musl compatibility */
 #include <netinet/in.h>
 
-#include <err.h>
+#include <errno.h>
+#include <linux/filter.h>
 #include <linux/icmp.h>
 #include <linux/if.h>
 #include <linux/ip.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -29,7 +32,7 @@
 static int pid = -1;
 
 /* standard 1s complement checksum */
-static unsigned short checksum(void* b, int len)
+unsigned short icmp_checksum(void* b, int len)
 {
 	unsigned short* buf = b;
 	unsigned int sum = 0;
@@ -54,20 +57,21 @@ int icmp_init(const char* ifname)
 
 	int fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
 	if (fd == -1) {
-		warn("Could not open socket");
+		LOG_ERR("Could not open ICMP socket: %s", strerror(errno));
 		return -1;
 	}
 
 	if (ifname != NULL) {
 		if (strlen(ifname) >= IFNAMSIZ) {
-			fprintf(stderr, "icmp_init: ifname too long");
+			LOG_ERR("icmp_init: ifname too long");
+			close(fd);
 			return -1;
 		}
 		struct ifreq ifr;
 		strncpy(ifr.ifr_name, ifname, IFNAMSIZ);
 		ret = setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, &ifr, sizeof(ifr));
 		if (ret < 0) {
-			warn("Could not bind to '%s'", ifname);
+			LOG_ERR("Could not bind to '%s': %s", ifname, strerror(errno));
 			close(fd);
 			return -1;
 		}
@@ -75,6 +79,27 @@ int icmp_init(const char* ifname)
 	return fd;
 }
 
+/* echo id of requests sent from socket fd, in network byte order. worker
+ * threads use ids from ICMP_ID_WORKER up instead of socket fds */
+uint16_t icmp_echo_id(int fd)
+{
+	return htons(pid + fd);
+}
+
+/* write echo request for socket fd into buf, returns its length */
+int icmp_echo_build(char* buf, int fd, int cnt)
+{
+	struct icmphdr* icmp = (struct icmphdr*)buf;
+
+	icmp->type = ICMP_ECHO;
+	icmp->code = 0;
+	icmp->un.echo.id = icmp_echo_id(fd);
+	icmp->un.echo.sequence = htons(cnt);
+	icmp->checksum = 0;
+	icmp->checksum = icmp_checksum(buf, sizeof(struct icmphdr));
+	return sizeof(struct icmphdr);
+}
+
 bool icmp_echo_send(int fd, int dst_ip, int cnt)
 {
 	char buf[500];
@@ -85,19 +110,52 @@ bool icmp_echo_send(int fd, int dst_ip, int cnt)
 	addr.sin_port = 0;
 	addr.sin_addr.s_addr = dst_ip;
 
-	struct icmphdr* icmp = (struct icmphdr*)buf;
+	int len = icmp_echo_build(buf, fd, cnt);
+	ret = sendto(fd, &buf, len, 0, (struct sockaddr*)&addr, sizeof(addr));
+	if (ret <= 0) {
+		debug_error(DBG_ERR_SEND);
+		return false;
+	}
+	return true;
+}
 
-	icmp->type = ICMP_ECHO;
-	icmp->code = 0;
-	icmp->un.echo.id = htons(pid + fd);
-	icmp->un.echo.sequence = htons(cnt);
-	icmp->checksum = 0;
-	icmp->checksum = checksum(buf, sizeof(struct icmphdr));
+/* send from a socket which is not bound to a device: the outgoing device is
+ * chosen per packet by ifindex (0 for the routing table) and the echo id by
+ * id, like the socket fd in icmp_echo_send() */
+bool icmp_echo_send_ifindex(int fd, int ifindex, int id, int dst_ip, int cnt)
+{
+	char buf[500];
+	char cbuf[CMSG_SPACE(sizeof(struct in_pktinfo))];
+	struct sockaddr_in addr;
+	struct iovec iov;
+	struct msghdr msg;
 
-	ret = sendto(fd, &buf, sizeof(struct icmphdr), 0, (struct sockaddr*)&addr,
-				 sizeof(addr));
-	if (ret <= 0) {
-		warn("sendto");
+	addr.sin_family = AF_INET;
+	addr.sin_port = 0;
+	addr.sin_addr.s_addr = dst_ip;
+
+	iov.iov_base = buf;
+	iov.iov_len = icmp_echo_build(buf, id, cnt);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &addr;
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (ifindex > 0) {
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+		struct in_pktinfo* info = (struct in_pktinfo*)CMSG_DATA(cmsg);
+		info->ipi_ifindex = ifindex;
+	}
+
+	if (sendmsg(fd, &msg, 0) <= 0) {
+		debug_error(DBG_ERR_SEND);
 		return false;
 	}
 	return true;
@@ -110,21 +168,128 @@ int icmp_echo_receive(int fd)
 
 	ret = recv(fd, buf, sizeof(buf), 0);
 	if (ret < (int)(sizeof(struct icmphdr) + sizeof(struct iphdr))) {
-		warn("received packet too short");
+		debug_error(DBG_ERR_RECV);
+		return -1;
+	}
+	return icmp_echo_parse(buf, ret);
+}
+
+/* check received packet (with IP header), returns the socket fd the echo
+ * request was sent from or -1 */
+int icmp_echo_parse(char* buf, int len)
+{
+	if (len < (int)(sizeof(struct icmphdr) + sizeof(struct iphdr))) {
 		return -1;
 	}
 
 	struct iphdr* ip = (struct iphdr*)buf;
+	if (ip->ihl * 4 + (int)sizeof(struct icmphdr) > len) {
+		return -1;
+	}
 	struct icmphdr* icmp = (struct icmphdr*)(buf + ip->ihl * 4);
 
 	int csum_recv = icmp->checksum;
 	icmp->checksum = 0; // need to zero before calculating checksum
-	int csum_calc = checksum(icmp, sizeof(struct icmphdr));
-	int received_fd = ntohs(icmp->un.echo.id) - pid;
+	int csum_calc = icmp_checksum(icmp, sizeof(struct icmphdr));
+	/* the id is 16 bit, pid + fd may have wrapped */
+	int received_fd = (ntohs(icmp->un.echo.id) - pid) & 0xffff;
 	if (csum_recv == csum_calc &&		// checksum correct
-		icmp->type == ICMP_ECHOREPLY && // correct type
-		received_fd >= 0) {				// handle could be valid
+		icmp->type == ICMP_ECHOREPLY) { // correct type
 		return received_fd;
 	}
 	return -1;
 }
+
+/* let the kernel pass only echo replies with the ids id to id + num - 1 (like
+ * fds, see icmp_echo_id()) to the socket, so that it doesn't receive the
+ * replies of all other sockets */
+bool icmp_filter_echo_ids(int fd, int id, int num)
+{
+	/* (echo id - first) & 0xffff < num, the ids may wrap */
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0), /* X = IP header length */
+		BPF_STMT(BPF_LD | BPF_B | BPF_IND, offsetof(struct icmphdr, type)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 0, 5),
+		BPF_STMT(BPF_LD | BPF_H | BPF_IND, offsetof(struct icmphdr, un)),
+		BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, ntohs(icmp_echo_id(id))),
+		BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xffff),
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, num, 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = {.len = ARRAY_SIZE(code), .filter = code};
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		LOG_ERR("Could not attach ICMP filter: %s", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool icmp_set_ttl(int fd, int ttl)
+{
+	return setsockopt(fd, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl)) == 0;
+}
+
+/* receive one answer to a trace probe sent from socket fd, see
+ * icmp_trace_parse(). returns 0 for other packets, -1 when there are no
+ * more */
+int icmp_trace_receive(int fd, unsigned int* from, bool* reached)
+{
+	char buf[500];
+
+	int len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (len <= 0) {
+		return -1;
+	}
+	int ttl = icmp_trace_parse(buf, len, fd, from, reached);
+	return ttl > 0 ? ttl : 0;
+}
+
+/* check received packet (with IP header) for an answer to a probe sent with
+ * limited TTL from socket fd: time exceeded from a router on the way or echo
+ * reply from the target (reached). returns the sequence number of the probe
+ * and the address which answered in from, or -1 */
+int icmp_trace_parse(char* buf, int len, int fd, unsigned int* from,
+					 bool* reached)
+{
+	if (len < (int)(sizeof(struct icmphdr) + sizeof(struct iphdr))) {
+		return -1;
+	}
+
+	struct iphdr* ip = (struct iphdr*)buf;
+	int off = ip->ihl * 4;
+	if (off + (int)sizeof(struct icmphdr) > len) {
+		return -1;
+	}
+	struct icmphdr* icmp = (struct icmphdr*)(buf + off);
+
+	if (icmp->type == ICMP_TIME_EXCEEDED) {
+		/* contains IP header and the first 8 bytes of our echo request */
+		off += sizeof(struct icmphdr);
+		if (off + (int)sizeof(struct iphdr) > len) {
+			return -1;
+		}
+		struct iphdr* inner_ip = (struct iphdr*)(buf + off);
+		off += inner_ip->ihl * 4;
+		if (inner_ip->protocol != IPPROTO_ICMP
+			|| off + (int)sizeof(struct icmphdr) > len) {
+			return -1;
+		}
+		icmp = (struct icmphdr*)(buf + off);
+		if (icmp->type != ICMP_ECHO) {
+			return -1;
+		}
+		*reached = false;
+	} else if (icmp->type == ICMP_ECHOREPLY) {
+		*reached = true;
+	} else {
+		return -1;
+	}
+
+	if (ntohs(icmp->un.echo.id) != ((pid + fd) & 0xffff)) {
+		return -1;
+	}
+	*from = ip->saddr;
+	return ntohs(icmp->un.echo.sequence);
+}
@@ -1,26 +1,235 @@
+#include <libubox/uloop.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <syslog.h>
+#include <time.h>
 
 #include "log.h"
 
+/*
+ * Messages are formatted into a ring buffer and written to syslog and stdout
+ * in batches from the event loop, so logging never blocks the caller on a
+ * slow syslog socket. Only when the ring is full, e.g. at startup with many
+ * interfaces, it is written out right away.
+ *
+ * Identical messages from one call site (its format string and a hash of the
+ * formatted message) share a token bucket, messages above the rate are
+ * counted and summarized instead. Errors are never limited.
+ *
+ * Not thread safe, only log from the main thread.
+ */
+
+#define LOG_RING_SIZE 64 /* power of 2 */
+#define LOG_MSG_LEN	  256
+#define LOG_SITES	  128 /* power of 2 */
+#define LOG_SITE_LEN  80  /* of the message in the summary */
+#define LOG_BURST	  10
+#define LOG_REFILL_MS 1000 /* one message per second after the burst */
+#define LOG_SWEEP_MS  10000
+
+struct log_rec {
+	enum loglevel level;
+	char msg[LOG_MSG_LEN];
+};
+
+struct log_site {
+	const char* format;
+	uint32_t hash; /* of the message */
+	char msg[LOG_SITE_LEN];
+	enum loglevel level;
+	unsigned int tokens;
+	long long last_ms;
+	unsigned int suppressed;
+};
+
+static struct log_rec ring[LOG_RING_SIZE];
+static unsigned int ring_head;
+static unsigned int ring_tail;
+
+static struct log_site sites[LOG_SITES];
+static bool sites_suppressed;
+static bool log_direct; /* in a forked child, which has no event loop */
+
+static struct uloop_timeout timeout_flush;
+static struct uloop_timeout timeout_sweep;
+
+static long long log_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void log_write(enum loglevel level, const char* msg)
+{
+	if (level <= LOG_NOTICE) {
+		syslog(level, "%s", msg);
+	}
+	if (level <= LOG_INFO) {
+		printf("%s\n", msg);
+	}
+}
+
+static void log_flush(void)
+{
+	while (ring_tail != ring_head) {
+		struct log_rec* r = &ring[ring_tail & (LOG_RING_SIZE - 1)];
+		log_write(r->level, r->msg);
+		ring_tail++;
+	}
+	fflush(stdout);
+}
+
+static void log_flush_cb(__attribute__((unused)) struct uloop_timeout* t)
+{
+	log_flush();
+}
+
+static struct log_rec* log_rec_new(enum loglevel level)
+{
+	if (ring_head - ring_tail >= LOG_RING_SIZE) {
+		log_flush(); /* rather block than lose messages */
+	}
+	struct log_rec* r = &ring[ring_head & (LOG_RING_SIZE - 1)];
+	r->level = level;
+	ring_head++;
+
+	if (!timeout_flush.pending) {
+		timeout_flush.cb = log_flush_cb;
+		uloop_timeout_set(&timeout_flush, 0);
+	}
+	return r;
+}
+
+static void log_summary(struct log_site* s)
+{
+	struct log_rec* r = log_rec_new(s->level);
+	snprintf(r->msg, sizeof(r->msg), "%u messages suppressed: %s",
+			 s->suppressed, s->msg);
+	s->suppressed = 0;
+}
+
+/* write summaries for call sites which have been quiet for a while */
+static void log_sweep_cb(__attribute__((unused)) struct uloop_timeout* t)
+{
+	long long now = log_now_ms();
+	bool pending = false;
+
+	for (int i = 0; i < LOG_SITES; i++) {
+		struct log_site* s = &sites[i];
+		if (s->suppressed == 0) {
+			continue;
+		}
+		if (now - s->last_ms >= LOG_SWEEP_MS) {
+			log_summary(s);
+		} else {
+			pending = true;
+		}
+	}
+	sites_suppressed = pending;
+	if (pending) {
+		uloop_timeout_set(&timeout_sweep, LOG_SWEEP_MS);
+	}
+}
+
+/* FNV-1a */
+static uint32_t log_hash(const char* msg)
+{
+	uint32_t h = 2166136261u;
+	while (*msg != '\0') {
+		h = (h ^ (unsigned char)*msg++) * 16777619u;
+	}
+	return h;
+}
+
+/* token bucket per call site and message, returns false if the message
+ * should be dropped */
+static bool log_ratelimit(enum loglevel level, const char* format,
+						  const char* msg)
+{
+	uint32_t hash = log_hash(msg);
+	unsigned int h = (hash ^ ((uintptr_t)format >> 3)) & (LOG_SITES - 1);
+	long long now = log_now_ms();
+	struct log_site* s = NULL;
+
+	for (int i = 0; i < LOG_SITES; i++) {
+		struct log_site* c = &sites[(h + i) & (LOG_SITES - 1)];
+		if (c->format == format && c->hash == hash) {
+			s = c;
+			break;
+		}
+		/* a site with a full bucket again can be reused */
+		if (s == NULL
+			&& (c->format == NULL
+				|| (c->suppressed == 0
+					&& now - c->last_ms >= LOG_BURST * LOG_REFILL_MS))) {
+			s = c;
+		}
+		if (c->format == NULL) {
+			break;
+		}
+	}
+	if (s == NULL) {
+		return true; /* table full, don't limit */
+	}
+
+	if (s->format != format || s->hash != hash) {
+		s->format = format;
+		s->hash = hash;
+		snprintf(s->msg, sizeof(s->msg), "%s", msg);
+		s->level = level;
+		s->tokens = LOG_BURST;
+		s->last_ms = now;
+	} else if (now - s->last_ms >= LOG_REFILL_MS) {
+		unsigned int refill = (now - s->last_ms) / LOG_REFILL_MS;
+		s->tokens = s->tokens + refill > LOG_BURST ? LOG_BURST
+												   : s->tokens + refill;
+		s->last_ms += (long long)refill * LOG_REFILL_MS;
+	}
+
+	if (s->tokens == 0) {
+		s->suppressed++;
+		if (!sites_suppressed) {
+			sites_suppressed = true;
+			timeout_sweep.cb = log_sweep_cb;
+			uloop_timeout_set(&timeout_sweep, LOG_SWEEP_MS);
+		}
+		return false;
+	}
+
+	s->tokens--;
+	if (s->suppressed > 0) {
+		log_summary(s);
+	}
+	return true;
+}
+
 void __attribute__((format(printf, 2, 3)))
 log_out(enum loglevel level, const char* format, ...)
 {
+	char msg[LOG_MSG_LEN];
 	va_list args;
 
-	if (level <= LOG_NOTICE) {
-		va_start(args, format);
-		vsyslog(level, format, args);
-		va_end(args);
+	if (level > LOG_INFO) {
+		return;
+	}
+	va_start(args, format);
+	vsnprintf(msg, sizeof(msg), format, args);
+	va_end(args);
+	if (level > LL_ERR && !log_ratelimit(level, format, msg)) {
+		return;
 	}
 
-	if (level <= LOG_INFO) {
-		va_start(args, format);
-		vprintf(format, args);
-		printf("\n");
-		va_end(args);
+	if (log_direct) {
+		log_write(level, msg);
+		fflush(stdout);
+		return;
 	}
+
+	struct log_rec* r = log_rec_new(level);
+	memcpy(r->msg, msg, strlen(msg) + 1);
 }
 
 void log_open(const char* name)
@@ -28,7 +237,23 @@ void log_open(const char* name)
 	openlog(name, LOG_PID | LOG_CONS, LOG_DAEMON);
 }
 
+/* call in a child process after fork: the parent writes the messages which
+ * were still queued, the child writes its own ones right away */
+void log_fork_child(void)
+{
+	ring_tail = ring_head;
+	log_direct = true;
+}
+
 void log_close(void)
 {
+	uloop_timeout_cancel(&timeout_sweep);
+	for (int i = 0; i < LOG_SITES; i++) {
+		if (sites[i].suppressed > 0) {
+			log_summary(&sites[i]);
+		}
+	}
+	uloop_timeout_cancel(&timeout_flush);
+	log_flush();
 	closelog();
 }
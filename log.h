@@ -9,6 +9,7 @@ void __attribute__((format(printf, 2, 3)))
 log_out(enum loglevel, const char* fmt, ...);
 void log_open(const char* name);
 void log_close(void);
+void log_fork_child(void);
 
 #ifndef DEBUG
 #define DEBUG 0
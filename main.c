@@ -12,26 +12,45 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
+#define _GNU_SOURCE /* pipe2 */
 #include "main.h"
 #include "log.h"
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-/* main list of interfaces */
-static struct ping_intf intf[MAX_NUM_INTERFACES];
+/* main list of interfaces, sorted by name */
+static struct vlist_tree interfaces;
+
+/* the same interfaces in config order */
+LIST_HEAD(interface_list);
+
+/* global config */
+static struct ping_conf conf;
 
 /* timeout for panic scripts */
 static struct uloop_timeout timeout_panic;
 
+/* pipe for handling SIGHUP in uloop */
+static int sighup_pipe[2] = {-1, -1};
+static struct uloop_fd sighup_fd;
+
+/* interfaces are only started from config updates when we are running */
+static bool running;
+
 void state_change(enum online_state state_new, struct ping_intf* pi)
 {
+	pi->provisional = false;
 	if (pi->state == state_new) { /* no change */
 		return;
 	}
 
 	pi->state = state_new;
+	pi->cnt_transitions++;
+	history_add(pi, HIST_STATE, state_new);
 
 	LOG_INF("Interface '%s' changed to %s", pi->name,
 			get_status_str(pi->state));
@@ -47,6 +66,7 @@ void state_change(enum online_state state_new, struct ping_intf* pi)
 	}
 
 	scripts_run(pi, state_new);
+	quality_state_changed(pi);
 }
 
 const char* get_status_str(enum online_state state)
@@ -64,6 +84,8 @@ const char* get_status_str(enum online_state state)
 		return "OFFLINE";
 	case ONLINE:
 		return "ONLINE";
+	case DEGRADED:
+		return "DEGRADED";
 	default:
 		return "INVALID";
 	}
@@ -71,121 +93,368 @@ const char* get_status_str(enum online_state state)
 
 enum online_state get_global_status(void)
 {
-	for (int i = 0; i < MAX_NUM_INTERFACES && intf[i].name[0]; i++) {
-		if (intf[i].state == ONLINE) {
+	struct ping_intf* pi;
+	enum online_state global = OFFLINE;
+	for_each_interface(pi) {
+		if (pi->state == ONLINE) {
 			return ONLINE;
+		} else if (pi->state == DEGRADED) {
+			global = DEGRADED;
+		}
+	}
+	return global;
+}
+
+/* called from ubus interface event */
+void notify_interface(const char* interface, const char* action)
+{
+	struct ping_intf* pi = get_interface(interface);
+	if (pi == NULL) {
+		return;
+	}
+
+	if (strcmp(action, "ifup") == 0) {
+		LOG_INF("Interface '%s' event UP", interface);
+		if (ping_init(pi) && !ping_burst(pi)) {
+			ping_send(pi);
 		}
+	} else if (strcmp(action, "ifdown") == 0) {
+		LOG_INF("Interface '%s' event DOWN", interface);
+		ping_stop(pi);
+		state_change(DOWN, pi);
 	}
-	return OFFLINE;
 }
 
-int get_online_interface_names(const char** dest, int destLen)
+/* called from netlink when the carrier of a device changes */
+void notify_device(const char* device, bool carrier)
 {
-	int j = 0;
-	for (int i = 0; i < MAX_NUM_INTERFACES && intf[i].name[0]; i++) {
-		if (intf[i].state == ONLINE && j < destLen) {
-			dest[j++] = intf[i].name;
+	struct ping_intf* pi;
+	for_each_interface(pi) {
+		const char* dev = pi->conf_ignore_ubus ? pi->conf_device : pi->device;
+		if (strcmp(dev, device) != 0) {
+			continue;
+		}
+		if (!carrier) {
+			LOG_INF("Interface '%s' (%s) lost carrier", pi->name, device);
+			ping_stop(pi);
+			state_change(DOWN, pi);
+		} else if (running && pi->state == DOWN) {
+			if (ping_init(pi) && !ping_burst(pi)) {
+				ping_send(pi);
+			}
 		}
 	}
-	return j;
 }
 
-int get_all_interface_names(const char** dest, int destLen)
+/* called from netlink when the first default route of a device appears or
+ * the last one is removed. once probes have been answered or lost the state
+ * is decided by them */
+void notify_default_route(const char* device, bool has_route)
 {
-	int i = 0;
-	for (; i < MAX_NUM_INTERFACES && !intf[i].conf_disabled && intf[i].name[0]
-		   && i < destLen;
-		 i++) {
-		dest[i] = intf[i].name;
+	struct ping_intf* pi;
+	for_each_interface(pi) {
+		const char* dev = pi->conf_ignore_ubus ? pi->conf_device : pi->device;
+		if (strcmp(dev, device) != 0) {
+			continue;
+		}
+		if (has_route && pi->state == UP_WITHOUT_DEFAULT_ROUTE) {
+			state_change(UP, pi);
+		} else if (!has_route && pi->state == UP) {
+			state_change(UP_WITHOUT_DEFAULT_ROUTE, pi);
+		}
 	}
-	return i;
 }
 
-/* called from ubus interface event */
-void notify_interface(const char* interface, const char* action)
+/* called from ubus when a requested interface status is available */
+void notify_interface_status(const char* interface)
 {
 	struct ping_intf* pi = get_interface(interface);
-	if (pi == NULL) {
+	if (pi == NULL || !pi->status_pending) {
 		return;
 	}
 
-	if (strcmp(action, "ifup") == 0) {
-		LOG_INF("Interface '%s' event UP", interface);
-		ping_init(pi);
+	pi->status_pending = false;
+	if (ping_init(pi) && !ping_burst(pi)) {
 		ping_send(pi);
-	} else if (strcmp(action, "ifdown") == 0) {
-		LOG_INF("Interface '%s' event DOWN", interface);
-		ping_stop(pi);
-		state_change(DOWN, pi);
 	}
 }
 
 struct ping_intf* get_interface_by_fd(int fd)
 {
-	struct ping_intf* pi = NULL;
+	struct ping_intf* pi;
 	/* find interface in our list */
-	for (int i = 0; i < MAX_NUM_INTERFACES && intf[i].name[0]; i++) {
-		if (intf[i].ufd.fd == fd) {
-			pi = &intf[i];
-			break;
+	for_each_interface(pi) {
+		if (pi->ufd.fd == fd) {
+			return pi;
 		}
 	}
-	return pi;
+	return NULL;
 }
 
 /* also called from ubus server_status */
 struct ping_intf* get_interface(const char* interface)
 {
-	struct ping_intf* pi = NULL;
-	/* find interface in our list */
-	for (int i = 0; i < MAX_NUM_INTERFACES && intf[i].name[0]; i++) {
-		if (strncmp(intf[i].name, interface, MAX_IFNAME_LEN) == 0) {
-			pi = &intf[i];
-			break;
-		}
-	}
-	return pi;
+	struct ping_intf* pi;
+	return vlist_find(&interfaces, interface, pi, node);
 }
 
 /* reset counters for all (pass NULL) or one interface */
 void reset_counters(const char* interface)
 {
-	for (int i = 0; i < MAX_NUM_INTERFACES && intf[i].name[0]; i++) {
+	struct ping_intf* pi;
+	for_each_interface(pi) {
 		if (interface == NULL
-			|| strncmp(intf[i].name, interface, MAX_IFNAME_LEN) == 0) {
-			intf[i].cnt_sent = 0;
-			intf[i].cnt_succ = 0;
-			intf[i].last_rtt = 0;
-			intf[i].max_rtt = 0;
+			|| strncmp(pi->name, interface, MAX_IFNAME_LEN) == 0) {
+			pi->cnt_sent = 0;
+			pi->cnt_succ = 0;
+			pi->last_rtt = 0;
+			pi->max_rtt = 0;
+			pi->rtt_sum = 0;
+			memset(pi->rtt_hist, 0, sizeof(pi->rtt_hist));
+			/* find out the current state quickly */
+			ping_burst(pi);
 		}
 	}
 }
 
+/*** config handling ***/
+
+/* called from UCI config for each valid and enabled interface section */
+void config_add_interface(struct ping_intf* pi)
+{
+	vlist_add(&interfaces, &pi->node, pi->name);
+}
+
+static bool intf_config_needs_restart(struct ping_intf* pi,
+									  struct ping_intf* pn)
+{
+	return pi->conf_proto != pn->conf_proto
+		   || pi->conf_tcp_port != pn->conf_tcp_port
+		   || pi->conf_ignore_ubus != pn->conf_ignore_ubus
+		   || strcmp(pi->conf_device, pn->conf_device) != 0
+		   || strcmp(pi->conf_compare, pn->conf_compare) != 0
+		   || pi->conf_gw_interval != pn->conf_gw_interval
+		   || pi->conf_gw_timeout != pn->conf_gw_timeout
+		   /* interfaces with budget don't use workers */
+		   || (pi->conf_budget == 0) != (pn->conf_budget == 0)
+		   || strcmp(pi->conf_hostname, pn->conf_hostname) != 0;
+}
+
+static bool intf_config_changed(struct ping_intf* pi, struct ping_intf* pn)
+{
+	return intf_config_needs_restart(pi, pn)
+		   || pi->conf_interval != pn->conf_interval
+		   || pi->conf_timeout != pn->conf_timeout
+		   || pi->conf_panic_timeout != pn->conf_panic_timeout
+		   || pi->conf_phi != pn->conf_phi
+		   || pi->conf_passive != pn->conf_passive
+		   || pi->conf_budget != pn->conf_budget
+		   || pi->conf_budget_packets != pn->conf_budget_packets
+		   || pi->conf_budget_month != pn->conf_budget_month
+		   || pi->conf_burst != pn->conf_burst
+		   || pi->conf_burst_interval != pn->conf_burst_interval
+		   || pi->conf_slo_loss != pn->conf_slo_loss
+		   || pi->conf_slo_latency != pn->conf_slo_latency
+		   || pi->conf_slo_jitter != pn->conf_slo_jitter
+		   || pi->conf_slo_hysteresis != pn->conf_slo_hysteresis;
+}
+
+static void intf_config_copy(struct ping_intf* pi, struct ping_intf* pn)
+{
+	pi->conf_interval = pn->conf_interval;
+	pi->conf_timeout = pn->conf_timeout;
+	if (strcmp(pi->conf_hostname, pn->conf_hostname) != 0) {
+		memcpy(pi->conf_hostname, pn->conf_hostname, MAX_HOSTNAME_LEN);
+		pi->conf_host = 0; /* resolve again */
+	}
+	pi->conf_proto = pn->conf_proto;
+	pi->conf_tcp_port = pn->conf_tcp_port;
+	pi->conf_panic_timeout = pn->conf_panic_timeout;
+	pi->conf_phi = pn->conf_phi;
+	pi->conf_passive = pn->conf_passive;
+	if (pi->conf_budget_month != pn->conf_budget_month) {
+		pi->budget.period_end = 0; /* recalculate */
+	}
+	pi->conf_budget = pn->conf_budget;
+	pi->conf_budget_packets = pn->conf_budget_packets;
+	pi->conf_budget_month = pn->conf_budget_month;
+	pi->conf_burst = pn->conf_burst;
+	pi->conf_burst_interval = pn->conf_burst_interval;
+	pi->conf_slo_loss = pn->conf_slo_loss;
+	pi->conf_slo_latency = pn->conf_slo_latency;
+	pi->conf_slo_jitter = pn->conf_slo_jitter;
+	pi->conf_slo_hysteresis = pn->conf_slo_hysteresis;
+	pi->conf_ignore_ubus = pn->conf_ignore_ubus;
+	memcpy(pi->conf_device, pn->conf_device, MAX_IFNAME_LEN);
+	memcpy(pi->conf_compare, pn->conf_compare, MAX_IFNAME_LEN);
+	pi->conf_gw_interval = pn->conf_gw_interval;
+	pi->conf_gw_timeout = pn->conf_gw_timeout;
+}
+
+/* free interface which has already been stopped */
+static void intf_free(struct ping_intf* pi)
+{
+	scripts_cancel(pi);
+	quality_remove(pi);
+	series_free(pi);
+	free(pi);
+}
+
+/*
+ * vlist update callback: keeps the old node of unchanged and changed
+ * interfaces, so their sockets, timers and statistics stay
+ */
+static void intf_update(__attribute__((unused)) struct vlist_tree* tree,
+						struct vlist_node* node_new,
+						struct vlist_node* node_old)
+{
+	struct ping_intf* pn = container_of(node_new, struct ping_intf, node);
+	struct ping_intf* pi = container_of(node_old, struct ping_intf, node);
+
+	if (node_new != NULL && node_old != NULL) {
+		/* interfaces are added in config order, keep it */
+		list_del(&pi->list);
+		list_add_tail(&pi->list, &interface_list);
+		if (intf_config_changed(pi, pn)) {
+			LOG_INF("Reconfiguring interface '%s'", pi->name);
+			bool restart = intf_config_needs_restart(pi, pn);
+			if (restart && running) {
+				ping_stop(pi);
+			}
+			intf_config_copy(pi, pn);
+			if (restart && running) {
+				ping_init(pi);
+			} else if (!restart) {
+				worker_update(pi);
+			}
+		}
+		free(pn);
+	} else if (node_new != NULL) {
+		LOG_INF("Adding interface '%s'", pn->name);
+		list_add_tail(&pn->list, &interface_list);
+		if (running) {
+			ping_init(pn);
+		}
+	} else if (node_old != NULL) {
+		LOG_INF("Removing interface '%s'", pi->name);
+		list_del(&pi->list);
+		ping_stop(pi);
+		intf_free(pi);
+	}
+}
+
+/* before the config is read */
+void intf_init(void)
+{
+	vlist_init(&interfaces, avl_strcmp, intf_update);
+	interfaces.keep_old = true;
+}
+
+/* re-read UCI config and apply the difference to the running interfaces */
+bool config_reload(void)
+{
+	struct ping_conf conf_new;
+
+	LOG_NOTI("Reloading config");
+
+	memset(&conf_new, 0, sizeof(conf_new));
+	vlist_update(&interfaces);
+	if (uci_config_pingcheck(&conf_new) < 0) {
+		/* nothing was added yet, keep all interfaces as they are */
+		LOG_ERR("Could not read UCI config");
+		return false;
+	}
+	vlist_flush(&interfaces);
+
+	if (memcmp(&conf, &conf_new, sizeof(conf)) != 0) {
+		LOG_NOTI("Global options changed, restart to apply them");
+	}
+
+	/* panic state may have changed with removed interfaces */
+	if (get_global_status() != OFFLINE) {
+		uloop_timeout_cancel(&timeout_panic);
+	}
+	return true;
+}
+
+/* SIGHUP handler, the reload itself is done from uloop */
+static void sighup_handler(__attribute__((unused)) int signo)
+{
+	char c = 0;
+	if (write(sighup_pipe[1], &c, 1) < 0) {
+		/* ignore, a reload is already pending */
+	}
+}
+
+static void sighup_fd_cb(struct uloop_fd* fd,
+						 __attribute__((unused)) unsigned int events)
+{
+	char buf[16];
+	while (read(fd->fd, buf, sizeof(buf)) > 0) {
+		/* drain */
+	}
+	config_reload();
+}
+
+static bool sighup_init(void)
+{
+	/* not inherited by scripts */
+	if (pipe2(sighup_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+		return false;
+	}
+	sighup_fd.fd = sighup_pipe[0];
+	sighup_fd.cb = sighup_fd_cb;
+	uloop_fd_add(&sighup_fd, ULOOP_READ);
+	signal(SIGHUP, sighup_handler);
+	return true;
+}
+
 /* uloop timeout callback when offline for too long */
 static void uto_panic_cb(__attribute__((unused)) struct uloop_timeout* t)
 {
 	scripts_run_panic();
 }
 
-int main(__attribute__((unused)) int argc, __attribute__((unused)) char** argv)
+int main(int argc, char** argv)
 {
 	int ret;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			uci_config_dir(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-c config_dir]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
 
 	log_open("pingcheck");
 
 	ret = uloop_init();
 	if (ret < 0) {
 		LOG_CRIT("Could not initialize uloop");
+		log_close(); /* flush the message */
 		return EXIT_FAILURE;
 	}
 
-	ret = uci_config_pingcheck(intf, MAX_NUM_INTERFACES);
+	intf_init();
+	scripts_init(); /* before any goto exit */
+
+	ret = uci_config_pingcheck(&conf) > 0;
 	if (!ret) {
 		LOG_CRIT("Could not read UCI config");
 		goto exit;
 	}
 
-	scripts_init();
+	quality_init(&conf);
+
+	/* before ping_init(), which takes over the saved state */
+	if (conf.state_file[0]) {
+		state_init(conf.state_file, conf.state_interval, conf.state_max_age);
+	}
 
 	ret = ubus_init();
 	if (!ret) {
@@ -201,36 +470,81 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char** argv)
 
 	ubus_register_server();
 
+	/* carrier and default routes from the kernel */
+	if (!netlink_init()) {
+		LOG_ERR("Could not monitor links, default routes from ubus only");
+	}
+
+	if (!sighup_init()) {
+		LOG_ERR("Could not set up SIGHUP handler");
+	}
+
+	if (conf.metrics_listen[0]) {
+		metrics_init(conf.metrics_listen);
+	}
+
+	if (conf.history_file[0]) {
+		history_init(conf.history_file, conf.history_size, conf.history_flush);
+	}
+
+	if (conf.series) {
+		series_init();
+	}
+
+	if (conf.io_uring && !uring_init()) {
+		LOG_ERR("Could not use io_uring, falling back to epoll");
+	}
+
+	if (conf.xdp && !xdp_init()) {
+		LOG_ERR("Could not use XDP, receiving replies on sockets");
+	}
+
+	if (conf.workers > 0 && !xdp_enabled() && !worker_init(conf.workers)) {
+		LOG_ERR("Could not start worker threads, probing on main thread");
+	}
+
 	/* start ping on all available interfaces */
-	for (int i = 0; i < MAX_NUM_INTERFACES && intf[i].name[0]; i++) {
-		if (!intf[i].conf_disabled) {
-			ping_init(&intf[i]);
+	struct ping_intf* pi;
+	for_each_interface(pi) {
+		if (ping_init(pi)) {
+			ping_burst(pi);
 		}
 	}
+	running = true;
 
-	/* initialize panic handler */
+	/* initialize panic handler, with the timeout of the first interface */
 	timeout_panic.cb = uto_panic_cb;
-	if (intf[0].conf_panic_timeout > 0) {
-		uloop_timeout_set(&timeout_panic,
-						  intf[0].conf_panic_timeout * 60 * 1000);
+	pi = list_empty(&interface_list)
+			 ? NULL
+			 : list_first_entry(&interface_list, struct ping_intf, list);
+	if (pi != NULL && pi->conf_panic_timeout > 0) {
+		uloop_timeout_set(&timeout_panic, pi->conf_panic_timeout * 60 * 1000);
 	}
 
 	/* main loop */
 	uloop_run();
+	state_finish();
 
 	/* print statistics and cleanup */
 	printf("\n");
-	for (int i = 0; i < MAX_NUM_INTERFACES && intf[i].name[0]; i++) {
-		if (!intf[i].conf_disabled) {
-			printf("%s:\t%-8s %3.0f%% (%d/%d on %s)\n", intf[i].name,
-				   get_status_str(intf[i].state),
-				   (float)intf[i].cnt_succ * 100 / intf[i].cnt_sent,
-				   intf[i].cnt_succ, intf[i].cnt_sent, intf[i].device);
-			ping_stop(&intf[i]);
-		}
+	for_each_interface(pi) {
+		printf("%s:\t%-8s %3.0f%% (%d/%d on %s)\n", pi->name,
+			   get_status_str(pi->state),
+			   (float)pi->cnt_succ * 100 / pi->cnt_sent, pi->cnt_succ,
+			   pi->cnt_sent, pi->device);
+		ping_stop(pi);
 	}
+	running = false;
+	vlist_flush_all(&interfaces);
+	worker_finish();
+	uring_finish();
+	xdp_finish();
+	passive_finish();
 
 exit:
+	history_finish();
+	metrics_finish();
+	netlink_finish();
 	scripts_finish();
 	uloop_done();
 	ubus_finish();
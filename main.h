@@ -12,15 +12,20 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
+#include "history.h"
 #include <libubox/runqueue.h>
 #include <libubox/uloop.h>
+#include <libubox/vlist.h>
+#include <limits.h>
 #include <stdbool.h>
 
 #define MAX_IFNAME_LEN	   256
 #define MAX_HOSTNAME_LEN   256
-#define MAX_NUM_INTERFACES 8
 #define SCRIPTS_TIMEOUT	   10	/* 10 sec */
 #define UBUS_TIMEOUT	   3000 /* 3 sec */
+#define RTT_HIST_BUCKETS   10	/* including +Inf */
+#define MIN_INTERVAL_ICMP  100	/* ms */
+#define MIN_INTERVAL_TCP   1000 /* ms, every probe is a new connection */
 
 enum online_state {
 	UNKNOWN,
@@ -28,18 +33,115 @@ enum online_state {
 	UP_WITHOUT_DEFAULT_ROUTE,
 	UP,
 	OFFLINE,
-	ONLINE
+	ONLINE,
+	DEGRADED /* answering, but not within the SLOs */
 };
 
 enum protocol { ICMP, TCP };
 
+struct blob_buf;
+
+enum series_res { SERIES_RAW, SERIES_1MIN, SERIES_15MIN, __SERIES_RES_MAX };
+
+#define PHI_WINDOW 100 /* inter-reply intervals remembered */
+
+/* arrival statistics for the phi accrual failure detector */
+struct phi_state {
+	unsigned int samples[PHI_WINDOW]; /* in ms */
+	unsigned int idx;
+	unsigned int cnt;
+	unsigned long long sum;
+	unsigned long long sum_sq;
+	struct timespec last; /* last reply */
+};
+
+typedef void (*series_point_cb)(void* ctx, uint64_t time, double rtt,
+								double loss);
+
+#define QUALITY_WINDOW 50 /* probes used for the quality score */
+#define QUALITY_LOST   UINT_MAX
+
+/* recent probe results for the quality score */
+struct quality_state {
+	unsigned int rtt[QUALITY_WINDOW]; /* in ms or QUALITY_LOST */
+	unsigned int idx;
+	unsigned int cnt;
+	unsigned int loss;	  /* in percent */
+	unsigned int latency; /* percentile, in ms */
+	unsigned int jitter;  /* in ms */
+	unsigned int p95;	  /* latency, in ms */
+	double score;		  /* lower is better */
+};
+
+/* TTL stepped probes to find the last hop which still answers */
+struct trace_state {
+	struct uloop_fd ufd;
+	struct uloop_timeout timeout;
+	int ttl;			  /* of the next probe */
+	int hop;			  /* highest TTL which answered in this run */
+	unsigned int addr;	  /* and who answered */
+	bool reached;		  /* target answered */
+	struct timespec start; /* of the last run */
+	/* result of the last finished run */
+	int last_hop; /* 0 if no hop answered */
+	unsigned int last_addr;
+	bool last_reached;
+	time_t last_time; /* 0 if never run */
+};
+
+/* fast probing of the next hop gateway */
+struct gateway_state {
+	struct uloop_fd ufd;
+	struct uloop_timeout timeout_send;
+	struct uloop_timeout timeout_down;
+	uint32_t addr; /* last probed */
+	unsigned int cnt_sent;
+	unsigned int cnt_fail;
+	unsigned int last_rtt; /* in ms */
+	struct timespec time_sent;
+	bool reply_pending; /* last probe not answered yet */
+	bool up;			/* answered since the last failure */
+	bool failed;		/* made the interface OFFLINE, until it answers */
+	struct timespec time_failed;
+	bool host_ok; /* host answered while failed */
+};
+
+/* evidence from real traffic for passive liveness */
+struct passive_state {
+	uint64_t rx_packets; /* at the last check */
+	bool rx_valid;
+	unsigned int rx_delta;	  /* packets received in the last interval */
+	unsigned int tcp_active;  /* connections which received data */
+	unsigned int tcp_stalled; /* connections which are retransmitting */
+	bool healthy;
+	unsigned int skipped; /* probes skipped in a row */
+	unsigned int cnt_skipped;
+};
+
+/* traffic used by probes in the current budget period */
+struct budget_state {
+	uint64_t used_packets;
+	uint64_t used_bytes;
+	unsigned int probes;
+	time_t period_end;
+	int interval; /* current, stretched interval in ms */
+	bool exhausted;
+};
+
 struct scripts_proc {
 	struct runqueue_process proc;
 	struct ping_intf* intf;
 	enum online_state state;
+	struct timespec time_start;
+	unsigned int cnt_runs;
+	unsigned long time_total; /* in ms */
+	bool pending; /* run again when finished */
 };
 
 struct ping_intf {
+	struct vlist_node node;
+	struct list_head list; /* in config order */
+
 	/* public state */
 	char name[MAX_IFNAME_LEN];
 	char device[MAX_IFNAME_LEN];
@@ -48,46 +150,208 @@ struct ping_intf {
 	unsigned int cnt_succ;
 	unsigned int last_rtt; /* in ms */
 	unsigned int max_rtt;  /* in ms */
+	unsigned int cnt_transitions;
+	unsigned int rtt_hist[RTT_HIST_BUCKETS];
+	unsigned long rtt_sum; /* in ms */
+	int hist_idx;		   /* index + 1 in history names, 0 if not assigned */
+	struct series_set* series;
 
 	/* config items */
-	int conf_interval;
-	int conf_timeout;
+	int conf_interval; /* ms */
+	int conf_timeout;  /* ms */
 	char conf_hostname[MAX_HOSTNAME_LEN];
 	int conf_host; /* resolved IP */
 	enum protocol conf_proto;
 	int conf_tcp_port;
 	int conf_panic_timeout; /* minutes */
 	bool conf_ignore_ubus;
+	char conf_device[MAX_IFNAME_LEN]; /* for ignore_ubus */
 	bool conf_disabled;
+	double conf_phi; /* phi threshold, 0 for fixed timeout */
+	char conf_compare[MAX_IFNAME_LEN]; /* compare group */
+	int conf_gw_interval;			   /* ms, 0 for no gateway probing */
+	int conf_gw_timeout;			   /* ms */
+	int conf_passive; /* packets per interval to skip probes, 0 for off */
+	uint64_t conf_budget; /* bytes or packets per period, 0 for none */
+	bool conf_budget_packets;
+	bool conf_budget_month; /* period is a month instead of a day */
+	int conf_burst;			 /* probes sent at start, 0 for none */
+	int conf_burst_interval; /* ms */
+	int conf_slo_loss;		 /* percent, 0 for none */
+	int conf_slo_latency;	 /* ms, 95th percentile, 0 for none */
+	int conf_slo_jitter;	 /* ms, 0 for none */
+	int conf_slo_hysteresis; /* percent */
 
 	/* internal state for ping */
 	struct uloop_fd ufd;
 	struct uloop_timeout timeout_offline;
 	struct uloop_timeout timeout_send;
+	struct timespec time_next; /* when the next probe is due */
 	struct timespec time_sent;
+	struct uloop_timeout timeout_burst;
+	int burst_left; /* probes of the burst still to send */
+	bool burst;		/* until the first regular probe */
+	bool reply_pending;
+	bool status_pending; /* waiting for ubus interface status */
+	int worker;			 /* index + 1 of worker thread, 0 for main thread */
+	unsigned int worker_slot;
+	unsigned int worker_gen;
+	bool worker_failed; /* the worker could not take it, use main thread */
+	struct uring_req* uring_recv; /* multishot ICMP receive */
+	struct uring_req* uring_conn; /* TCP connect in progress */
+	uint64_t xdp_key;	  /* registered in the XDP map, 0 if not */
+	uint64_t xdp_replies; /* counted by XDP, already handled */
+	struct phi_state phi;
+	struct quality_state quality;
+	struct compare_group* compare;
+	long long compare_round; /* due time of the last probe, in ms */
+	int compare_rtt;		 /* RTT in this round or -1 */
+	struct trace_state trace;
+	struct gateway_state gateway;
+	struct passive_state passive;
+	struct budget_state budget;
+	bool warm; /* counters restored at startup, see state.c */
+	enum online_state warm_state;
+	bool provisional; /* restored state not confirmed by probes yet */
 
 	/* internal state for scripts */
 	struct scripts_proc scripts_on;
 	struct scripts_proc scripts_off;
+	struct scripts_proc scripts_degraded;
+	struct scripts_proc scripts_budget;
+};
+
+/* global config items, from the "default" section */
+struct ping_conf {
+	char metrics_listen[MAX_HOSTNAME_LEN];
+	char history_file[MAX_HOSTNAME_LEN];
+	int history_size;  /* kB */
+	int history_flush; /* sec */
+	bool series;
+	int workers; /* number of ICMP worker threads, 0 for none */
+	bool io_uring;
+	bool xdp;
+	/* quality score weights, -1 for default */
+	int score_latency;
+	int score_jitter;
+	int score_loss;
+	int score_percentile;
+	int score_hysteresis; /* percent */
+	char state_file[MAX_HOSTNAME_LEN];
+	int state_interval; /* sec */
+	int state_max_age;	/* sec */
 };
 
 // utils.c
+int clock_now(clockid_t clk, struct timespec* ts);
+void clock_set_source(int (*source)(clockid_t clk, struct timespec* ts));
+time_t clock_time(void);
 long timespec_diff_ms(struct timespec start, struct timespec end);
+void timespec_add_ms(struct timespec* t, long ms);
+bool timespec_before(const struct timespec* a, const struct timespec* b);
+bool process_usage(unsigned long* cpu_ms, unsigned long* rss_kb);
 
 // icmp.c
+#define ICMP_ID_WORKER 0x8000 /* echo ids of worker threads, above all fds */
 int icmp_init(const char* ifname);
+unsigned short icmp_checksum(void* b, int len);
 bool icmp_echo_send(int fd, int dst, int cnt);
+bool icmp_echo_send_ifindex(int fd, int ifindex, int id, int dst, int cnt);
 int icmp_echo_receive(int fd);
+int icmp_echo_build(char* buf, int fd, int cnt);
+uint16_t icmp_echo_id(int fd);
+int icmp_echo_parse(char* buf, int len);
+bool icmp_filter_echo_ids(int fd, int id, int num);
+int icmp_trace_parse(char* buf, int len, int fd, unsigned int* from,
+					 bool* reached);
+bool icmp_set_ttl(int fd, int ttl);
+int icmp_trace_receive(int fd, unsigned int* from, bool* reached);
 
 // tcp.c
+int tcp_socket(const char* ifname);
 int tcp_connect(const char* ifname, int dst, int port);
 bool tcp_check_connect(int fd);
 
 // ping.c
+/* probe socket operations, can be replaced e.g. for simulations. also used
+ * for the gateway and trace sockets */
+struct ping_io {
+	int (*icmp_init)(const char* ifname);
+	bool (*icmp_echo_send)(int fd, int dst, int cnt);
+	int (*icmp_echo_receive)(int fd);
+	bool (*icmp_set_ttl)(int fd, int ttl);
+	int (*icmp_trace_receive)(int fd, unsigned int* from, bool* reached);
+	int (*tcp_connect)(const char* ifname, int dst, int port);
+	bool (*tcp_check_connect)(int fd);
+};
+extern const struct ping_io* probe_io;
+void ping_set_io(const struct ping_io* io);
+extern const unsigned int rtt_hist_bounds[RTT_HIST_BUCKETS - 1];
 bool ping_init(struct ping_intf* pi);
 bool ping_send(struct ping_intf* pi);
+bool ping_burst(struct ping_intf* pi);
+void ping_sent(struct ping_intf* pi);
+void ping_send_error(struct ping_intf* pi);
+void ping_reply(struct ping_intf* pi, unsigned int rtt);
 void ping_stop(struct ping_intf* pi);
 
+// phi.c
+void phi_reset(struct ping_intf* pi);
+void phi_add(struct ping_intf* pi, bool sample);
+double phi_value(struct ping_intf* pi);
+int phi_timeout(struct ping_intf* pi);
+
+// quality.c
+void quality_init(const struct ping_conf* conf);
+void quality_reset(struct ping_intf* pi);
+void quality_add(struct ping_intf* pi, int rtt);
+void quality_state_changed(struct ping_intf* pi);
+void quality_remove(struct ping_intf* pi);
+struct ping_intf* quality_best(void);
+void quality_restore_best(struct ping_intf* pi);
+void quality_blob(struct blob_buf* b);
+
+// compare.c
+void compare_join(struct ping_intf* pi);
+void compare_leave(struct ping_intf* pi);
+void compare_round(struct ping_intf* pi, long long round);
+void compare_reply(struct ping_intf* pi, unsigned int rtt);
+void compare_blob(struct blob_buf* b);
+
+// trace.c
+void trace_start(struct ping_intf* pi);
+void trace_stop(struct ping_intf* pi);
+const char* trace_addr_str(struct ping_intf* pi);
+int trace_age(struct ping_intf* pi);
+
+// gateway.c
+void gateway_start(struct ping_intf* pi);
+void gateway_stop(struct ping_intf* pi);
+bool gateway_failed(struct ping_intf* pi);
+
+// passive.c
+void passive_reset(struct ping_intf* pi);
+bool passive_check(struct ping_intf* pi);
+void passive_finish(void);
+
+// budget.c
+void budget_sent(struct ping_intf* pi);
+void budget_reply(struct ping_intf* pi);
+void budget_tcp_close(struct ping_intf* pi, int fd, bool connected);
+void budget_icmp(struct ping_intf* pi);
+bool budget_allow(struct ping_intf* pi);
+int budget_interval(struct ping_intf* pi);
+
+// slo.c
+enum online_state slo_state(struct ping_intf* pi);
+void slo_check(struct ping_intf* pi);
+
+// state.c
+void state_init(const char* file, int save_interval, int age);
+bool state_warm_start(struct ping_intf* pi);
+void state_save(void);
+void state_finish(void);
+
 // ubus.c
 bool ubus_init(void);
 bool ubus_listen_network_events(void);
@@ -97,21 +361,117 @@ bool ubus_register_server(void);
 void ubus_finish(void);
 
 // uci.c
-int uci_config_pingcheck(struct ping_intf* intf, int len);
+void uci_config_dir(const char* dir);
+int uci_config_pingcheck(struct ping_conf* conf);
 
 // scripts.c
 void scripts_init(void);
 void scripts_run(struct ping_intf* pi, enum online_state state_new);
 void scripts_run_panic(void);
+void scripts_run_best(struct ping_intf* pi, const char* previous);
+void scripts_run_budget(struct ping_intf* pi);
+void scripts_cancel(struct ping_intf* pi);
 void scripts_finish(void);
 
+// netlink.c
+bool netlink_init(void);
+int netlink_link_carrier(const char* dev);
+bool netlink_has_default_route(const char* dev);
+uint32_t netlink_default_gateway(const char* dev);
+int netlink_link_addrs(const char* dev, uint32_t* addrs, int max);
+bool netlink_link_stats(const char* dev, uint64_t* rx_packets);
+void netlink_finish(void);
+
+// worker.c
+bool worker_init(int num);
+bool worker_enabled(void);
+bool worker_add(struct ping_intf* pi);
+void worker_update(struct ping_intf* pi);
+void worker_remove(struct ping_intf* pi);
+void worker_finish(void);
+
+// uring.c
+bool uring_init(void);
+bool uring_enabled(void);
+bool uring_recv_start(struct ping_intf* pi);
+bool uring_icmp_send(struct ping_intf* pi);
+bool uring_tcp_connect(struct ping_intf* pi);
+void uring_cancel(struct ping_intf* pi);
+void uring_finish(void);
+
+// xdp.c
+bool xdp_init(void);
+bool xdp_enabled(void);
+void xdp_update(struct ping_intf* pi);
+void xdp_remove(struct ping_intf* pi);
+void xdp_finish(void);
+
+// debug.c
+enum debug_cb {
+	DBG_CB_SEND,
+	DBG_CB_RECV,
+	DBG_CB_RESOLVE,
+	DBG_CB_UBUS,
+	DBG_CB_SCRIPT,
+	__DBG_CB_MAX
+};
+enum debug_io {
+	DBG_IO_PROBE,
+	DBG_IO_SEND,
+	DBG_IO_RECV,
+	DBG_IO_CONNECT,
+	DBG_IO_RESOLVE,
+	DBG_IO_FORK,
+	__DBG_IO_MAX
+};
+enum debug_err {
+	DBG_ERR_SEND,		/* sending probe failed */
+	DBG_ERR_RECV,		/* short or invalid packet received */
+	DBG_ERR_CONNECT,	/* TCP connect failed right away */
+	DBG_ERR_UNKNOWN_ID, /* reply for unknown socket */
+	__DBG_ERR_MAX
+};
+extern const char* debug_err_names[__DBG_ERR_MAX];
+void debug_timeout_lag(struct uloop_timeout* t);
+void debug_cb_start(long long* start);
+void debug_cb_end(enum debug_cb cb, long long start, const char* name);
+void debug_io(enum debug_io io);
+void debug_error(enum debug_err err);
+unsigned long debug_error_count(enum debug_err err);
+void debug_blob(struct blob_buf* b);
+
+// metrics.c
+bool metrics_init(const char* listen);
+void metrics_finish(void);
+
+// history.c
+bool history_init(const char* file, int size_kb, int flush_sec);
+void history_add(struct ping_intf* pi, enum history_type type,
+				 unsigned int value);
+void history_finish(void);
+
+// series.c
+void series_init(void);
+void series_add(struct ping_intf* pi, int rtt);
+void series_query(struct ping_intf* pi, enum series_res res, uint64_t start,
+				  uint64_t end, series_point_cb cb, void* ctx);
+size_t series_memory(struct ping_intf* pi);
+int series_res_from_str(const char* str);
+void series_free(struct ping_intf* pi);
+
 // main.c
+extern struct list_head interface_list;
+#define for_each_interface(pi) list_for_each_entry(pi, &interface_list, list)
+void intf_init(void);
+void config_add_interface(struct ping_intf* pi);
+bool config_reload(void);
 void notify_interface(const char* interface, const char* action);
+void notify_interface_status(const char* interface);
+void notify_device(const char* device, bool carrier);
+void notify_default_route(const char* device, bool has_route);
 struct ping_intf* get_interface_by_fd(int fd);
 struct ping_intf* get_interface(const char* interface);
 const char* get_status_str(enum online_state state);
 enum online_state get_global_status();
-int get_online_interface_names(const char** dest, int destLen);
-int get_all_interface_names(const char** dest, int destLen);
 void state_change(enum online_state state_new, struct ping_intf* pi);
 void reset_counters(const char* interface);
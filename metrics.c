@@ -0,0 +1,384 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "log.h"
+#include "main.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libubox/usock.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * OpenMetrics (Prometheus) exporter
+ *
+ * Serves the exposition text over a minimal HTTP/1.0 response on a Unix or
+ * TCP listening socket. The text is generated into one buffer which is kept
+ * between scrapes, so after the first few scrapes no allocation is needed.
+ */
+
+#define METRICS_MAX_CLIENTS	4
+#define METRICS_CLIENT_TIMEOUT	5000 /* 5 sec */
+#define METRICS_BUF_INITIAL	4096
+
+static const char* http_header
+	= "HTTP/1.0 200 OK\r\n"
+	  "Content-Type: application/openmetrics-text; version=1.0.0; "
+	  "charset=utf-8\r\n"
+	  "Connection: close\r\n\r\n";
+
+struct metrics_client {
+	struct uloop_fd ufd;
+	struct uloop_timeout timeout;
+	size_t pos; /* how much of the buffer has already been written */
+	bool writing;
+};
+
+static struct uloop_fd listen_fd;
+static struct metrics_client clients[METRICS_MAX_CLIENTS];
+
+/* exposition buffer, reused */
+static char* buf;
+static size_t buf_size;
+static size_t buf_len;
+
+/* number of clients still writing out the current buffer */
+static int buf_users;
+
+static void __attribute__((format(printf, 1, 2)))
+metrics_printf(const char* format, ...)
+{
+	va_list args;
+	int len;
+
+	while (true) {
+		va_start(args, format);
+		len = vsnprintf(buf + buf_len, buf_size - buf_len, format, args);
+		va_end(args);
+
+		if (len < 0) {
+			return;
+		}
+		if (buf_len + len < buf_size) {
+			buf_len += len;
+			return;
+		}
+
+		/* grow buffer and try again */
+		char* nbuf = realloc(buf, buf_size * 2);
+		if (nbuf == NULL) {
+			LOG_ERR("Metrics: out of memory");
+			return;
+		}
+		buf = nbuf;
+		buf_size *= 2;
+	}
+}
+
+static void metrics_generate(void)
+{
+	struct ping_intf* pi;
+
+	buf_len = 0;
+	metrics_printf("%s", http_header);
+
+	metrics_printf("# TYPE pingcheck_status stateset\n");
+	metrics_printf("# HELP pingcheck_status Global connectivity status\n");
+	enum online_state global = get_global_status();
+	metrics_printf("pingcheck_status{pingcheck_status=\"ONLINE\"} %d\n",
+				   global == ONLINE);
+	metrics_printf("pingcheck_status{pingcheck_status=\"OFFLINE\"} %d\n",
+				   global == OFFLINE);
+	metrics_printf("pingcheck_status{pingcheck_status=\"DEGRADED\"} %d\n",
+				   global == DEGRADED);
+
+	metrics_printf("# TYPE pingcheck_interface_state stateset\n");
+	metrics_printf("# HELP pingcheck_interface_state Interface status\n");
+	for_each_interface(pi) {
+		for (enum online_state s = UNKNOWN; s <= DEGRADED; s++) {
+			metrics_printf("pingcheck_interface_state{interface=\"%s\","
+						   "pingcheck_interface_state=\"%s\"} %d\n",
+						   pi->name, get_status_str(s),
+						   pi->state == s);
+		}
+	}
+
+	metrics_printf("# TYPE pingcheck_sent counter\n");
+	metrics_printf("# HELP pingcheck_sent Probes sent\n");
+	for_each_interface(pi) {
+		metrics_printf("pingcheck_sent_total{interface=\"%s\"} %u\n",
+					   pi->name, pi->cnt_sent);
+	}
+
+	metrics_printf("# TYPE pingcheck_success counter\n");
+	metrics_printf("# HELP pingcheck_success Probes answered\n");
+	for_each_interface(pi) {
+		metrics_printf("pingcheck_success_total{interface=\"%s\"} %u\n",
+					   pi->name, pi->cnt_succ);
+	}
+
+	metrics_printf("# TYPE pingcheck_state_transitions counter\n");
+	metrics_printf("# HELP pingcheck_state_transitions Interface state "
+				   "changes\n");
+	for_each_interface(pi) {
+		metrics_printf("pingcheck_state_transitions_total{interface=\"%s\"} "
+					   "%u\n",
+					   pi->name, pi->cnt_transitions);
+	}
+
+	if (xdp_enabled()) {
+		metrics_printf("# TYPE pingcheck_xdp_replies counter\n");
+		metrics_printf("# HELP pingcheck_xdp_replies Replies counted and "
+					   "dropped by XDP\n");
+		for_each_interface(pi) {
+			metrics_printf("pingcheck_xdp_replies_total{interface=\"%s\"} "
+						   "%llu\n",
+						   pi->name, (unsigned long long)pi->xdp_replies);
+		}
+	}
+
+	metrics_printf("# TYPE pingcheck_rtt_seconds histogram\n");
+	metrics_printf("# UNIT pingcheck_rtt_seconds seconds\n");
+	metrics_printf("# HELP pingcheck_rtt_seconds Round trip time\n");
+	for_each_interface(pi) {
+		unsigned int cnt = 0;
+		for (int j = 0; j < RTT_HIST_BUCKETS; j++) {
+			cnt += pi->rtt_hist[j];
+			if (j < RTT_HIST_BUCKETS - 1) {
+				metrics_printf("pingcheck_rtt_seconds_bucket{interface=\"%s\","
+							   "le=\"%.3f\"} %u\n",
+							   pi->name, rtt_hist_bounds[j] / 1000.0,
+							   cnt);
+			} else {
+				metrics_printf("pingcheck_rtt_seconds_bucket{interface=\"%s\","
+							   "le=\"+Inf\"} %u\n",
+							   pi->name, cnt);
+			}
+		}
+		metrics_printf("pingcheck_rtt_seconds_sum{interface=\"%s\"} %.3f\n",
+					   pi->name, pi->rtt_sum / 1000.0);
+		metrics_printf("pingcheck_rtt_seconds_count{interface=\"%s\"} %u\n",
+					   pi->name, cnt);
+	}
+
+	metrics_printf("# TYPE pingcheck_script_duration_seconds summary\n");
+	metrics_printf("# UNIT pingcheck_script_duration_seconds seconds\n");
+	metrics_printf("# HELP pingcheck_script_duration_seconds Hook script "
+				   "run time\n");
+	for_each_interface(pi) {
+		struct scripts_proc* scr[]
+			= {&pi->scripts_on, &pi->scripts_off, &pi->scripts_degraded};
+		const char* hooks[] = {"online", "offline", "degraded"};
+		for (unsigned int j = 0; j < ARRAY_SIZE(scr); j++) {
+			const char* hook = hooks[j];
+			metrics_printf("pingcheck_script_duration_seconds_sum{interface="
+						   "\"%s\",hook=\"%s\"} %.3f\n",
+						   pi->name, hook, scr[j]->time_total / 1000.0);
+			metrics_printf("pingcheck_script_duration_seconds_count{"
+						   "interface=\"%s\",hook=\"%s\"} %u\n",
+						   pi->name, hook, scr[j]->cnt_runs);
+		}
+	}
+
+	metrics_printf("# TYPE pingcheck_io_errors counter\n");
+	metrics_printf("# HELP pingcheck_io_errors Probe send and receive "
+				   "errors\n");
+	for (int i = 0; i < __DBG_ERR_MAX; i++) {
+		metrics_printf("pingcheck_io_errors_total{type=\"%s\"} %lu\n",
+					   debug_err_names[i], debug_error_count(i));
+	}
+
+	unsigned long cpu_ms;
+	unsigned long rss_kb;
+	if (process_usage(&cpu_ms, &rss_kb)) {
+		metrics_printf("# TYPE process_cpu_seconds counter\n");
+		metrics_printf("# UNIT process_cpu_seconds seconds\n");
+		metrics_printf("# HELP process_cpu_seconds User and system CPU time\n");
+		metrics_printf("process_cpu_seconds_total %.3f\n", cpu_ms / 1000.0);
+		metrics_printf("# TYPE process_resident_memory_bytes gauge\n");
+		metrics_printf("# UNIT process_resident_memory_bytes bytes\n");
+		metrics_printf("# HELP process_resident_memory_bytes Resident memory "
+					   "size\n");
+		metrics_printf("process_resident_memory_bytes %lu\n", rss_kb * 1024);
+	}
+
+	metrics_printf("# EOF\n");
+}
+
+static void metrics_client_close(struct metrics_client* cl)
+{
+	if (cl->writing) {
+		buf_users--;
+	}
+	uloop_timeout_cancel(&cl->timeout);
+	uloop_fd_delete(&cl->ufd);
+	close(cl->ufd.fd);
+	memset(cl, 0, sizeof(*cl));
+}
+
+static void metrics_client_write(struct metrics_client* cl)
+{
+	while (cl->pos < buf_len) {
+		ssize_t ret = write(cl->ufd.fd, buf + cl->pos, buf_len - cl->pos);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* continue when socket is writable again */
+				uloop_fd_add(&cl->ufd, ULOOP_WRITE);
+				return;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		cl->pos += ret;
+	}
+	metrics_client_close(cl);
+}
+
+/* uloop callback on client socket */
+static void metrics_client_cb(struct uloop_fd* fd,
+							  __attribute__((unused)) unsigned int events)
+{
+	struct metrics_client* cl = container_of(fd, struct metrics_client, ufd);
+	char req[512];
+
+	if (cl->writing) {
+		metrics_client_write(cl);
+		return;
+	}
+
+	/* we answer every request the same way, so the content of the
+	 * request does not matter and we don't wait for all of it */
+	ssize_t ret = read(fd->fd, req, sizeof(req));
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	if (ret <= 0) {
+		metrics_client_close(cl);
+		return;
+	}
+
+	/* only regenerate when no other client is still writing the buffer */
+	if (buf_users == 0) {
+		metrics_generate();
+	}
+	buf_users++;
+	cl->writing = true;
+	cl->pos = 0;
+	metrics_client_write(cl);
+}
+
+/* uloop timeout callback for clients which take too long */
+static void uto_client_cb(struct uloop_timeout* t)
+{
+	struct metrics_client* cl = container_of(t, struct metrics_client, timeout);
+	metrics_client_close(cl);
+}
+
+/* uloop callback on listening socket */
+static void metrics_accept_cb(struct uloop_fd* fd,
+							  __attribute__((unused)) unsigned int events)
+{
+	struct metrics_client* cl = NULL;
+
+	int cfd = accept(fd->fd, NULL, NULL);
+	if (cfd < 0) {
+		return;
+	}
+	fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL, 0) | O_NONBLOCK);
+
+	for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+		if (clients[i].ufd.fd == 0) {
+			cl = &clients[i];
+			break;
+		}
+	}
+	if (cl == NULL) {
+		LOG_WARN("Metrics: too many clients");
+		close(cfd);
+		return;
+	}
+
+	cl->ufd.fd = cfd;
+	cl->ufd.cb = metrics_client_cb;
+	uloop_fd_add(&cl->ufd, ULOOP_READ);
+	cl->timeout.cb = uto_client_cb;
+	uloop_timeout_set(&cl->timeout, METRICS_CLIENT_TIMEOUT);
+}
+
+/*
+ * listen is either an absolute path for a Unix socket, "host:port" or just
+ * a port, which will listen on all addresses
+ */
+bool metrics_init(const char* listen)
+{
+	char host[MAX_HOSTNAME_LEN];
+	const char* port;
+	int fd;
+
+	if (listen[0] == '/') {
+		unlink(listen);
+		fd = usock(USOCK_UNIX | USOCK_SERVER | USOCK_NONBLOCK, listen, NULL);
+	} else {
+		const char* sep = strrchr(listen, ':');
+		if (sep != NULL) {
+			snprintf(host, sizeof(host), "%.*s", (int)(sep - listen), listen);
+			port = sep + 1;
+		} else {
+			strcpy(host, "0.0.0.0");
+			port = listen;
+		}
+		fd = usock(USOCK_TCP | USOCK_SERVER | USOCK_NONBLOCK, host, port);
+	}
+
+	if (fd < 0) {
+		LOG_ERR("Metrics: could not listen on '%s'", listen);
+		return false;
+	}
+
+	buf_size = METRICS_BUF_INITIAL;
+	buf = malloc(buf_size);
+	if (buf == NULL) {
+		close(fd);
+		return false;
+	}
+
+	listen_fd.fd = fd;
+	listen_fd.cb = metrics_accept_cb;
+	uloop_fd_add(&listen_fd, ULOOP_READ);
+
+	LOG_INF("Metrics: listening on '%s'", listen);
+	return true;
+}
+
+void metrics_finish(void)
+{
+	for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+		if (clients[i].ufd.fd > 0) {
+			metrics_client_close(&clients[i]);
+		}
+	}
+	if (listen_fd.fd > 0) {
+		uloop_fd_delete(&listen_fd);
+		close(listen_fd.fd);
+		listen_fd.fd = 0;
+	}
+	free(buf);
+	buf = NULL;
+}
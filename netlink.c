@@ -0,0 +1,661 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "log.h"
+#include "main.h"
+
+/* keep libc includes before linux headers for musl compatibility */
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/*
+ * Link, address and route monitoring with rtnetlink
+ *
+ * We keep a list of network devices with their carrier state and IPv4
+ * addresses, and a list of IPv4 default routes from all routing tables
+ * (including policy routing tables). Carrier changes are passed on to
+ * notify_device() and default route changes to notify_default_route()
+ * immediately.
+ *
+ * When the kernel drops events because our receive buffer overran, we dump
+ * everything again and remove what was not part of the dump.
+ */
+
+#define NL_BUF_SIZE	  8192
+#define NL_MAX_ADDRS 4
+
+struct nl_link {
+	struct list_head list;
+	int ifindex;
+	char name[IFNAMSIZ];
+	bool carrier;
+	bool stale; /* not seen in the resync dump (yet) */
+	int num_addrs;
+	uint32_t addrs[NL_MAX_ADDRS];
+};
+
+struct nl_route {
+	struct list_head list;
+	uint32_t table;
+	uint32_t metric;
+	int oif;
+	uint32_t gateway;
+	bool stale;
+};
+
+static LIST_HEAD(links);
+static LIST_HEAD(routes);
+
+static struct uloop_fd nl_fd;
+static int nl_stats_fd = -1; /* for synchronous requests */
+static uint32_t nl_seq;
+
+static struct nl_link* netlink_link_by_index(int ifindex)
+{
+	struct nl_link* l;
+	list_for_each_entry(l, &links, list) {
+		if (l->ifindex == ifindex) {
+			return l;
+		}
+	}
+	return NULL;
+}
+
+static struct nl_link* netlink_link_by_name(const char* name)
+{
+	struct nl_link* l;
+	list_for_each_entry(l, &links, list) {
+		if (strncmp(l->name, name, IFNAMSIZ) == 0) {
+			return l;
+		}
+	}
+	return NULL;
+}
+
+/*** link ***/
+
+static void netlink_handle_link(struct nlmsghdr* nh)
+{
+	struct ifinfomsg* ifi = NLMSG_DATA(nh);
+	int len = IFLA_PAYLOAD(nh);
+	const char* name = NULL;
+
+	for (struct rtattr* rta = IFLA_RTA(ifi); RTA_OK(rta, len);
+		 rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFLA_IFNAME) {
+			name = RTA_DATA(rta);
+		}
+	}
+
+	struct nl_link* l = netlink_link_by_index(ifi->ifi_index);
+
+	if (nh->nlmsg_type == RTM_DELLINK) {
+		if (l != NULL) {
+			if (l->carrier) {
+				notify_device(l->name, false);
+			}
+			list_del(&l->list);
+			free(l);
+		}
+		return;
+	}
+
+	if (l == NULL) {
+		l = calloc(1, sizeof(*l));
+		if (l == NULL) {
+			return;
+		}
+		l->ifindex = ifi->ifi_index;
+		list_add_tail(&l->list, &links);
+	}
+	l->stale = false;
+	if (name != NULL) { /* devices can be renamed */
+		strncpy(l->name, name, IFNAMSIZ - 1);
+	}
+
+	bool carrier = (ifi->ifi_flags & IFF_UP) && (ifi->ifi_flags & IFF_LOWER_UP);
+	if (carrier != l->carrier) {
+		l->carrier = carrier;
+		LOG_INF("Device '%s' carrier %s", l->name, carrier ? "up" : "down");
+		notify_device(l->name, carrier);
+	}
+}
+
+/*** address ***/
+
+static void netlink_handle_addr(struct nlmsghdr* nh)
+{
+	struct ifaddrmsg* ifa = NLMSG_DATA(nh);
+	int len = IFA_PAYLOAD(nh);
+	uint32_t addr = 0;
+
+	if (ifa->ifa_family != AF_INET) {
+		return;
+	}
+
+	for (struct rtattr* rta = IFA_RTA(ifa); RTA_OK(rta, len);
+		 rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFA_LOCAL
+			|| (rta->rta_type == IFA_ADDRESS && addr == 0)) {
+			memcpy(&addr, RTA_DATA(rta), sizeof(addr));
+		}
+	}
+
+	struct nl_link* l = netlink_link_by_index(ifa->ifa_index);
+	if (l == NULL || addr == 0) {
+		return;
+	}
+
+	for (int i = 0; i < l->num_addrs; i++) {
+		if (l->addrs[i] == addr) {
+			if (nh->nlmsg_type == RTM_DELADDR) {
+				l->addrs[i] = l->addrs[--l->num_addrs];
+			}
+			return;
+		}
+	}
+	if (nh->nlmsg_type == RTM_NEWADDR && l->num_addrs < NL_MAX_ADDRS) {
+		l->addrs[l->num_addrs++] = addr;
+	}
+}
+
+/*** route ***/
+
+static bool netlink_oif_has_route(int oif)
+{
+	struct nl_route* r;
+	list_for_each_entry(r, &routes, list) {
+		if (r->oif == oif) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* tell main when the first default route of a device appears or the last
+ * one goes away */
+static void netlink_route_notify(int oif, bool had_route)
+{
+	struct nl_link* l = netlink_link_by_index(oif);
+	bool has_route = netlink_oif_has_route(oif);
+
+	if (l != NULL && has_route != had_route) {
+		LOG_INF("Device '%s' default route %s", l->name,
+				has_route ? "added" : "removed");
+		notify_default_route(l->name, has_route);
+	}
+}
+
+static void netlink_route_del(struct nl_route* r)
+{
+	int oif = r->oif;
+	list_del(&r->list);
+	free(r);
+	netlink_route_notify(oif, true);
+}
+
+static void netlink_route_update(bool add, uint32_t table, uint32_t metric,
+								 int oif, uint32_t gateway)
+{
+	struct nl_route* r;
+
+	list_for_each_entry(r, &routes, list) {
+		if (r->table == table && r->metric == metric && r->oif == oif) {
+			if (add) {
+				r->gateway = gateway;
+				r->stale = false;
+			} else {
+				netlink_route_del(r);
+			}
+			return;
+		}
+	}
+
+	if (!add) {
+		return;
+	}
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		return;
+	}
+	bool had_route = netlink_oif_has_route(oif);
+	r->table = table;
+	r->metric = metric;
+	r->oif = oif;
+	r->gateway = gateway;
+	list_add_tail(&r->list, &routes);
+	netlink_route_notify(oif, had_route);
+}
+
+static void netlink_handle_route(struct nlmsghdr* nh)
+{
+	struct rtmsg* rtm = NLMSG_DATA(nh);
+	int len = RTM_PAYLOAD(nh);
+	uint32_t table = rtm->rtm_table;
+	uint32_t metric = 0;
+	uint32_t gateway = 0;
+	int oif = 0;
+	struct rtattr* multipath = NULL;
+
+	/* only IPv4 default routes */
+	if (rtm->rtm_family != AF_INET || rtm->rtm_dst_len != 0
+		|| rtm->rtm_type != RTN_UNICAST) {
+		return;
+	}
+
+	for (struct rtattr* rta = RTM_RTA(rtm); RTA_OK(rta, len);
+		 rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case RTA_TABLE:
+			memcpy(&table, RTA_DATA(rta), sizeof(table));
+			break;
+		case RTA_PRIORITY:
+			memcpy(&metric, RTA_DATA(rta), sizeof(metric));
+			break;
+		case RTA_OIF:
+			memcpy(&oif, RTA_DATA(rta), sizeof(oif));
+			break;
+		case RTA_GATEWAY:
+			memcpy(&gateway, RTA_DATA(rta), sizeof(gateway));
+			break;
+		case RTA_MULTIPATH:
+			multipath = rta;
+			break;
+		}
+	}
+
+	bool add = nh->nlmsg_type == RTM_NEWROUTE;
+
+	if (multipath == NULL) {
+		netlink_route_update(add, table, metric, oif, gateway);
+		return;
+	}
+
+	/* one entry per nexthop */
+	struct rtnexthop* nhp = RTA_DATA(multipath);
+	int mlen = RTA_PAYLOAD(multipath);
+	while (mlen >= (int)sizeof(*nhp) && nhp->rtnh_len >= sizeof(*nhp)
+		   && nhp->rtnh_len <= mlen) {
+		uint32_t gw = 0;
+		int alen = nhp->rtnh_len - sizeof(*nhp);
+		for (struct rtattr* rta = RTNH_DATA(nhp); RTA_OK(rta, alen);
+			 rta = RTA_NEXT(rta, alen)) {
+			if (rta->rta_type == RTA_GATEWAY) {
+				memcpy(&gw, RTA_DATA(rta), sizeof(gw));
+			}
+		}
+		netlink_route_update(add, table, metric, nhp->rtnh_ifindex, gw);
+		mlen -= NLMSG_ALIGN(nhp->rtnh_len);
+		nhp = RTNH_NEXT(nhp);
+	}
+}
+
+/*** socket ***/
+
+/* returns 0 when the end of a dump has been reached, -1 on error and 1 when
+ * more messages are expected */
+static int netlink_handle_msgs(char* buf, int len)
+{
+	for (struct nlmsghdr* nh = (struct nlmsghdr*)buf; NLMSG_OK(nh, len);
+		 nh = NLMSG_NEXT(nh, len)) {
+		switch (nh->nlmsg_type) {
+		case NLMSG_DONE:
+			return 0;
+		case NLMSG_ERROR: {
+			struct nlmsgerr* err = NLMSG_DATA(nh);
+			if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*err))) {
+				LOG_ERR("Netlink: truncated error message");
+				return -1;
+			}
+			if (err->error == 0) { /* ACK */
+				return 0;
+			}
+			LOG_ERR("Netlink: error %s", strerror(-err->error));
+			return -1;
+		}
+		case RTM_NEWLINK:
+		case RTM_DELLINK:
+			netlink_handle_link(nh);
+			break;
+		case RTM_NEWADDR:
+		case RTM_DELADDR:
+			netlink_handle_addr(nh);
+			break;
+		case RTM_NEWROUTE:
+		case RTM_DELROUTE:
+			netlink_handle_route(nh);
+			break;
+		}
+	}
+	return 1;
+}
+
+static int netlink_socket(uint32_t groups)
+{
+	struct sockaddr_nl sa;
+
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0) {
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = groups;
+	if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* blocking dump of the current state, the kernel answers right away */
+static bool netlink_dump(int fd, int type)
+{
+	char buf[NL_BUF_SIZE];
+	struct {
+		struct nlmsghdr nh;
+		struct rtgenmsg g;
+	} req;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.g));
+	req.nh.nlmsg_type = type;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nh.nlmsg_seq = ++nl_seq;
+	req.g.rtgen_family = type == RTM_GETLINK ? AF_UNSPEC : AF_INET;
+
+	if (send(fd, &req, req.nh.nlmsg_len, 0) < 0) {
+		return false;
+	}
+
+	while (true) {
+		int len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		int ret = netlink_handle_msgs(buf, len);
+		if (ret <= 0) {
+			return ret == 0;
+		}
+	}
+}
+
+static bool netlink_dump_all(void)
+{
+	int fd = netlink_socket(0);
+	if (fd < 0) {
+		return false;
+	}
+	bool ret = netlink_dump(fd, RTM_GETLINK) && netlink_dump(fd, RTM_GETADDR)
+			   && netlink_dump(fd, RTM_GETROUTE);
+	close(fd);
+	return ret;
+}
+
+/* get the complete state again and remove links and routes which were not
+ * part of it, as if we had received their delete events */
+static void netlink_resync(void)
+{
+	struct nl_link* l;
+	struct nl_link* ltmp;
+	struct nl_route* r;
+	struct nl_route* rtmp;
+
+	list_for_each_entry(l, &links, list) {
+		l->stale = true;
+		l->num_addrs = 0; /* addresses are dumped again */
+	}
+	list_for_each_entry(r, &routes, list) {
+		r->stale = true;
+	}
+
+	if (!netlink_dump_all()) {
+		/* keep what we have, the next overrun tries again */
+		LOG_ERR("Netlink: resync failed");
+		return;
+	}
+
+	list_for_each_entry_safe(r, rtmp, &routes, list) {
+		if (r->stale) {
+			netlink_route_del(r);
+		}
+	}
+	list_for_each_entry_safe(l, ltmp, &links, list) {
+		if (l->stale) {
+			if (l->carrier) {
+				notify_device(l->name, false);
+			}
+			list_del(&l->list);
+			free(l);
+		}
+	}
+}
+
+/* uloop callback for netlink events */
+static void netlink_fd_handler(struct uloop_fd* fd,
+							   __attribute__((unused)) unsigned int events)
+{
+	char buf[NL_BUF_SIZE];
+	bool overrun = false;
+
+	while (true) {
+		int len = recv(fd->fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == ENOBUFS) {
+				/* we lost events, the state may now be wrong */
+				LOG_ERR("Netlink: receive buffer overrun, resyncing");
+				overrun = true;
+				continue;
+			}
+			break; /* EAGAIN */
+		}
+		netlink_handle_msgs(buf, len);
+	}
+
+	/* after the queue is drained, so older events don't overwrite the dump.
+	 * events which happen during the dump are queued and applied after */
+	if (overrun) {
+		netlink_resync();
+	}
+}
+
+/*** API ***/
+
+/* returns -1 when device is unknown, otherwise if it has carrier */
+int netlink_link_carrier(const char* dev)
+{
+	struct nl_link* l = netlink_link_by_name(dev);
+	return l == NULL ? -1 : l->carrier;
+}
+
+bool netlink_has_default_route(const char* dev)
+{
+	struct nl_link* l = netlink_link_by_name(dev);
+	struct nl_route* r;
+
+	if (l == NULL) {
+		return false;
+	}
+	list_for_each_entry(r, &routes, list) {
+		if (r->oif == l->ifindex) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* gateway of the default route with the lowest metric on dev, or 0 */
+uint32_t netlink_default_gateway(const char* dev)
+{
+	struct nl_link* l = netlink_link_by_name(dev);
+	struct nl_route* r;
+	struct nl_route* best = NULL;
+
+	if (l == NULL) {
+		return 0;
+	}
+	list_for_each_entry(r, &routes, list) {
+		if (r->oif == l->ifindex && r->gateway != 0
+			&& (best == NULL || r->metric < best->metric)) {
+			best = r;
+		}
+	}
+	return best != NULL ? best->gateway : 0;
+}
+
+/* IPv4 addresses of dev, returns their number or -1 if dev is unknown */
+int netlink_link_addrs(const char* dev, uint32_t* addrs, int max)
+{
+	struct nl_link* l = netlink_link_by_name(dev);
+	if (l == NULL) {
+		return -1;
+	}
+	int num = l->num_addrs < max ? l->num_addrs : max;
+	memcpy(addrs, l->addrs, num * sizeof(*addrs));
+	return num;
+}
+
+/* received packets of dev, asked from the kernel right away */
+bool netlink_link_stats(const char* dev, uint64_t* rx_packets)
+{
+	struct nl_link* l = netlink_link_by_name(dev);
+	char buf[NL_BUF_SIZE];
+	struct {
+		struct nlmsghdr nh;
+		struct ifinfomsg ifi;
+	} req;
+
+	if (l == NULL) {
+		return false;
+	}
+	if (nl_stats_fd < 0) {
+		nl_stats_fd = netlink_socket(0);
+		if (nl_stats_fd < 0) {
+			return false;
+		}
+		/* this blocks the event loop, don't wait forever */
+		struct timeval tv = {.tv_sec = 0, .tv_usec = 100000};
+		setsockopt(nl_stats_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+	req.nh.nlmsg_type = RTM_GETLINK;
+	req.nh.nlmsg_flags = NLM_F_REQUEST;
+	req.nh.nlmsg_seq = ++nl_seq;
+	req.ifi.ifi_family = AF_UNSPEC;
+	req.ifi.ifi_index = l->ifindex;
+
+	if (send(nl_stats_fd, &req, req.nh.nlmsg_len, 0) < 0) {
+		return false;
+	}
+
+	/* skip answers to earlier requests which timed out */
+	while (true) {
+		int len = recv(nl_stats_fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		struct nlmsghdr* nh = (struct nlmsghdr*)buf;
+		if (!NLMSG_OK(nh, (unsigned int)len)) {
+			return false;
+		}
+		if (nh->nlmsg_seq != req.nh.nlmsg_seq) {
+			continue;
+		}
+		if (nh->nlmsg_type != RTM_NEWLINK) {
+			return false;
+		}
+
+		struct ifinfomsg* ifi = NLMSG_DATA(nh);
+		int alen = IFLA_PAYLOAD(nh);
+		for (struct rtattr* rta = IFLA_RTA(ifi); RTA_OK(rta, alen);
+			 rta = RTA_NEXT(rta, alen)) {
+			if (rta->rta_type == IFLA_STATS64
+				&& RTA_PAYLOAD(rta) >= sizeof(struct rtnl_link_stats64)) {
+				struct rtnl_link_stats64 st;
+				memcpy(&st, RTA_DATA(rta), sizeof(st));
+				*rx_packets = st.rx_packets;
+				return true;
+			}
+		}
+		return false;
+	}
+}
+
+bool netlink_init(void)
+{
+	/* subscribe first, so we don't miss any events during the dump */
+	int fd = netlink_socket(RTMGRP_LINK | RTMGRP_IPV4_IFADDR
+							| RTMGRP_IPV4_ROUTE);
+	if (fd < 0) {
+		LOG_ERR("Netlink: could not open socket");
+		return false;
+	}
+
+	if (!netlink_dump_all()) {
+		LOG_ERR("Netlink: could not get initial state");
+		close(fd);
+		return false;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	nl_fd.fd = fd;
+	nl_fd.cb = netlink_fd_handler;
+	uloop_fd_add(&nl_fd, ULOOP_READ);
+	return true;
+}
+
+void netlink_finish(void)
+{
+	struct nl_link* l;
+	struct nl_link* ltmp;
+	struct nl_route* r;
+	struct nl_route* rtmp;
+
+	if (nl_fd.fd > 0) {
+		uloop_fd_delete(&nl_fd);
+		close(nl_fd.fd);
+		nl_fd.fd = 0;
+	}
+	if (nl_stats_fd >= 0) {
+		close(nl_stats_fd);
+		nl_stats_fd = -1;
+	}
+	list_for_each_entry_safe(l, ltmp, &links, list) {
+		list_del(&l->list);
+		free(l);
+	}
+	list_for_each_entry_safe(r, rtmp, &routes, list) {
+		list_del(&r->list);
+		free(r);
+	}
+}
@@ -0,0 +1,198 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "log.h"
+#include "main.h"
+
+/* keep libc includes before linux headers for musl compatibility */
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <linux/inet_diag.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/*
+ * Passive liveness
+ *
+ * On a busy uplink, real traffic shows that it works. Before each probe we
+ * look at how many packets the device received since the last interval
+ * (rtnetlink statistics) and at the TCP connections from its addresses
+ * (sock_diag): connections which received data in the last interval are
+ * working flows, connections which are retransmitting are a bad sign.
+ * While the traffic is healthy, the probe is skipped and the offline timeout
+ * is moved on as if a reply had been received. A real probe is still sent
+ * every PASSIVE_MAX_SKIP intervals, for RTT statistics.
+ *
+ * The received packets alone are no evidence: ARP and broadcasts keep
+ * coming in on an uplink which is dead upstream. So a TCP connection must
+ * have received data, and as long as a real probe is unanswered no probes
+ * are skipped, so the offline timeout can run out.
+ */
+
+#define PASSIVE_MAX_SKIP  10
+#define PASSIVE_MAX_ADDRS 4
+#define PASSIVE_BUF_SIZE  8192
+
+static int diag_fd = -1;
+
+static bool passive_addr_match(const uint32_t* addrs, int num, uint32_t addr)
+{
+	for (int i = 0; i < num; i++) {
+		if (addrs[i] == addr) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void passive_tcp_msg(struct nlmsghdr* nh, const uint32_t* addrs,
+							int num, unsigned int interval,
+							struct passive_state* ps)
+{
+	struct inet_diag_msg* m = NLMSG_DATA(nh);
+	if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*m))
+		|| !passive_addr_match(addrs, num, m->id.idiag_src[0])) {
+		return;
+	}
+
+	int len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*m));
+	for (struct rtattr* rta = (struct rtattr*)(m + 1); RTA_OK(rta, len);
+		 rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type != INET_DIAG_INFO) {
+			continue;
+		}
+		/* older kernels have a shorter struct */
+		struct tcp_info ti;
+		memset(&ti, 0, sizeof(ti));
+		memcpy(&ti, RTA_DATA(rta),
+			   RTA_PAYLOAD(rta) < sizeof(ti) ? RTA_PAYLOAD(rta) : sizeof(ti));
+		if (ti.tcpi_retransmits > 0) {
+			ps->tcp_stalled++;
+		} else if (ti.tcpi_last_data_recv < interval) {
+			ps->tcp_active++;
+		}
+	}
+}
+
+/* count the established TCP connections from addrs */
+static bool passive_tcp(const uint32_t* addrs, int num, unsigned int interval,
+						struct passive_state* ps)
+{
+	char buf[PASSIVE_BUF_SIZE];
+	struct {
+		struct nlmsghdr nh;
+		struct inet_diag_req_v2 r;
+	} req;
+
+	if (diag_fd < 0) {
+		diag_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+						 NETLINK_SOCK_DIAG);
+		if (diag_fd < 0) {
+			LOG_ERR("Could not open sock_diag socket: %s", strerror(errno));
+			return false;
+		}
+		/* this blocks the event loop, don't wait forever */
+		struct timeval tv = {.tv_sec = 0, .tv_usec = 100000};
+		setsockopt(diag_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = sizeof(req);
+	req.nh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.r.sdiag_family = AF_INET;
+	req.r.sdiag_protocol = IPPROTO_TCP;
+	req.r.idiag_states = 1 << TCP_ESTABLISHED;
+	req.r.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+
+	if (send(diag_fd, &req, sizeof(req), 0) < 0) {
+		return false;
+	}
+
+	while (true) {
+		int len = recv(diag_fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			/* the rest of the dump would confuse the next one */
+			close(diag_fd);
+			diag_fd = -1;
+			return false;
+		}
+		for (struct nlmsghdr* nh = (struct nlmsghdr*)buf;
+			 NLMSG_OK(nh, (unsigned int)len); nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				return true;
+			} else if (nh->nlmsg_type == NLMSG_ERROR) {
+				return false;
+			}
+			passive_tcp_msg(nh, addrs, num, interval, ps);
+		}
+	}
+}
+
+void passive_reset(struct ping_intf* pi)
+{
+	memset(&pi->passive, 0, sizeof(pi->passive));
+}
+
+/* returns true if the traffic shows that the link works and the next probe
+ * can be skipped */
+bool passive_check(struct ping_intf* pi)
+{
+	struct passive_state* ps = &pi->passive;
+	uint32_t addrs[PASSIVE_MAX_ADDRS];
+	uint64_t rx;
+	bool rx_ok = false;
+
+	if (netlink_link_stats(pi->device, &rx)) {
+		ps->rx_delta = ps->rx_valid ? rx - ps->rx_packets : 0;
+		rx_ok = ps->rx_valid && ps->rx_delta >= (unsigned int)pi->conf_passive;
+		ps->rx_packets = rx;
+		ps->rx_valid = true;
+	}
+
+	ps->tcp_active = 0;
+	ps->tcp_stalled = 0;
+	int num = netlink_link_addrs(pi->device, addrs, PASSIVE_MAX_ADDRS);
+	if (num > 0) {
+		passive_tcp(addrs, num, pi->conf_interval, ps);
+	}
+
+	ps->healthy = rx_ok && ps->tcp_active > 0 && ps->tcp_stalled == 0;
+	if (!ps->healthy || pi->state != ONLINE || pi->reply_pending
+		|| ps->skipped >= PASSIVE_MAX_SKIP) {
+		ps->skipped = 0;
+		return false;
+	}
+	ps->skipped++;
+	ps->cnt_skipped++;
+	return true;
+}
+
+void passive_finish(void)
+{
+	if (diag_fd >= 0) {
+		close(diag_fd);
+		diag_fd = -1;
+	}
+}
@@ -0,0 +1,147 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "main.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Phi accrual failure detector (Hayashibara et al.)
+ *
+ * Instead of a fixed timeout, learn the distribution of the time between
+ * replies and express how unlikely it is that a reply is still coming as
+ * phi = -log10(P(next reply later than now)). A phi of 3 means a 0.1% chance
+ * of a false alarm. Arrival times are assumed to be normally distributed.
+ */
+
+#define PHI_MIN_SAMPLES	  10
+#define PHI_MIN_STDDEV_MS 10 /* and 10% of the mean */
+#define PHI_MIN_INTERVALS 3	 /* timeout at least, unless `timeout` is less */
+
+static void phi_stats(struct phi_state* ps, double* mean, double* stddev)
+{
+	*mean = (double)ps->sum / ps->cnt;
+	double var = (double)ps->sum_sq / ps->cnt - *mean * *mean;
+	*stddev = var > 0 ? sqrt(var) : 0;
+
+	/* very regular links would otherwise be declared offline on the
+	 * slightest delay */
+	if (*stddev < *mean / 10) {
+		*stddev = *mean / 10;
+	}
+	if (*stddev < PHI_MIN_STDDEV_MS) {
+		*stddev = PHI_MIN_STDDEV_MS;
+	}
+}
+
+/* probability that the next reply comes later than y standard deviations
+ * after the mean */
+static double phi_p_later(double y)
+{
+	return 0.5 * erfc(y / M_SQRT2);
+}
+
+void phi_reset(struct ping_intf* pi)
+{
+	memset(&pi->phi, 0, sizeof(pi->phi));
+}
+
+/* record a reply. the interval since the last one is learned if sample is
+ * true, the gap after an outage says nothing about normal operation. but a
+ * gap which the fixed timeout would have tolerated is a lost probe, which is
+ * learned even if phi already went OFFLINE, otherwise single losses could
+ * never widen the distribution */
+void phi_add(struct ping_intf* pi, bool sample)
+{
+	struct phi_state* ps = &pi->phi;
+	struct timespec now;
+
+	clock_now(CLOCK_MONOTONIC, &now);
+	if (ps->last.tv_sec == 0 && ps->last.tv_nsec == 0) {
+		ps->last = now;
+		return;
+	}
+	long ms = timespec_diff_ms(ps->last, now);
+	if (sample || ms <= pi->conf_timeout) {
+		unsigned int val = ms > 0 ? ms : 0;
+
+		if (ps->cnt == PHI_WINDOW) {
+			unsigned int old = ps->samples[ps->idx];
+			ps->sum -= old;
+			ps->sum_sq -= (unsigned long long)old * old;
+		} else {
+			ps->cnt++;
+		}
+		ps->samples[ps->idx] = val;
+		ps->idx = (ps->idx + 1) % PHI_WINDOW;
+		ps->sum += val;
+		ps->sum_sq += (unsigned long long)val * val;
+	}
+	ps->last = now;
+}
+
+/* current suspicion level, 0 while not enough has been learned */
+double phi_value(struct ping_intf* pi)
+{
+	struct phi_state* ps = &pi->phi;
+	struct timespec now;
+	double mean, stddev;
+
+	if (ps->cnt < PHI_MIN_SAMPLES) {
+		return 0;
+	}
+	phi_stats(ps, &mean, &stddev);
+	clock_now(CLOCK_MONOTONIC, &now);
+	double p = phi_p_later((timespec_diff_ms(ps->last, now) - mean) / stddev);
+	return p > 1e-300 ? -log10(p) : 300;
+}
+
+/* ms after the last reply when phi reaches the configured threshold,
+ * or -1 while not enough has been learned */
+int phi_timeout(struct ping_intf* pi)
+{
+	struct phi_state* ps = &pi->phi;
+	double mean, stddev;
+
+	if (ps->cnt < PHI_MIN_SAMPLES) {
+		return -1;
+	}
+	phi_stats(ps, &mean, &stddev);
+
+	/* p_later is monotonic, find where it drops to 10^-threshold */
+	double target = pow(10, -pi->conf_phi);
+	double lo = -10, hi = 38;
+	for (int i = 0; i < 50; i++) {
+		double y = (lo + hi) / 2;
+		if (phi_p_later(y) > target) {
+			lo = y;
+		} else {
+			hi = y;
+		}
+	}
+	double ms = mean + hi * stddev;
+
+	/* with regular probes the distribution is narrow around the interval
+	 * until losses have been learned, and a single lost probe would be an
+	 * outage */
+	int interval = pi->budget.interval > pi->conf_interval
+					   ? pi->budget.interval
+					   : pi->conf_interval;
+	int min = interval * PHI_MIN_INTERVALS;
+	if (min > pi->conf_timeout) {
+		min = pi->conf_timeout;
+	}
+	return ms > min ? ms + 0.5 : min;
+}
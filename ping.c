@@ -22,6 +22,32 @@
 #include <time.h>
 #include <unistd.h>
 
+#define BURST_WAIT 1000 /* ms for replies after the last probe of a burst */
+
+/* upper bounds of RTT histogram buckets in ms, last bucket is +Inf */
+const unsigned int rtt_hist_bounds[RTT_HIST_BUCKETS - 1]
+	= {10, 25, 50, 100, 250, 500, 1000, 2500, 5000};
+
+static const struct ping_io ping_io_sockets = {
+	.icmp_init = icmp_init,
+	.icmp_echo_send = icmp_echo_send,
+	.icmp_echo_receive = icmp_echo_receive,
+	.icmp_set_ttl = icmp_set_ttl,
+	.icmp_trace_receive = icmp_trace_receive,
+	.tcp_connect = tcp_connect,
+	.tcp_check_connect = tcp_check_connect,
+};
+
+const struct ping_io* probe_io = &ping_io_sockets;
+
+static bool ping_resolve(struct ping_intf* pi);
+
+/* set socket operations, NULL restores the real sockets */
+void ping_set_io(const struct ping_io* ops)
+{
+	probe_io = ops != NULL ? ops : &ping_io_sockets;
+}
+
 static void ping_uloop_fd_close(struct uloop_fd* ufd)
 {
 	if (ufd != NULL && ufd->fd > 0) {
@@ -31,14 +57,48 @@ static void ping_uloop_fd_close(struct uloop_fd* ufd)
 	}
 }
 
+static void ping_rtt_hist_add(struct ping_intf* pi, unsigned int rtt)
+{
+	int i = 0;
+	while (i < RTT_HIST_BUCKETS - 1 && rtt > rtt_hist_bounds[i]) {
+		i++;
+	}
+	pi->rtt_hist[i]++;
+	pi->rtt_sum += rtt;
+}
+
+static void ping_fd_receive(struct uloop_fd* fd, struct ping_intf* pi);
+
+/* is fd one of the additional gateway or trace sockets, whose replies the
+ * probe sockets see as well */
+static bool ping_fd_internal(int fd)
+{
+	struct ping_intf* pi;
+	for_each_interface(pi) {
+		if (pi->gateway.ufd.fd == fd || pi->trace.ufd.fd == fd) {
+			return true;
+		}
+	}
+	return false;
+}
+
 /* uloop callback when received something on a ping socket */
 static void ping_fd_handler(struct uloop_fd* fd,
 							__attribute__((unused)) unsigned int events)
 {
 	struct ping_intf* pi = container_of(fd, struct ping_intf, ufd);
+	long long start;
+
+	debug_cb_start(&start);
+	ping_fd_receive(fd, pi);
+	debug_cb_end(DBG_CB_RECV, start, pi->name);
+}
 
+static void ping_fd_receive(struct uloop_fd* fd, struct ping_intf* pi)
+{
 	if (pi->conf_proto == ICMP) {
-		int received_fd = icmp_echo_receive(fd->fd);
+		int received_fd = probe_io->icmp_echo_receive(fd->fd);
+		debug_io(DBG_IO_RECV);
 		if (received_fd == -1) {
 			return;
 		} else {
@@ -47,7 +107,9 @@ static void ping_fd_handler(struct uloop_fd* fd,
 				if (interface != NULL) {
 					pi = container_of(&interface->ufd, struct ping_intf, ufd);
 				} else {
-					printf("ICMP echo received for different handle that was not found %d\n", received_fd);
+					if (!ping_fd_internal(received_fd)) {
+						debug_error(DBG_ERR_UNKNOWN_ID);
+					}
 					return;
 				}
 			}
@@ -63,7 +125,9 @@ static void ping_fd_handler(struct uloop_fd* fd,
 		 *
 		 * after that we just close the socket, as we don't need to send or
 		 * receive any data */
-		bool succ = tcp_check_connect(fd->fd);
+		bool succ = probe_io->tcp_check_connect(fd->fd);
+		debug_io(DBG_IO_RECV);
+		budget_tcp_close(pi, fd->fd, succ);
 		ping_uloop_fd_close(fd);
 		// printf("TCP connected %d\n", succ);
 		if (!succ) {
@@ -71,23 +135,74 @@ static void ping_fd_handler(struct uloop_fd* fd,
 		}
 	}
 
+	/* calculate round trip time */
+	struct timespec time_recv;
+	clock_now(CLOCK_MONOTONIC, &time_recv);
+	ping_reply(pi, timespec_diff_ms(pi->time_sent, time_recv));
+}
+
+/* offline timeout after a reply, the next probe may come later than the
+ * configured interval when the budget stretches it */
+static int ping_timeout(struct ping_intf* pi)
+{
+	int timeout = pi->conf_timeout + pi->last_rtt * 2;
+	if (pi->budget.interval > pi->conf_interval) {
+		timeout += pi->budget.interval - pi->conf_interval;
+	}
+	return timeout;
+}
+
+/* common handling of a reply, also for replies received by worker threads */
+void ping_reply(struct ping_intf* pi, unsigned int rtt)
+{
 	// LOG_DBG("Received pong on '%s'", pi->name);
 	pi->cnt_succ++;
+	budget_reply(pi);
 
-	/* calculate round trip time */
-	struct timespec time_recv;
-	clock_gettime(CLOCK_MONOTONIC, &time_recv);
-	pi->last_rtt = timespec_diff_ms(pi->time_sent, time_recv);
+	if (pi->burst) {
+		/* which probe of the burst was answered is not known, so neither is
+		 * the RTT. it's enough to know that the interface works */
+		uloop_timeout_cancel(&pi->timeout_burst);
+		pi->burst_left = 0;
+		pi->reply_pending = false;
+		uloop_timeout_set(&pi->timeout_offline, ping_timeout(pi));
+		if (!gateway_failed(pi)) {
+			state_change(slo_state(pi), pi);
+		}
+		return;
+	}
+	pi->last_rtt = rtt;
 	if (pi->last_rtt > pi->max_rtt) {
 		pi->max_rtt = pi->last_rtt;
 	}
+	ping_rtt_hist_add(pi, pi->last_rtt);
+	history_add(pi, HIST_REPLY, pi->last_rtt);
+	if (pi->reply_pending) {
+		series_add(pi, pi->last_rtt);
+		quality_add(pi, pi->last_rtt);
+		if (pi->compare != NULL) {
+			compare_reply(pi, pi->last_rtt);
+		}
+		pi->reply_pending = false;
+	}
 
 	/* online just confirmed: move timeout for offline to later
-	 * and give the next reply an extra window of two times the last RTT */
-	uloop_timeout_set(&pi->timeout_offline,
-					  pi->conf_timeout * 1000 + pi->last_rtt * 2);
+	 * and give the next reply an extra window of two times the last RTT.
+	 * with the phi detector the timeout comes from the learned reply
+	 * intervals, once there are enough of them */
+	int timeout = -1;
+	if (pi->conf_phi > 0) {
+		phi_add(pi, pi->state == ONLINE || pi->state == DEGRADED);
+		timeout = phi_timeout(pi);
+	}
+	if (timeout < 0) {
+		timeout = ping_timeout(pi);
+	}
+	uloop_timeout_set(&pi->timeout_offline, timeout);
 
-	state_change(ONLINE, pi);
+	if (!gateway_failed(pi)) {
+		state_change(slo_state(pi), pi);
+	}
 }
 
 /* uloop timeout callback when we did not receive a ping reply for a certain
@@ -95,30 +210,87 @@ static void ping_fd_handler(struct uloop_fd* fd,
 static void uto_offline_cb(struct uloop_timeout* t)
 {
 	struct ping_intf* pi = container_of(t, struct ping_intf, timeout_offline);
+	debug_timeout_lag(t);
+	trace_start(pi);
 	state_change(OFFLINE, pi);
 }
 
+/* members of a compare group send at multiples of their interval, so the
+ * probes of one round go out in the same event loop iteration. moves t to
+ * the next multiple after it */
+static void ping_align(struct ping_intf* pi, struct timespec* t)
+{
+	long long ms = (long long)t->tv_sec * 1000 + t->tv_nsec / 1000000;
+	ms = (ms / pi->conf_interval + 1) * pi->conf_interval;
+	t->tv_sec = ms / 1000;
+	t->tv_nsec = (ms % 1000) * 1000000;
+}
+
+/* re-schedule next sending relative to when this one was due, not to now,
+ * so that short intervals don't drift with the callback latency */
+static void ping_schedule_next(struct ping_intf* pi)
+{
+	struct timespec now;
+	clock_now(CLOCK_MONOTONIC, &now);
+
+	int interval = budget_interval(pi);
+	timespec_add_ms(&pi->time_next, interval);
+	if (timespec_before(&pi->time_next, &now)) {
+		/* we are late by more than one interval, don't send a burst */
+		pi->time_next = now;
+		if (pi->compare != NULL) {
+			ping_align(pi, &pi->time_next);
+		} else {
+			timespec_add_ms(&pi->time_next, interval);
+		}
+	}
+	uloop_timeout_set(&pi->timeout_send, timespec_diff_ms(now, pi->time_next));
+}
+
 /* uloop timeout callback when it's time to send a ping */
 static void uto_ping_send_cb(struct uloop_timeout* t)
 {
 	struct ping_intf* pi = container_of(t, struct ping_intf, timeout_send);
-	ping_send(pi);
-	/* re-schedule next sending */
-	uloop_timeout_set(t, pi->conf_interval * 1000);
+	long long start;
+
+	debug_timeout_lag(t);
+	debug_cb_start(&start);
+	pi->burst = false;
+	if (pi->compare != NULL) {
+		compare_round(pi, (long long)pi->time_next.tv_sec * 1000
+							  + pi->time_next.tv_nsec / 1000000);
+	}
+	if (!budget_allow(pi)) {
+		/* no probes until the next period, keep the last state */
+		uloop_timeout_set(&pi->timeout_offline, ping_timeout(pi));
+	} else if (pi->conf_passive > 0 && passive_check(pi)) {
+		/* real traffic shows that the link works, like a reply would */
+		uloop_timeout_set(&pi->timeout_offline, ping_timeout(pi));
+	} else {
+		ping_send(pi);
+	}
+	ping_schedule_next(pi);
+	debug_cb_end(DBG_CB_SEND, start, pi->name);
 }
 
 bool ping_init(struct ping_intf* pi)
 {
 	int ret;
+	int ubus_ret = -1;
 
-	if (pi->ufd.fd != 0) {
+	if (pi->ufd.fd != 0 || pi->worker > 0) {
 		LOG_ERR("Ping on '%s' already init", pi->name);
 		return true;
 	}
 
 	if (!pi->conf_ignore_ubus) {
 		ret = ubus_interface_get_status(pi->name, pi->device, MAX_IFNAME_LEN);
-		if (ret < 0) {
+		ubus_ret = ret;
+		if (ret == -2) {
+			/* continued from notify_interface_status() */
+			pi->status_pending = true;
+			return false;
+		} else if (ret < 0) {
 			LOG_INF("Interface '%s' not found or error", pi->name);
 			pi->state = UNKNOWN;
 			return false;
@@ -126,13 +298,23 @@ bool ping_init(struct ping_intf* pi)
 			LOG_INF("Interface '%s' not up", pi->name);
 			pi->state = DOWN;
 			return false;
-		} else if (ret == 1) {
-			LOG_INF("Interface '%s' (%s) has no default route but local one",
-					pi->name, pi->device);
-			pi->state = UP_WITHOUT_DEFAULT_ROUTE;
-		} else if (ret == 2) {
-			pi->state = UP;
 		}
+	} else if (pi->conf_device[0] != '\0') {
+		strcpy(pi->device, pi->conf_device);
+	}
+
+	/* link state and default route from the kernel via netlink, when it
+	 * doesn't know the device the default route from netifd */
+	ret = pi->device[0] != '\0' ? netlink_link_carrier(pi->device) : -1;
+	if (ret == 0) {
+		LOG_INF("Interface '%s' (%s) has no carrier", pi->name, pi->device);
+		pi->state = DOWN;
+		return false;
+	} else if ((ret < 0 && ubus_ret == 1)
+			   || (ret > 0 && !netlink_has_default_route(pi->device))) {
+		LOG_INF("Interface '%s' (%s) has no default route but local one",
+				pi->name, pi->device);
+		pi->state = UP_WITHOUT_DEFAULT_ROUTE;
 	} else {
 		pi->state = UP;
 	}
@@ -141,50 +323,90 @@ bool ping_init(struct ping_intf* pi)
 			pi->name, pi->device);
 
 	/* init ICMP socket. for TCP we open a new socket every time */
-	if (pi->conf_proto == ICMP) {
-		ret = icmp_init(pi->device);
-		if (ret < 0) {
+	if (pi->conf_proto == ICMP && worker_enabled()
+		&& pi->conf_compare[0] == '\0' && pi->conf_passive == 0
+		&& pi->conf_budget == 0 && !xdp_enabled() && !pi->worker_failed) {
+		/* hand over to a worker thread, which sends and receives on its own
+		 * socket. it needs the address, later it's resolved again in
+		 * ping_sent() */
+		ping_resolve(pi);
+		if (!worker_add(pi)) {
 			return false;
 		}
-
-		/* add socket handler to uloop */
-		pi->ufd.fd = ret;
-		pi->ufd.cb = ping_fd_handler;
-		ret = uloop_fd_add(&pi->ufd, ULOOP_READ);
+	} else if (pi->conf_proto == ICMP) {
+		ret = probe_io->icmp_init(pi->device);
 		if (ret < 0) {
-			LOG_ERR("Could not add uloop fd %d for '%s'", pi->ufd.fd, pi->name);
 			return false;
 		}
+
+		if (uring_enabled()) {
+			pi->ufd.fd = ret;
+			if (!uring_recv_start(pi)) {
+				ping_uloop_fd_close(&pi->ufd);
+				return false;
+			}
+		} else {
+			/* add socket handler to uloop */
+			pi->ufd.fd = ret;
+			pi->ufd.cb = ping_fd_handler;
+			ret = uloop_fd_add(&pi->ufd, ULOOP_READ);
+			if (ret < 0) {
+				LOG_ERR("Could not add uloop fd %d for '%s'", pi->ufd.fd,
+						pi->name);
+				return false;
+			}
+		}
 	}
 
 	/* regular sending of ping (start first in 1 sec) */
-	pi->timeout_send.cb = uto_ping_send_cb;
-	ret = uloop_timeout_set(&pi->timeout_send, 1000);
-	if (ret < 0) {
-		LOG_ERR("Could not add uloop send timeout for '%s'", pi->name);
-		return false;
+	if (pi->worker == 0) {
+		struct timespec now;
+		clock_now(CLOCK_MONOTONIC, &now);
+		pi->timeout_send.cb = uto_ping_send_cb;
+		pi->time_next = now;
+		timespec_add_ms(&pi->time_next, 1000);
+		if (pi->conf_compare[0] != '\0') {
+			ping_align(pi, &pi->time_next);
+			compare_join(pi);
+		}
+		ret = uloop_timeout_set(&pi->timeout_send,
+								timespec_diff_ms(now, pi->time_next));
+		if (ret < 0) {
+			LOG_ERR("Could not add uloop send timeout for '%s'", pi->name);
+			return false;
+		}
 	}
 
 	/* timeout for offline state, if no reply has been received
 	 *
-	 * add 900ms to the timeout to give the last reply a chance to arrive
-	 * before the timeout triggers, in case the timout is a multiple of
-	 * interval. this will later be adjusted to the last RTT
+	 * add 900ms (or 90% of shorter intervals) to the timeout to give the
+	 * last reply a chance to arrive before the timeout triggers, in case the
+	 * timout is a multiple of interval. this will later be adjusted to the
+	 * last RTT
 	 */
+	int grace = pi->conf_interval * 9 / 10;
 	pi->timeout_offline.cb = uto_offline_cb;
 	ret = uloop_timeout_set(&pi->timeout_offline,
-							pi->conf_timeout * 1000 + 900);
+							pi->conf_timeout + (grace < 900 ? grace : 900));
 	if (ret < 0) {
 		LOG_ERR("Could not add uloop offline timeout for '%s'", pi->name);
 		return false;
 	}
 
-	/* reset counters */
-	pi->cnt_sent = 0;
-	pi->cnt_succ = 0;
-	pi->last_rtt = 0;
-	pi->max_rtt = 0;
+	/* reset counters, unless they were restored at startup */
+	if (!state_warm_start(pi)) {
+		pi->cnt_sent = 0;
+		pi->cnt_succ = 0;
+		pi->last_rtt = 0;
+		pi->max_rtt = 0;
+		pi->rtt_sum = 0;
+		memset(pi->rtt_hist, 0, sizeof(pi->rtt_hist));
+	}
+	phi_reset(pi);
+	quality_reset(pi);
+	passive_reset(pi);
 
+	gateway_start(pi);
 	return true;
 }
 
@@ -192,12 +414,17 @@ static bool ping_resolve(struct ping_intf* pi)
 {
 	struct addrinfo hints;
 	struct addrinfo* addr;
+	long long start;
 
 	memset(&hints, 0, sizeof(struct addrinfo));
 	hints.ai_family = AF_INET;
 	hints.ai_socktype = pi->conf_proto == ICMP ? SOCK_DGRAM : SOCK_STREAM;
 
+	/* this blocks the loop, e.g. when the DNS server is not reachable */
+	debug_cb_start(&start);
 	int r = getaddrinfo(pi->conf_hostname, NULL, &hints, &addr);
+	debug_cb_end(DBG_CB_RESOLVE, start, pi->conf_hostname);
+	debug_io(DBG_IO_RESOLVE);
 	if (r < 0 || addr == NULL) {
 		LOG_ERR("Failed to resolve '%s'", pi->conf_hostname);
 		return false;
@@ -205,8 +432,8 @@ static bool ping_resolve(struct ping_intf* pi)
 
 	/* use only first address */
 	struct sockaddr_in* sa = (struct sockaddr_in*)addr->ai_addr;
-	printf("Resolved %s to %s\n", pi->conf_hostname,
-		   inet_ntoa((struct in_addr)sa->sin_addr));
+	LOG_DBG("Resolved %s to %s", pi->conf_hostname,
+			inet_ntoa((struct in_addr)sa->sin_addr));
 	pi->conf_host = sa->sin_addr.s_addr;
 
 	freeaddrinfo(addr);
@@ -219,12 +446,19 @@ static bool ping_resolve(struct ping_intf* pi)
  * checked in the uloop socket callback above */
 static bool ping_send_tcp(struct ping_intf* pi)
 {
+	if (uring_enabled()) {
+		return uring_tcp_connect(pi);
+	}
+
 	if (pi->ufd.fd > 0) {
 		// LOG_DBG("TCP connection timed out '%s'", pi->name);
+		budget_tcp_close(pi, pi->ufd.fd, false);
 		ping_uloop_fd_close(&pi->ufd);
 	}
 
-	int ret = tcp_connect(pi->device, pi->conf_host, pi->conf_tcp_port);
+	int ret = probe_io->tcp_connect(pi->device, pi->conf_host,
+									pi->conf_tcp_port);
+	debug_io(DBG_IO_CONNECT);
 	if (ret > 0) {
 		/* add socket handler to uloop.
 		 * when connect() finishes, select indicates writability */
@@ -239,12 +473,59 @@ static bool ping_send_tcp(struct ping_intf* pi)
 	return true;
 }
 
+static bool ping_need_resolve(struct ping_intf* pi)
+{
+	/* resolve at least every 10th time */
+	return pi->conf_host == 0 || (pi->state != ONLINE && pi->state != DEGRADED)
+		   || pi->cnt_sent % 10 == 0;
+}
+
+/* common handling after a probe has been sent, also by worker threads */
+void ping_sent(struct ping_intf* pi)
+{
+	debug_io(DBG_IO_PROBE);
+	pi->cnt_sent++;
+	clock_now(CLOCK_MONOTONIC, &pi->time_sent);
+	history_add(pi, HIST_SENT, 0);
+	budget_sent(pi);
+	if (pi->reply_pending) { /* previous probe was lost */
+		series_add(pi, -1);
+		quality_add(pi, -1);
+		slo_check(pi);
+		if (pi->state == ONLINE || pi->state == DEGRADED) {
+			/* suspicious, find out where the problem is early */
+			trace_start(pi);
+		}
+	}
+	pi->reply_pending = true;
+
+	/* workers send on their own, so resolve for the next one here */
+	if (pi->worker > 0 && ping_need_resolve(pi)) {
+		int host = pi->conf_host;
+		if (ping_resolve(pi) && pi->conf_host != host) {
+			worker_update(pi);
+		}
+	}
+}
+
+/* worker thread could not send a probe */
+void ping_send_error(struct ping_intf* pi)
+{
+	LOG_ERR("Could not send ping on '%s'", pi->name);
+	if (ping_resolve(pi)) {
+		worker_update(pi);
+	}
+}
+
 bool ping_send(struct ping_intf* pi)
 {
 	bool ret = false;
 
-	/* resolve at least every 10th time */
-	if (pi->conf_host == 0 || pi->state != ONLINE || pi->cnt_sent % 10 == 0) {
+	if (pi->worker > 0) {
+		return true; /* the worker thread sends by itself */
+	}
+
+	if (ping_need_resolve(pi)) {
 		if (!ping_resolve(pi)) {
 			return false;
 		}
@@ -256,24 +537,100 @@ bool ping_send(struct ping_intf* pi)
 			LOG_ERR("ping not init on '%s'", pi->name);
 			return false;
 		}
-		ret = icmp_echo_send(pi->ufd.fd, pi->conf_host, pi->cnt_sent);
+		if (xdp_enabled()) {
+			xdp_update(pi);
+		}
+		if (pi->uring_recv != NULL) {
+			ret = uring_icmp_send(pi);
+		} else {
+			ret = probe_io->icmp_echo_send(pi->ufd.fd, pi->conf_host,
+										 pi->cnt_sent);
+			debug_io(DBG_IO_SEND);
+		}
 	} else if (pi->conf_proto == TCP) {
 		ret = ping_send_tcp(pi);
 	}
 
 	/* common code */
 	if (ret) {
-		pi->cnt_sent++;
-		clock_gettime(CLOCK_MONOTONIC, &pi->time_sent);
+		ping_sent(pi);
 	} else {
 		LOG_ERR("Could not send ping on '%s'", pi->name);
 	}
 	return ret;
 }
 
+static void uto_burst_cb(struct uloop_timeout* t)
+{
+	struct ping_intf* pi = container_of(t, struct ping_intf, timeout_burst);
+
+	debug_timeout_lag(t);
+	if (pi->burst_left <= 0 || !budget_allow(pi)) {
+		return;
+	}
+	/* unanswered probes of the burst are not counted as lost */
+	pi->reply_pending = false;
+	ping_send(pi);
+	if (--pi->burst_left > 0) {
+		uloop_timeout_set(t, pi->conf_burst_interval);
+	}
+}
+
+/*
+ * send conf_burst probes conf_burst_interval apart right away, e.g. after
+ * ifup, for a quick first result: the first reply makes the interface ONLINE
+ * and ends the burst, without any reply it goes OFFLINE shortly after the
+ * burst instead of after the timeout. regular probes continue after it.
+ * returns false if no burst was started
+ */
+bool ping_burst(struct ping_intf* pi)
+{
+	struct timespec now;
+
+	if (pi->conf_burst <= 0 || pi->worker > 0 || !pi->timeout_send.pending) {
+		return false;
+	}
+
+	LOG_INF("Sending burst of %d probes on '%s'", pi->conf_burst, pi->name);
+	int len = (pi->conf_burst - 1) * pi->conf_burst_interval;
+	clock_now(CLOCK_MONOTONIC, &now);
+	pi->time_next = now;
+	timespec_add_ms(&pi->time_next, len + pi->conf_interval);
+	if (pi->compare != NULL) {
+		ping_align(pi, &pi->time_next);
+	}
+	uloop_timeout_set(&pi->timeout_send, timespec_diff_ms(now, pi->time_next));
+
+	/* only decide faster when the state is not known yet. a working
+	 * interface, e.g. after a reset, keeps its timeout, a long RTT would
+	 * otherwise make it OFFLINE */
+	int timeout = len + BURST_WAIT;
+	if (pi->state != ONLINE && pi->state != DEGRADED
+		&& pi->timeout_offline.pending
+		&& timeout < uloop_timeout_remaining(&pi->timeout_offline)) {
+		uloop_timeout_set(&pi->timeout_offline, timeout);
+	}
+
+	pi->burst = true;
+	pi->burst_left = pi->conf_burst;
+	pi->timeout_burst.cb = uto_burst_cb;
+	uto_burst_cb(&pi->timeout_burst);
+	return true;
+}
+
 void ping_stop(struct ping_intf* pi)
 {
 	uloop_timeout_cancel(&pi->timeout_offline);
 	uloop_timeout_cancel(&pi->timeout_send);
+	uloop_timeout_cancel(&pi->timeout_burst);
+	pi->burst_left = 0;
+	pi->burst = false;
+	uring_cancel(pi);
+	xdp_remove(pi);
 	ping_uloop_fd_close(&pi->ufd);
+	worker_remove(pi);
+	compare_leave(pi);
+	trace_stop(pi);
+	gateway_stop(pi);
+	pi->reply_pending = false;
 }
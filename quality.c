@@ -0,0 +1,222 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "log.h"
+#include "main.h"
+#include <libubox/blobmsg.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Link quality score and best interface
+ *
+ * The score of an interface is calculated from its last QUALITY_WINDOW probes
+ * as weighted sum of a latency percentile, jitter (mean difference of
+ * consecutive RTTs) in ms and loss in percent. Lower is better. The best
+ * interface is the ONLINE one with the lowest score, but it is only replaced
+ * by one which is better by more than the hysteresis.
+ */
+
+static int w_latency = 1;
+static int w_jitter = 1;
+static int w_loss = 10;
+static int percentile = 90;
+static int hysteresis = 20;
+
+static struct ping_intf* best;
+
+void quality_init(const struct ping_conf* conf)
+{
+	if (conf->score_latency >= 0) {
+		w_latency = conf->score_latency;
+	}
+	if (conf->score_jitter >= 0) {
+		w_jitter = conf->score_jitter;
+	}
+	if (conf->score_loss >= 0) {
+		w_loss = conf->score_loss;
+	}
+	if (conf->score_percentile > 0 && conf->score_percentile <= 100) {
+		percentile = conf->score_percentile;
+	}
+	if (conf->score_hysteresis >= 0 && conf->score_hysteresis < 100) {
+		hysteresis = conf->score_hysteresis;
+	}
+}
+
+void quality_reset(struct ping_intf* pi)
+{
+	memset(&pi->quality, 0, sizeof(pi->quality));
+}
+
+static int quality_cmp_uint(const void* a, const void* b)
+{
+	unsigned int x = *(const unsigned int*)a;
+	unsigned int y = *(const unsigned int*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void quality_calc(struct quality_state* q)
+{
+	unsigned int rtts[QUALITY_WINDOW];
+	unsigned int num = 0;
+	unsigned int lost = 0;
+	unsigned long jitter_sum = 0;
+	unsigned int prev = QUALITY_LOST;
+
+	/* oldest to newest, for the differences of consecutive RTTs */
+	for (unsigned int i = 0; i < q->cnt; i++) {
+		unsigned int rtt
+			= q->rtt[(q->idx + QUALITY_WINDOW - q->cnt + i) % QUALITY_WINDOW];
+		if (rtt == QUALITY_LOST) {
+			lost++;
+			continue;
+		}
+		if (prev != QUALITY_LOST) {
+			jitter_sum += rtt > prev ? rtt - prev : prev - rtt;
+		}
+		prev = rtt;
+		rtts[num++] = rtt;
+	}
+
+	q->loss = lost * 100 / q->cnt;
+	q->jitter = num > 1 ? jitter_sum / (num - 1) : 0;
+	if (num > 0) {
+		qsort(rtts, num, sizeof(rtts[0]), quality_cmp_uint);
+		q->latency = rtts[(num - 1) * percentile / 100];
+		q->p95 = rtts[(num - 1) * 95 / 100];
+	} else {
+		q->latency = 0;
+		q->p95 = 0;
+	}
+	q->score = (double)w_latency * q->latency + (double)w_jitter * q->jitter
+			   + (double)w_loss * q->loss;
+}
+
+/* pi replaces the current best only if it's better by the hysteresis */
+static bool quality_better(struct ping_intf* pi)
+{
+	return best == NULL || best->state != ONLINE
+		   || pi->quality.score * 100 < best->quality.score * (100 - hysteresis);
+}
+
+static void quality_update_best(void)
+{
+	struct ping_intf* pi;
+	struct ping_intf* cand = NULL;
+
+	for_each_interface(pi) {
+		if (pi->state == ONLINE && pi->quality.cnt > 0
+			&& (cand == NULL || pi->quality.score < cand->quality.score)) {
+			cand = pi;
+		}
+	}
+
+	if (cand == NULL || cand == best || !quality_better(cand)) {
+		return;
+	}
+
+	const char* previous = best != NULL ? best->name : "";
+	LOG_NOTI("Best interface changed from '%s' to '%s' (score %.0f)",
+			 previous, cand->name, cand->quality.score);
+	scripts_run_best(cand, previous);
+	best = cand;
+}
+
+/* add probe result, rtt in ms or -1 for lost */
+void quality_add(struct ping_intf* pi, int rtt)
+{
+	struct quality_state* q = &pi->quality;
+
+	q->rtt[q->idx] = rtt >= 0 ? (unsigned int)rtt : QUALITY_LOST;
+	q->idx = (q->idx + 1) % QUALITY_WINDOW;
+	if (q->cnt < QUALITY_WINDOW) {
+		q->cnt++;
+	}
+	quality_calc(q);
+
+	/* only look at all interfaces when the best one could change */
+	if (pi->state == ONLINE && (pi == best || quality_better(pi))) {
+		quality_update_best();
+	}
+}
+
+void quality_state_changed(struct ping_intf* pi)
+{
+	if (pi == best || pi->state == ONLINE) {
+		quality_update_best();
+	}
+}
+
+/* interface is going away */
+void quality_remove(struct ping_intf* pi)
+{
+	if (pi == best) {
+		best = NULL;
+	}
+}
+
+struct ping_intf* quality_best(void)
+{
+	return best;
+}
+
+/* best interface saved before a restart, without running the scripts */
+void quality_restore_best(struct ping_intf* pi)
+{
+	best = pi;
+}
+
+static int quality_cmp_intf(const void* a, const void* b)
+{
+	const struct ping_intf* x = *(struct ping_intf* const*)a;
+	const struct ping_intf* y = *(struct ping_intf* const*)b;
+	return x->quality.score < y->quality.score ? -1
+											   : x->quality.score > y->quality.score;
+}
+
+/* add ONLINE interfaces ordered by score and the best one to ubus reply */
+void quality_blob(struct blob_buf* b)
+{
+	struct ping_intf* pi;
+	struct ping_intf** ranked;
+	int num = 0;
+
+	for_each_interface(pi) {
+		num++;
+	}
+	ranked = calloc(num > 0 ? num : 1, sizeof(*ranked));
+	if (ranked == NULL) {
+		return;
+	}
+
+	num = 0;
+	for_each_interface(pi) {
+		if (pi->state == ONLINE && pi->quality.cnt > 0) {
+			ranked[num++] = pi;
+		}
+	}
+	qsort(ranked, num, sizeof(*ranked), quality_cmp_intf);
+
+	void* arr = blobmsg_open_array(b, "ranked_interfaces");
+	for (int i = 0; i < num; i++) {
+		blobmsg_add_string(b, NULL, ranked[i]->name);
+	}
+	blobmsg_close_array(b, arr);
+	free(ranked);
+
+	if (best != NULL && best->state == ONLINE) {
+		blobmsg_add_string(b, "best_interface", best->name);
+	}
+}
@@ -0,0 +1,418 @@
+/* pingcheck-report - SLA report from pingcheck history files
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "history.h"
+#include <endian.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_INTERFACES 64
+#define RTT_MAX		   10000 /* ms, larger RTTs are counted here */
+
+/* same order as enum online_state in main.h */
+static const char* state_names[] = {
+	"UNKNOWN", "DOWN", "UP_WITHOUT_DEFAULT_ROUTE", "UP", "OFFLINE", "ONLINE",
+	"DEGRADED",
+};
+#define NUM_STATES (sizeof(state_names) / sizeof(state_names[0]))
+#define ST_UNKNOWN	0
+#define ST_DOWN		1
+#define ST_OFFLINE	4
+#define ST_ONLINE	5
+#define ST_DEGRADED 6
+
+struct outage {
+	uint64_t start;
+	uint64_t end;
+	int state;
+};
+
+struct intf_report {
+	char name[HISTORY_NAME_LEN];
+	unsigned long sent;
+	unsigned long replies;
+	unsigned int rtt_max;
+	unsigned int* rtt_hist; /* RTT_MAX + 1 buckets of 1ms */
+	int state;
+	uint64_t state_since; /* 0 if no state known yet */
+	uint64_t outage_since;
+	uint64_t time_in_state[NUM_STATES];
+	struct outage* outages;
+	int num_outages;
+	int outage_cap;
+};
+
+static struct intf_report intfs[MAX_INTERFACES];
+static int num_intfs;
+
+/* report range, unix time in ms */
+static uint64_t range_start;
+static uint64_t range_end = UINT64_MAX;
+
+/* time of the last record over all files */
+static uint64_t time_last;
+
+static struct intf_report* report_intf(const char* name)
+{
+	for (int i = 0; i < num_intfs; i++) {
+		if (strncmp(intfs[i].name, name, HISTORY_NAME_LEN) == 0) {
+			return &intfs[i];
+		}
+	}
+	if (num_intfs >= MAX_INTERFACES) {
+		return NULL;
+	}
+
+	struct intf_report* ir = &intfs[num_intfs];
+	ir->rtt_hist = calloc(RTT_MAX + 1, sizeof(unsigned int));
+	if (ir->rtt_hist == NULL) {
+		return NULL;
+	}
+	strncpy(ir->name, name, HISTORY_NAME_LEN - 1);
+	num_intfs++;
+	return ir;
+}
+
+static bool is_outage(int state)
+{
+	return state == ST_DOWN || state == ST_OFFLINE;
+}
+
+/* account time in current state up to 'now', clipped to report range */
+static void report_state_time(struct intf_report* ir, uint64_t now)
+{
+	if (ir->state_since == 0) {
+		return;
+	}
+	uint64_t from = ir->state_since > range_start ? ir->state_since
+												  : range_start;
+	uint64_t to = now < range_end ? now : range_end;
+	if (to > from) {
+		ir->time_in_state[ir->state] += to - from;
+	}
+}
+
+static void report_outage_add(struct intf_report* ir, uint64_t start,
+							  uint64_t end, int state)
+{
+	if (end < range_start || start > range_end) {
+		return;
+	}
+	if (ir->num_outages == ir->outage_cap) {
+		int cap = ir->outage_cap ? ir->outage_cap * 2 : 16;
+		struct outage* o = realloc(ir->outages, cap * sizeof(*o));
+		if (o == NULL) {
+			return;
+		}
+		ir->outages = o;
+		ir->outage_cap = cap;
+	}
+	ir->outages[ir->num_outages++] = (struct outage){start, end, state};
+}
+
+static void report_state(struct intf_report* ir, uint64_t now, int state)
+{
+	if (state < 0 || state >= (int)NUM_STATES) {
+		return;
+	}
+
+	report_state_time(ir, now);
+
+	/* consecutive DOWN and OFFLINE count as one outage */
+	if (is_outage(state) && !is_outage(ir->state)) {
+		ir->outage_since = now;
+	} else if (!is_outage(state) && is_outage(ir->state)
+			   && ir->state_since != 0) {
+		report_outage_add(ir, ir->outage_since, now, ir->state);
+	}
+
+	ir->state_since = now;
+	ir->state = state;
+}
+
+/* pingcheck was not running since the last record before a restart, so
+ * that time is not counted in the last known states */
+static void report_restart(void)
+{
+	for (int i = 0; i < num_intfs; i++) {
+		if (intfs[i].state_since != 0 && intfs[i].state != ST_UNKNOWN) {
+			report_state(&intfs[i], time_last, ST_UNKNOWN);
+		}
+	}
+}
+
+static bool report_file(const char* path)
+{
+	struct intf_report* map[HISTORY_MAX_NAMES] = {NULL};
+	struct stat st;
+	uint64_t now = 0;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		return false;
+	}
+	if ((size_t)st.st_size < sizeof(struct history_header)) {
+		fprintf(stderr, "%s: file too short\n", path);
+		close(fd);
+		return false;
+	}
+
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		perror(path);
+		return false;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	const struct history_header* hdr = data;
+	if (le32toh(hdr->magic) != HISTORY_MAGIC
+		|| le16toh(hdr->version) != HISTORY_VERSION
+		|| le16toh(hdr->record_size) != sizeof(struct history_record)) {
+		fprintf(stderr, "%s: not a pingcheck history file\n", path);
+		munmap(data, st.st_size);
+		return false;
+	}
+
+	const struct history_record* r = (const void*)(hdr + 1);
+	size_t num = (st.st_size - sizeof(*hdr)) / sizeof(*r);
+
+	for (size_t i = 0; i < num; i++, r++) {
+		if (r->type == HIST_BASE) {
+			now = ((uint64_t)le32toh(r->time_delta) << 16)
+				  | le16toh(r->value);
+			continue;
+		}
+		if (now == 0) { /* no base yet, can't use this record */
+			continue;
+		}
+		now += le32toh(r->time_delta);
+
+		if (r->type == HIST_START) {
+			report_restart();
+		}
+		if (now > time_last) {
+			time_last = now;
+		}
+		if (r->type == HIST_START) {
+			continue;
+		}
+
+		if (r->intf >= HISTORY_MAX_NAMES || hdr->names[r->intf][0] == '\0') {
+			continue;
+		}
+		if (map[r->intf] == NULL) {
+			char name[HISTORY_NAME_LEN];
+			memcpy(name, hdr->names[r->intf], HISTORY_NAME_LEN);
+			name[HISTORY_NAME_LEN - 1] = '\0';
+			map[r->intf] = report_intf(name);
+			if (map[r->intf] == NULL) {
+				continue;
+			}
+		}
+		struct intf_report* ir = map[r->intf];
+
+		if (r->type == HIST_STATE) {
+			report_state(ir, now, le16toh(r->value));
+			continue;
+		}
+
+		if (now < range_start || now > range_end) {
+			continue;
+		}
+		if (r->type == HIST_SENT) {
+			ir->sent++;
+		} else if (r->type == HIST_REPLY) {
+			unsigned int rtt = le16toh(r->value);
+			ir->replies++;
+			ir->rtt_hist[rtt < RTT_MAX ? rtt : RTT_MAX]++;
+			if (rtt > ir->rtt_max) {
+				ir->rtt_max = rtt;
+			}
+		}
+	}
+
+	munmap(data, st.st_size);
+	return true;
+}
+
+static unsigned int report_percentile(struct intf_report* ir, int pct)
+{
+	unsigned long want = (ir->replies * pct + 99) / 100;
+	unsigned long cnt = 0;
+	for (unsigned int i = 0; i <= RTT_MAX; i++) {
+		cnt += ir->rtt_hist[i];
+		if (cnt >= want) {
+			return i;
+		}
+	}
+	return RTT_MAX;
+}
+
+static const char* format_time(uint64_t ms)
+{
+	static char buf[32];
+	time_t t = ms / 1000;
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+	return buf;
+}
+
+static const char* format_duration(uint64_t ms)
+{
+	static char buf[32];
+	unsigned long s = ms / 1000;
+	if (s >= 86400) {
+		snprintf(buf, sizeof(buf), "%lud %luh %lum", s / 86400,
+				 s % 86400 / 3600, s % 3600 / 60);
+	} else if (s >= 3600) {
+		snprintf(buf, sizeof(buf), "%luh %lum %lus", s / 3600, s % 3600 / 60,
+				 s % 60);
+	} else {
+		snprintf(buf, sizeof(buf), "%lum %lus", s / 60, s % 60);
+	}
+	return buf;
+}
+
+static void report_print(struct intf_report* ir)
+{
+	uint64_t known = 0;
+	for (unsigned int i = 0; i < NUM_STATES; i++) {
+		if (i != ST_UNKNOWN) {
+			known += ir->time_in_state[i];
+		}
+	}
+
+	printf("Interface %s\n", ir->name);
+	if (known > 0) {
+		printf("  Availability: %.3f %% (online %s",
+			   ir->time_in_state[ST_ONLINE] * 100.0 / known,
+			   format_duration(ir->time_in_state[ST_ONLINE]));
+		printf(" of %s)\n", format_duration(known));
+		if (ir->time_in_state[ST_DEGRADED] > 0) {
+			printf("  Degraded:     %.3f %% (%s)\n",
+				   ir->time_in_state[ST_DEGRADED] * 100.0 / known,
+				   format_duration(ir->time_in_state[ST_DEGRADED]));
+		}
+	} else {
+		printf("  Availability: no state information\n");
+	}
+
+	printf("  Probes:       %lu sent, %lu replies", ir->sent, ir->replies);
+	if (ir->sent > 0) {
+		printf(", %.2f %% loss",
+			   ir->sent > ir->replies
+				   ? (ir->sent - ir->replies) * 100.0 / ir->sent
+				   : 0.0);
+	}
+	printf("\n");
+
+	if (ir->replies > 0) {
+		printf("  RTT:          p50 %u ms, p90 %u ms, p95 %u ms, p99 %u ms, "
+			   "max %u ms\n",
+			   report_percentile(ir, 50), report_percentile(ir, 90),
+			   report_percentile(ir, 95), report_percentile(ir, 99),
+			   ir->rtt_max);
+	}
+
+	printf("  Outages:      %d\n", ir->num_outages);
+	for (int i = 0; i < ir->num_outages; i++) {
+		struct outage* o = &ir->outages[i];
+		printf("    %s  ", format_time(o->start));
+		printf("%-12s %s\n", format_duration(o->end - o->start),
+			   state_names[o->state]);
+	}
+}
+
+/* unix time in seconds, negative values are relative to now */
+static uint64_t parse_time(const char* str)
+{
+	long long t = atoll(str);
+	if (t < 0) {
+		t += time(NULL);
+	}
+	return t > 0 ? (uint64_t)t * 1000 : 0;
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr,
+			"Usage: %s [-s start] [-e end] [-i interface] file...\n"
+			"  -s, -e  unix time in seconds, negative is relative to now\n"
+			"  -i      only report this interface\n"
+			"Files are read in order, give rotated files first.\n",
+			name);
+}
+
+int main(int argc, char** argv)
+{
+	const char* only = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:e:i:h")) != -1) {
+		switch (opt) {
+		case 's':
+			range_start = parse_time(optarg);
+			break;
+		case 'e':
+			range_end = parse_time(optarg);
+			break;
+		case 'i':
+			only = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		report_file(argv[i]);
+	}
+
+	/* close open states and outages at the end of the data */
+	uint64_t end = time_last < range_end ? time_last : range_end;
+	for (int i = 0; i < num_intfs; i++) {
+		struct intf_report* ir = &intfs[i];
+		report_state_time(ir, end);
+		if (ir->state_since != 0 && is_outage(ir->state)) {
+			report_outage_add(ir, ir->outage_since, end, ir->state);
+		}
+	}
+
+	if (range_start > 0 || range_end != UINT64_MAX) {
+		printf("Period %s", format_time(range_start));
+		printf(" - %s\n\n", format_time(end));
+	}
+
+	for (int i = 0; i < num_intfs; i++) {
+		if (only == NULL || strcmp(intfs[i].name, only) == 0) {
+			report_print(&intfs[i]);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
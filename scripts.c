@@ -16,6 +16,8 @@
 #include "main.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 /* run queue for scripts */
@@ -24,46 +26,108 @@ static struct runqueue runq;
 /* for panic scripts */
 static struct runqueue_process proc_panic;
 
+/* for best interface scripts, the names are copied as the interfaces may go
+ * away before the scripts run */
+static struct runqueue_process proc_best;
+static char best_intf[MAX_IFNAME_LEN];
+static char best_dev[MAX_IFNAME_LEN];
+static char best_prev[MAX_IFNAME_LEN];
+static bool best_pending; /* changed again while scripts were running */
+
+/* name of the scripts directory for a state */
+static const char* scripts_state_str(enum online_state state)
+{
+	if (state == ONLINE) {
+		return "online";
+	} else if (state == DEGRADED) {
+		return "degraded";
+	}
+	return "offline";
+}
+
+/* environment variable for the scripts */
+struct scripts_var {
+	const char* name;
+	const char* value;
+};
+
 /*
- * Here we fork and run the scripts in the child process.
- * The parent process just monitors the child process.
+ * Here we fork and run the scripts in /etc/pingcheck/<hooks>.d/ in the child
+ * process, with the variables vars (up to one with name NULL) in their
+ * environment. The parent process just monitors the child process, name is
+ * for the debug statistics. Returns true in the parent if the fork worked.
  */
-static void task_scripts_run(struct runqueue* q, struct runqueue_task* t)
+static bool scripts_fork(struct runqueue* q, struct runqueue_process* rp,
+						 const char* name, const char* hooks,
+						 const struct scripts_var* vars)
 {
-	char cmd[500];
-	int len = 0;
-	struct scripts_proc* scr = container_of(t, struct scripts_proc, proc.task);
-	struct ping_intf* pi = scr->intf;
-	char* state_str = (scr->state == ONLINE ? "online" : "offline");
+	char cmd[100];
+	long long start;
 
+	debug_cb_start(&start);
 	pid_t pid = fork();
 	if (pid < 0) {
 		LOG_ERR("Run scripts fork failed!");
-		return;
+		return false;
 	} else if (pid > 0) {
 		/* parent process: monitor until child has finished */
-		runqueue_process_add(q, &scr->proc, pid);
-		return;
+		debug_cb_end(DBG_CB_SCRIPT, start, name);
+		debug_io(DBG_IO_FORK);
+		runqueue_process_add(q, rp, pid);
+		return true;
 	}
 
 	/* child process */
-	len = snprintf(
-		cmd, sizeof(cmd),
-		"export INTERFACE=\"%s\"; export DEVICE=\"%s\"; export GLOBAL=\"%s\"; "
-		"for hook in /etc/pingcheck/%s.d/*; do [ -r \"$hook\" ] && sh $hook; "
-		"done",
-		pi->name, pi->device, get_status_str(get_global_status()), state_str);
+	log_fork_child();
+	for (; vars != NULL && vars->name != NULL; vars++) {
+		if (setenv(vars->name, vars->value, 1) < 0) {
+			LOG_ERR("Run scripts environment error!");
+			_exit(EXIT_FAILURE);
+		}
+	}
 
+	int len = snprintf(cmd, sizeof(cmd),
+					   "for hook in /etc/pingcheck/%s.d/*; do "
+					   "[ -r \"$hook\" ] && sh $hook; done",
+					   hooks);
 	if (len <= 0 || (unsigned int)len >= sizeof(cmd)) { // error or truncated
 		LOG_ERR("Run scripts commands truncated!");
 		_exit(EXIT_FAILURE);
 	}
 
-	LOG_NOTI("Running '%s' scripts for '%s'", state_str, pi->name);
-	int ret = execlp("/bin/sh", "/bin/sh", "-c", cmd, NULL);
-	if (ret == -1) {
-		LOG_ERR("Run scripts exec error!");
-		_exit(EXIT_FAILURE);
+	execlp("/bin/sh", "/bin/sh", "-c", cmd, NULL);
+	LOG_ERR("Run scripts exec error!");
+	_exit(EXIT_FAILURE);
+}
+
+static void task_scripts_run(struct runqueue* q, struct runqueue_task* t)
+{
+	struct scripts_proc* scr = container_of(t, struct scripts_proc, proc.task);
+	struct ping_intf* pi = scr->intf;
+	const char* state_str = scripts_state_str(scr->state);
+	char hop[12] = "";
+	char hop_age[12] = "";
+
+	/* the last fault localisation, if it is recent */
+	int age = trace_age(pi);
+	if (age >= 0) {
+		snprintf(hop, sizeof(hop), "%d",
+				 pi->trace.last_reached ? -1 : pi->trace.last_hop);
+		snprintf(hop_age, sizeof(hop_age), "%d", age);
+	}
+
+	struct scripts_var vars[] = {
+		{"INTERFACE", pi->name},
+		{"DEVICE", pi->device},
+		{"GLOBAL", get_status_str(get_global_status())},
+		{"HOP", hop},
+		{"HOP_ADDRESS", age >= 0 ? trace_addr_str(pi) : ""},
+		{"HOP_AGE", hop_age},
+		{NULL, NULL},
+	};
+	if (scripts_fork(q, &scr->proc, pi->name, state_str, vars)) {
+		LOG_NOTI("Running '%s' scripts for '%s'", state_str, pi->name);
+		clock_now(CLOCK_MONOTONIC, &scr->time_start);
 	}
 }
 
@@ -72,8 +136,8 @@ static void task_scripts_cancel(struct runqueue* q, struct runqueue_task* t,
 								int type)
 {
 	struct scripts_proc* scr = container_of(t, struct scripts_proc, proc.task);
-	LOG_NOTI("'%s' scripts for '%s' cancelled",
-			 scr->state == ONLINE ? "online" : "offline", scr->intf->name);
+	LOG_NOTI("'%s' scripts for '%s' cancelled", scripts_state_str(scr->state),
+			 scr->intf->name);
 	runqueue_process_cancel_cb(q, t, type);
 }
 
@@ -81,11 +145,28 @@ static void task_scripts_cancel(struct runqueue* q, struct runqueue_task* t,
 static void task_scripts_kill(struct runqueue* q, struct runqueue_task* t)
 {
 	struct scripts_proc* scr = container_of(t, struct scripts_proc, proc.task);
-	LOG_NOTI("'%s' scripts for '%s' killed",
-			 scr->state == ONLINE ? "online" : "offline", scr->intf->name);
+	LOG_NOTI("'%s' scripts for '%s' killed", scripts_state_str(scr->state),
+			 scr->intf->name);
 	runqueue_process_kill_cb(q, t);
 }
 
+/* runqueue callback when task is finished, also after cancel or kill */
+static void task_scripts_complete(__attribute__((unused)) struct runqueue* q,
+								  struct runqueue_task* t)
+{
+	struct scripts_proc* scr = container_of(t, struct scripts_proc, proc.task);
+	struct timespec time_end;
+
+	if (scr->time_start.tv_sec == 0) { /* was never started */
+		return;
+	}
+
+	clock_now(CLOCK_MONOTONIC, &time_end);
+	scr->time_total += timespec_diff_ms(scr->time_start, time_end);
+	scr->cnt_runs++;
+	scr->time_start.tv_sec = 0;
+}
+
 static const struct runqueue_task_type task_scripts_type
 	= {.run = task_scripts_run,
 	   .cancel = task_scripts_cancel,
@@ -94,28 +175,31 @@ static const struct runqueue_task_type task_scripts_type
 /* called by main to request scripts to be run */
 void scripts_run(struct ping_intf* pi, enum online_state state_new)
 {
+	struct scripts_proc* all[]
+		= {&pi->scripts_on, &pi->scripts_degraded, &pi->scripts_off};
 	struct scripts_proc* scr;
-	struct scripts_proc* scr_other;
-	const char* state_str;
+	const char* state_str = scripts_state_str(state_new);
 
 	if (state_new == ONLINE) {
 		scr = &pi->scripts_on;
-		scr_other = &pi->scripts_off;
-		state_str = "online";
+	} else if (state_new == DEGRADED) {
+		scr = &pi->scripts_degraded;
 	} else {
 		scr = &pi->scripts_off;
-		scr_other = &pi->scripts_on;
-		state_str = "offline";
 	}
 
 	/*
-	 * cancel obsolete other task: e.g when ONLINE script is getting queued
+	 * cancel obsolete other tasks: e.g when ONLINE script is getting queued
 	 * and OFFLINE script is already queued and not running yet, cancel it
 	 */
-	if (scr_other->proc.task.queued && !scr_other->proc.task.running) {
-		LOG_NOTI("Cancelling obsolete '%s' scripts for '%s'",
-				 scr->state != ONLINE ? "online" : "offline", pi->name);
-		runqueue_task_cancel(&scr_other->proc.task, 1);
+	for (unsigned int i = 0; i < ARRAY_SIZE(all); i++) {
+		struct scripts_proc* other = all[i];
+		if (other != scr && other->proc.task.queued
+			&& !other->proc.task.running) {
+			LOG_NOTI("Cancelling obsolete '%s' scripts for '%s'",
+					 scripts_state_str(other->state), pi->name);
+			runqueue_task_cancel(&other->proc.task, 1);
+		}
 	}
 
 	/* don't queue the same scripts twice */
@@ -129,6 +213,7 @@ void scripts_run(struct ping_intf* pi, enum online_state state_new)
 	LOG_NOTI("Scheduling '%s' scripts for '%s'", state_str, pi->name);
 	scr->proc.task.type = &task_scripts_type;
 	scr->proc.task.run_timeout = SCRIPTS_TIMEOUT * 1000;
+	scr->proc.task.complete = task_scripts_complete;
 	scr->intf = pi;
 	scr->state = state_new;
 	runqueue_task_add(&runq, &scr->proc.task, false);
@@ -136,33 +221,10 @@ void scripts_run(struct ping_intf* pi, enum online_state state_new)
 
 static void task_panic_run(struct runqueue* q, struct runqueue_task* t)
 {
-	pid_t pid = fork();
-	if (pid < 0) {
-		LOG_ERR("Run scripts fork failed!");
-		return;
-	} else if (pid > 0) {
-		/* parent process: monitor until child has finished */
-		struct runqueue_process* rp = (struct runqueue_process*)t;
-		runqueue_process_add(q, rp, pid);
-		return;
-	}
+	struct runqueue_process* rp = (struct runqueue_process*)t;
 
-	/* child process */
-	char cmd[500];
-	int len = snprintf(cmd, sizeof(cmd),
-					   "for hook in /etc/pingcheck/panic.d/*; do [ -r "
-					   "\"$hook\" ] && sh $hook; done");
-
-	if (len <= 0 || (unsigned int)len >= sizeof(cmd)) { // error or truncated
-		LOG_ERR("Run scripts commands truncated!");
-		_exit(EXIT_FAILURE);
-	}
-
-	LOG_NOTI("Running PANIC scripts");
-	int ret = execlp("/bin/sh", "/bin/sh", "-c", cmd, NULL);
-	if (ret == -1) {
-		LOG_ERR("Run scripts exec error!");
-		_exit(EXIT_FAILURE);
+	if (scripts_fork(q, rp, "panic", "panic", NULL)) {
+		LOG_NOTI("Running PANIC scripts");
 	}
 }
 
@@ -178,6 +240,134 @@ void scripts_run_panic()
 	runqueue_task_add(&runq, &proc_panic.task, false);
 }
 
+static void task_best_run(struct runqueue* q, struct runqueue_task* t)
+{
+	struct runqueue_process* rp = (struct runqueue_process*)t;
+	struct scripts_var vars[] = {
+		{"INTERFACE", best_intf},
+		{"DEVICE", best_dev},
+		{"PREVIOUS", best_prev},
+		{NULL, NULL},
+	};
+
+	if (scripts_fork(q, rp, best_intf, "best", vars)) {
+		LOG_NOTI("Running 'best' scripts for '%s'", best_intf);
+	}
+}
+
+static void task_best_complete(__attribute__((unused)) struct runqueue* q,
+							   __attribute__((unused)) struct runqueue_task* t)
+{
+	if (best_pending) {
+		best_pending = false;
+		runqueue_task_add(&runq, &proc_best.task, false);
+	}
+}
+
+static const struct runqueue_task_type task_scripts_best_type = {
+	.run = task_best_run,
+};
+
+/* called when the best interface changed from previous to pi */
+void scripts_run_best(struct ping_intf* pi, const char* previous)
+{
+	/* a queued task which has not forked yet just uses the new names */
+	bool waiting = proc_best.task.queued && !proc_best.task.running;
+	if (!waiting) {
+		strncpy(best_prev, previous, MAX_IFNAME_LEN - 1);
+	}
+	strncpy(best_intf, pi->name, MAX_IFNAME_LEN - 1);
+	strncpy(best_dev, pi->device, MAX_IFNAME_LEN - 1);
+
+	if (proc_best.task.running) {
+		best_pending = true;
+		return;
+	} else if (waiting) {
+		return;
+	}
+
+	LOG_NOTI("Scheduling 'best' scripts for '%s'", pi->name);
+	proc_best.task.type = &task_scripts_best_type;
+	proc_best.task.run_timeout = SCRIPTS_TIMEOUT * 1000;
+	proc_best.task.complete = task_best_complete;
+	runqueue_task_add(&runq, &proc_best.task, false);
+}
+
+static void task_budget_run(struct runqueue* q, struct runqueue_task* t)
+{
+	struct scripts_proc* scr = container_of(t, struct scripts_proc, proc.task);
+	struct ping_intf* pi = scr->intf;
+	const char* budget_str = pi->budget.exhausted ? "exhausted" : "available";
+	struct scripts_var vars[] = {
+		{"INTERFACE", pi->name},
+		{"DEVICE", pi->device},
+		{"BUDGET", budget_str},
+		{NULL, NULL},
+	};
+
+	if (scripts_fork(q, &scr->proc, pi->name, "budget", vars)) {
+		LOG_NOTI("Running 'budget' scripts for '%s' (%s)", pi->name,
+				 budget_str);
+	}
+}
+
+static void task_budget_complete(__attribute__((unused)) struct runqueue* q,
+								 struct runqueue_task* t)
+{
+	struct scripts_proc* scr = container_of(t, struct scripts_proc, proc.task);
+
+	/* the budget changed again while the scripts were running */
+	if (scr->pending) {
+		scr->pending = false;
+		runqueue_task_add(&runq, &scr->proc.task, false);
+	}
+}
+
+static const struct runqueue_task_type task_scripts_budget_type = {
+	.run = task_budget_run,
+};
+
+/* called when the budget of pi got exhausted or available again */
+void scripts_run_budget(struct ping_intf* pi)
+{
+	struct scripts_proc* scr = &pi->scripts_budget;
+
+	/* a queued task which has not forked yet uses the current state */
+	if (scr->proc.task.running) {
+		LOG_NOTI("'budget' scripts for '%s' running, run again after",
+				 pi->name);
+		scr->pending = true;
+		return;
+	} else if (scr->proc.task.queued) {
+		return;
+	}
+
+	LOG_NOTI("Scheduling 'budget' scripts for '%s'", pi->name);
+	scr->proc.task.type = &task_scripts_budget_type;
+	scr->proc.task.run_timeout = SCRIPTS_TIMEOUT * 1000;
+	scr->proc.task.complete = task_budget_complete;
+	scr->intf = pi;
+	runqueue_task_add(&runq, &scr->proc.task, false);
+}
+
+/* stop pending and running scripts of an interface which is going away */
+void scripts_cancel(struct ping_intf* pi)
+{
+	if (pi->scripts_on.proc.task.queued) {
+		runqueue_task_kill(&pi->scripts_on.proc.task);
+	}
+	if (pi->scripts_off.proc.task.queued) {
+		runqueue_task_kill(&pi->scripts_off.proc.task);
+	}
+	if (pi->scripts_degraded.proc.task.queued) {
+		runqueue_task_kill(&pi->scripts_degraded.proc.task);
+	}
+	pi->scripts_budget.pending = false;
+	if (pi->scripts_budget.proc.task.queued) {
+		runqueue_task_kill(&pi->scripts_budget.proc.task);
+	}
+}
+
 void scripts_init(void)
 {
 	runqueue_init(&runq);
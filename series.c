@@ -0,0 +1,484 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "log.h"
+#include "main.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * In-memory time series of RTT and loss for the last 24 hours
+ *
+ * Each interface keeps one series per resolution: every probe result (raw)
+ * and averages over 1 and 15 minutes. A point is a timestamp in ms and two
+ * values, the RTT in ms and the loss in percent.
+ *
+ * Points are compressed like in Facebook's Gorilla TSDB: timestamps are
+ * stored as delta-of-delta with variable length prefixes, values as XOR
+ * against the previous value, only storing the meaningful bits. Points are
+ * written into fixed size chunks. When a chunk is full the oldest chunk is
+ * reused if it is older than 24 hours or the series has reached its chunk
+ * limit, so memory use is bounded.
+ */
+
+#define SERIES_CHUNK_BYTES 512
+#define SERIES_MAX_AGE	   (24 * 3600 * 1000) /* 24h in ms */
+#define SERIES_POINT_BITS  (36 + 2 * 77)	  /* worst case for one point */
+#define SERIES_VALUES	   2
+
+struct series_chunk {
+	struct series_chunk* next;
+	uint64_t time_first;
+	uint64_t time_last;
+	unsigned int num_points;
+	unsigned int num_bits;
+	uint8_t data[SERIES_CHUNK_BYTES];
+};
+
+struct series {
+	struct series_chunk* head; /* oldest */
+	struct series_chunk* tail; /* currently written */
+	int num_chunks;
+	int max_chunks;
+
+	/* encoder state for the tail chunk */
+	uint64_t time_prev;
+	int64_t delta_prev;
+	uint64_t val_prev[SERIES_VALUES];
+	uint8_t lead_prev[SERIES_VALUES];
+	uint8_t trail_prev[SERIES_VALUES];
+
+	/* accumulator for downsampling, not used for raw */
+	uint64_t bucket_start;
+	double rtt_sum;
+	unsigned int cnt_probes;
+	unsigned int cnt_replies;
+};
+
+struct series_set {
+	struct series res[__SERIES_RES_MAX];
+};
+
+static const int series_res_ms[__SERIES_RES_MAX] = {
+	[SERIES_RAW] = 0,
+	[SERIES_1MIN] = 60 * 1000,
+	[SERIES_15MIN] = 15 * 60 * 1000,
+};
+
+/* chunk limits, 24h of 1 min averages need about 12 chunks */
+static const int series_res_chunks[__SERIES_RES_MAX] = {
+	[SERIES_RAW] = 4,
+	[SERIES_1MIN] = 16,
+	[SERIES_15MIN] = 4,
+};
+
+static const char* series_res_names[__SERIES_RES_MAX] = {
+	[SERIES_RAW] = "raw",
+	[SERIES_1MIN] = "1m",
+	[SERIES_15MIN] = "15m",
+};
+
+static bool series_enabled;
+
+/*** bit stream ***/
+
+static void bits_write(struct series_chunk* c, uint64_t val, int num)
+{
+	while (num > 0) {
+		int pos = c->num_bits % 8;
+		int n = 8 - pos < num ? 8 - pos : num;
+		uint8_t bits = (val >> (num - n)) & ((1 << n) - 1);
+		if (pos == 0) {
+			c->data[c->num_bits / 8] = 0;
+		}
+		c->data[c->num_bits / 8] |= bits << (8 - pos - n);
+		c->num_bits += n;
+		num -= n;
+	}
+}
+
+struct bits_reader {
+	const struct series_chunk* c;
+	unsigned int pos;
+};
+
+static uint64_t bits_read(struct bits_reader* r, int num)
+{
+	uint64_t val = 0;
+	while (num > 0) {
+		int pos = r->pos % 8;
+		int n = 8 - pos < num ? 8 - pos : num;
+		uint8_t byte = r->c->data[r->pos / 8];
+		val = (val << n) | ((byte >> (8 - pos - n)) & ((1 << n) - 1));
+		r->pos += n;
+		num -= n;
+	}
+	return val;
+}
+
+/*** encoding ***/
+
+static uint64_t double_bits(double d)
+{
+	uint64_t u;
+	memcpy(&u, &d, sizeof(u));
+	return u;
+}
+
+static double bits_double(uint64_t u)
+{
+	double d;
+	memcpy(&d, &u, sizeof(d));
+	return d;
+}
+
+static void series_encode_time(struct series* s, uint64_t time)
+{
+	int64_t delta = time - s->time_prev;
+	int64_t dod = delta - s->delta_prev;
+	struct series_chunk* c = s->tail;
+
+	if (dod == 0) {
+		bits_write(c, 0, 1);
+	} else if (dod >= -63 && dod <= 64) {
+		bits_write(c, 0x2, 2);
+		bits_write(c, dod + 63, 7);
+	} else if (dod >= -255 && dod <= 256) {
+		bits_write(c, 0x6, 3);
+		bits_write(c, dod + 255, 9);
+	} else if (dod >= -2047 && dod <= 2048) {
+		bits_write(c, 0xe, 4);
+		bits_write(c, dod + 2047, 12);
+	} else {
+		bits_write(c, 0xf, 4);
+		bits_write(c, (uint32_t)dod, 32);
+	}
+
+	s->delta_prev = delta;
+	s->time_prev = time;
+}
+
+static void series_encode_value(struct series* s, int i, double value)
+{
+	uint64_t val = double_bits(value);
+	uint64_t xor = val ^ s->val_prev[i];
+	struct series_chunk* c = s->tail;
+
+	s->val_prev[i] = val;
+
+	if (xor == 0) {
+		bits_write(c, 0, 1);
+		return;
+	}
+
+	int lead = __builtin_clzll(xor);
+	int trail = __builtin_ctzll(xor);
+	if (lead > 31) { /* only 5 bits for storing it */
+		lead = 31;
+	}
+
+	if (s->lead_prev[i] != 0xff && lead >= s->lead_prev[i]
+		&& trail >= s->trail_prev[i]) {
+		/* fits into the previous window */
+		int len = 64 - s->lead_prev[i] - s->trail_prev[i];
+		bits_write(c, 0x2, 2);
+		bits_write(c, xor >> s->trail_prev[i], len);
+	} else {
+		int len = 64 - lead - trail;
+		bits_write(c, 0x3, 2);
+		bits_write(c, lead, 5);
+		bits_write(c, len - 1, 6); /* len is 1 to 64 */
+		bits_write(c, xor >> trail, len);
+		s->lead_prev[i] = lead;
+		s->trail_prev[i] = trail;
+	}
+}
+
+/* get a new chunk, reusing the oldest one if possible */
+static struct series_chunk* series_chunk_new(struct series* s, uint64_t now)
+{
+	struct series_chunk* c = NULL;
+
+	if (s->head != NULL && s->head != s->tail
+		&& (s->num_chunks >= s->max_chunks
+			|| s->head->time_last + SERIES_MAX_AGE < now)) {
+		c = s->head;
+		s->head = c->next;
+		s->num_chunks--;
+	} else if (s->num_chunks < s->max_chunks) {
+		c = malloc(sizeof(*c));
+	}
+
+	if (c == NULL) {
+		return NULL;
+	}
+
+	memset(c, 0, offsetof(struct series_chunk, data));
+	if (s->tail != NULL) {
+		s->tail->next = c;
+	} else {
+		s->head = c;
+	}
+	s->tail = c;
+	s->num_chunks++;
+	return c;
+}
+
+static void series_add_point(struct series* s, uint64_t time, double rtt,
+							 double loss)
+{
+	double vals[SERIES_VALUES] = {rtt, loss};
+	struct series_chunk* c = s->tail;
+
+	if (c == NULL || c->num_bits + SERIES_POINT_BITS > SERIES_CHUNK_BYTES * 8
+		|| time < s->time_prev) {
+		c = series_chunk_new(s, time);
+		if (c == NULL) {
+			return;
+		}
+	}
+
+	if (c->num_points == 0) {
+		/* first point of chunk is stored uncompressed */
+		c->time_first = time;
+		bits_write(c, time, 64);
+		s->time_prev = time;
+		s->delta_prev = 0;
+		for (int i = 0; i < SERIES_VALUES; i++) {
+			s->val_prev[i] = double_bits(vals[i]);
+			s->lead_prev[i] = 0xff;
+			bits_write(c, s->val_prev[i], 64);
+		}
+	} else {
+		series_encode_time(s, time);
+		for (int i = 0; i < SERIES_VALUES; i++) {
+			series_encode_value(s, i, vals[i]);
+		}
+	}
+
+	c->time_last = time;
+	c->num_points++;
+}
+
+/*** decoding ***/
+
+struct series_decoder {
+	struct bits_reader r;
+	unsigned int num;
+	uint64_t time;
+	int64_t delta;
+	uint64_t val[SERIES_VALUES];
+	uint8_t lead[SERIES_VALUES];
+	uint8_t trail[SERIES_VALUES];
+};
+
+static void series_decode_value(struct series_decoder* d, int i)
+{
+	if (bits_read(&d->r, 1) == 0) {
+		return; /* same value */
+	}
+	if (bits_read(&d->r, 1) == 1) {
+		d->lead[i] = bits_read(&d->r, 5);
+		int len = bits_read(&d->r, 6) + 1;
+		d->trail[i] = 64 - d->lead[i] - len;
+	}
+	int len = 64 - d->lead[i] - d->trail[i];
+	d->val[i] ^= bits_read(&d->r, len) << d->trail[i];
+}
+
+static bool series_decode_next(struct series_decoder* d)
+{
+	if (d->num >= d->r.c->num_points) {
+		return false;
+	}
+
+	if (d->num++ == 0) {
+		d->time = bits_read(&d->r, 64);
+		d->delta = 0;
+		for (int i = 0; i < SERIES_VALUES; i++) {
+			d->val[i] = bits_read(&d->r, 64);
+		}
+		return true;
+	}
+
+	int64_t dod;
+	if (bits_read(&d->r, 1) == 0) {
+		dod = 0;
+	} else if (bits_read(&d->r, 1) == 0) {
+		dod = (int64_t)bits_read(&d->r, 7) - 63;
+	} else if (bits_read(&d->r, 1) == 0) {
+		dod = (int64_t)bits_read(&d->r, 9) - 255;
+	} else if (bits_read(&d->r, 1) == 0) {
+		dod = (int64_t)bits_read(&d->r, 12) - 2047;
+	} else {
+		dod = (int32_t)bits_read(&d->r, 32);
+	}
+	d->delta += dod;
+	d->time += d->delta;
+
+	for (int i = 0; i < SERIES_VALUES; i++) {
+		series_decode_value(d, i);
+	}
+	return true;
+}
+
+/*** API ***/
+
+static uint64_t series_now(void)
+{
+	struct timespec ts;
+	clock_now(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct series_set* series_get(struct ping_intf* pi)
+{
+	if (pi->series == NULL) {
+		pi->series = calloc(1, sizeof(struct series_set));
+		if (pi->series == NULL) {
+			return NULL;
+		}
+		for (int i = 0; i < __SERIES_RES_MAX; i++) {
+			pi->series->res[i].max_chunks = series_res_chunks[i];
+		}
+	}
+	return pi->series;
+}
+
+/* add a downsampled point when the bucket is complete */
+static void series_downsample(struct series* s, int res, uint64_t time,
+							  int rtt)
+{
+	uint64_t bucket = time - time % series_res_ms[res];
+
+	/* averages are rounded to full ms and percent: values with short
+	 * mantissas compress much better */
+	if (s->cnt_probes > 0 && bucket != s->bucket_start) {
+		unsigned int lost = s->cnt_probes - s->cnt_replies;
+		series_add_point(s, s->bucket_start,
+						 s->cnt_replies > 0
+							 ? (int)(s->rtt_sum / s->cnt_replies + 0.5)
+							 : 0,
+						 (int)(100.0 * lost / s->cnt_probes + 0.5));
+		s->rtt_sum = 0;
+		s->cnt_probes = 0;
+		s->cnt_replies = 0;
+	}
+
+	s->bucket_start = bucket;
+	s->cnt_probes++;
+	if (rtt >= 0) {
+		s->rtt_sum += rtt;
+		s->cnt_replies++;
+	}
+}
+
+/* record a probe result, rtt is -1 when the probe was lost */
+void series_add(struct ping_intf* pi, int rtt)
+{
+	if (!series_enabled) {
+		return;
+	}
+
+	struct series_set* ss = series_get(pi);
+	if (ss == NULL) {
+		return;
+	}
+
+	uint64_t now = series_now();
+	series_add_point(&ss->res[SERIES_RAW], now, rtt >= 0 ? rtt : 0,
+					 rtt >= 0 ? 0 : 100);
+	for (int i = SERIES_1MIN; i < __SERIES_RES_MAX; i++) {
+		series_downsample(&ss->res[i], i, now, rtt);
+	}
+}
+
+/* call cb for all points within start and end (unix time in ms) */
+void series_query(struct ping_intf* pi, enum series_res res, uint64_t start,
+				  uint64_t end, series_point_cb cb, void* ctx)
+{
+	if (pi->series == NULL || res >= __SERIES_RES_MAX) {
+		return;
+	}
+
+	uint64_t oldest = series_now() - SERIES_MAX_AGE;
+	if (start < oldest) {
+		start = oldest;
+	}
+
+	struct series* s = &pi->series->res[res];
+	for (struct series_chunk* c = s->head; c != NULL; c = c->next) {
+		if (c->time_last < start || c->time_first > end) {
+			continue;
+		}
+		struct series_decoder d = {.r = {.c = c}};
+		while (series_decode_next(&d)) {
+			if (d.time > end) {
+				break;
+			}
+			if (d.time >= start) {
+				cb(ctx, d.time, bits_double(d.val[0]), bits_double(d.val[1]));
+			}
+		}
+	}
+}
+
+/* memory used by series of one interface in bytes */
+size_t series_memory(struct ping_intf* pi)
+{
+	size_t mem = 0;
+	if (pi->series == NULL) {
+		return 0;
+	}
+	mem += sizeof(struct series_set);
+	for (int i = 0; i < __SERIES_RES_MAX; i++) {
+		mem += pi->series->res[i].num_chunks * sizeof(struct series_chunk);
+	}
+	return mem;
+}
+
+int series_res_from_str(const char* str)
+{
+	for (int i = 0; i < __SERIES_RES_MAX; i++) {
+		if (strcmp(str, series_res_names[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void series_free(struct ping_intf* pi)
+{
+	if (pi->series == NULL) {
+		return;
+	}
+	for (int i = 0; i < __SERIES_RES_MAX; i++) {
+		struct series_chunk* c = pi->series->res[i].head;
+		while (c != NULL) {
+			struct series_chunk* next = c->next;
+			free(c);
+			c = next;
+		}
+	}
+	free(pi->series);
+	pi->series = NULL;
+}
+
+void series_init(void)
+{
+	series_enabled = true;
+	LOG_INF("Keeping RTT and loss time series");
+}
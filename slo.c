@@ -0,0 +1,65 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "log.h"
+#include "main.h"
+
+/*
+ * Service level objectives
+ *
+ * An interface which answers, but with too much loss, latency (95th
+ * percentile) or jitter over its last QUALITY_WINDOW probes (see quality.c)
+ * is DEGRADED instead of ONLINE. To avoid flapping, it only becomes ONLINE
+ * again when all of them are better than their limits by the hysteresis.
+ */
+
+#define SLO_MIN_PROBES 10
+
+/* is val over limit? while degraded, the limit is lower by the hysteresis */
+static bool slo_over(struct ping_intf* pi, unsigned int val, int limit,
+					 bool degraded)
+{
+	if (limit <= 0) {
+		return false;
+	}
+	if (degraded) {
+		return val * 100 > (unsigned int)limit * (100 - pi->conf_slo_hysteresis);
+	}
+	return val > (unsigned int)limit;
+}
+
+/* state of an interface which answers: ONLINE or DEGRADED */
+enum online_state slo_state(struct ping_intf* pi)
+{
+	struct quality_state* q = &pi->quality;
+	bool degraded = pi->state == DEGRADED;
+
+	if (q->cnt < SLO_MIN_PROBES) {
+		return degraded ? DEGRADED : ONLINE;
+	}
+	if (slo_over(pi, q->loss, pi->conf_slo_loss, degraded)
+		|| slo_over(pi, q->p95, pi->conf_slo_latency, degraded)
+		|| slo_over(pi, q->jitter, pi->conf_slo_jitter, degraded)) {
+		return DEGRADED;
+	}
+	return ONLINE;
+}
+
+/* re-evaluate after a lost probe, only while the interface answers */
+void slo_check(struct ping_intf* pi)
+{
+	if (pi->state == ONLINE || pi->state == DEGRADED) {
+		state_change(slo_state(pi), pi);
+	}
+}
@@ -0,0 +1,263 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "log.h"
+#include "main.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Warm start
+ *
+ * State, counters and RTT statistics of all interfaces are saved to a small
+ * text file periodically and on exit, and read back at startup. Counters are
+ * always continued. The saved state is only used if it's not older than
+ * max_age, then as a provisional state: the online and offline scripts run
+ * only when the first probes show something else.
+ *
+ * One line per interface with "key=value" pairs, unknown keys are ignored so
+ * that files of older and newer versions can be read.
+ */
+
+#define STATE_VERSION  1
+#define STATE_LINE_LEN 1024
+
+static const char* path;
+static int max_age;	 /* sec */
+static int interval; /* sec */
+static time_t saved; /* time of the restored file */
+static struct uloop_timeout timeout_save;
+
+static enum online_state state_from_str(const char* str)
+{
+	for (enum online_state s = UNKNOWN; s <= DEGRADED; s++) {
+		if (strcmp(get_status_str(s), str) == 0) {
+			return s;
+		}
+	}
+	return UNKNOWN;
+}
+
+static void state_parse_hist(struct ping_intf* pi, char* val)
+{
+	char* tok;
+	char* save;
+	int i = 0;
+
+	for (tok = strtok_r(val, ",", &save); tok != NULL && i < RTT_HIST_BUCKETS;
+		 tok = strtok_r(NULL, ",", &save)) {
+		pi->rtt_hist[i++] = strtoul(tok, NULL, 10);
+	}
+}
+
+static void state_parse_intf(char* line)
+{
+	char* save;
+	char* tok = strtok_r(line, " \n", &save);
+	struct ping_intf* pi = tok != NULL ? get_interface(tok) : NULL;
+	if (pi == NULL) {
+		return; /* not configured anymore */
+	}
+
+	while ((tok = strtok_r(NULL, " \n", &save)) != NULL) {
+		char* val = strchr(tok, '=');
+		if (val == NULL) {
+			continue;
+		}
+		*val++ = '\0';
+		if (strcmp(tok, "state") == 0) {
+			pi->warm_state = state_from_str(val);
+		} else if (strcmp(tok, "sent") == 0) {
+			pi->cnt_sent = strtoul(val, NULL, 10);
+		} else if (strcmp(tok, "success") == 0) {
+			pi->cnt_succ = strtoul(val, NULL, 10);
+		} else if (strcmp(tok, "last_rtt") == 0) {
+			pi->last_rtt = strtoul(val, NULL, 10);
+		} else if (strcmp(tok, "max_rtt") == 0) {
+			pi->max_rtt = strtoul(val, NULL, 10);
+		} else if (strcmp(tok, "rtt_sum") == 0) {
+			pi->rtt_sum = strtoul(val, NULL, 10);
+		} else if (strcmp(tok, "rtt_hist") == 0) {
+			state_parse_hist(pi, val);
+		} else if (strcmp(tok, "transitions") == 0) {
+			pi->cnt_transitions = strtoul(val, NULL, 10);
+		} else if (strcmp(tok, "budget_bytes") == 0) {
+			pi->budget.used_bytes = strtoull(val, NULL, 10);
+		} else if (strcmp(tok, "budget_packets") == 0) {
+			pi->budget.used_packets = strtoull(val, NULL, 10);
+		} else if (strcmp(tok, "budget_probes") == 0) {
+			pi->budget.probes = strtoul(val, NULL, 10);
+		} else if (strcmp(tok, "budget_end") == 0) {
+			/* a past period is started again in budget_allow() */
+			pi->budget.period_end = strtoll(val, NULL, 10);
+		} else if (strcmp(tok, "budget_exhausted") == 0) {
+			pi->budget.exhausted = atoi(val) > 0;
+		}
+	}
+	pi->warm = true;
+}
+
+static bool state_restore(void)
+{
+	char line[STATE_LINE_LEN];
+	char best[MAX_IFNAME_LEN] = "";
+	int version;
+	long long time_saved;
+
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		return false;
+	}
+
+	if (fgets(line, sizeof(line), f) == NULL
+		|| sscanf(line, "pingcheck %d %lld", &version, &time_saved) != 2
+		|| version > STATE_VERSION) {
+		LOG_ERR("State: '%s' is not a valid state file", path);
+		fclose(f);
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "intf ", 5) == 0) {
+			state_parse_intf(line + 5);
+		} else if (strncmp(line, "best ", 5) == 0) {
+			sscanf(line + 5, "%255s", best);
+		}
+	}
+	fclose(f);
+
+	saved = time_saved;
+	long age = time(NULL) - saved;
+	LOG_INF("State: restored from '%s', saved %ld sec ago", path, age);
+
+	struct ping_intf* pi = best[0] != '\0' ? get_interface(best) : NULL;
+	if (pi != NULL && age >= 0 && age <= max_age) {
+		quality_restore_best(pi);
+	}
+	return true;
+}
+
+/* write to a temporary file first, so there is always a complete one */
+void state_save(void)
+{
+	char tmp[MAX_HOSTNAME_LEN + 4];
+	struct ping_intf* pi;
+
+	if (path == NULL) {
+		return;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE* f = fopen(tmp, "w");
+	if (f == NULL) {
+		LOG_ERR("State: could not write '%s'", tmp);
+		return;
+	}
+
+	fprintf(f, "pingcheck %d %lld\n", STATE_VERSION, (long long)time(NULL));
+	pi = quality_best();
+	if (pi != NULL) {
+		fprintf(f, "best %s\n", pi->name);
+	}
+	for_each_interface(pi) {
+		fprintf(f,
+				"intf %s state=%s sent=%u success=%u last_rtt=%u max_rtt=%u "
+				"rtt_sum=%lu transitions=%u rtt_hist=",
+				pi->name, get_status_str(pi->state), pi->cnt_sent,
+				pi->cnt_succ, pi->last_rtt, pi->max_rtt, pi->rtt_sum,
+				pi->cnt_transitions);
+		for (int i = 0; i < RTT_HIST_BUCKETS; i++) {
+			fprintf(f, i > 0 ? ",%u" : "%u", pi->rtt_hist[i]);
+		}
+		if (pi->conf_budget > 0) {
+			fprintf(f,
+					" budget_bytes=%llu budget_packets=%llu budget_probes=%u "
+					"budget_end=%lld budget_exhausted=%d",
+					(unsigned long long)pi->budget.used_bytes,
+					(unsigned long long)pi->budget.used_packets,
+					pi->budget.probes, (long long)pi->budget.period_end,
+					pi->budget.exhausted);
+		}
+		fprintf(f, "\n");
+	}
+
+	bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+	if (fclose(f) != 0 || !ok || rename(tmp, path) < 0) {
+		LOG_ERR("State: could not write '%s'", path);
+		unlink(tmp);
+	}
+}
+
+static void state_save_cb(struct uloop_timeout* t)
+{
+	debug_timeout_lag(t);
+	state_save();
+	uloop_timeout_set(t, interval * 1000);
+}
+
+/* called from ping_init() instead of resetting the counters. returns true if
+ * they were restored, then the saved state is taken over if it's recent */
+bool state_warm_start(struct ping_intf* pi)
+{
+	if (!pi->warm) {
+		return false;
+	}
+	pi->warm = false;
+
+	long age = time(NULL) - saved;
+	if (age < 0 || age > max_age) {
+		LOG_INF("State: saved state of '%s' too old", pi->name);
+		return true;
+	}
+
+	/* only when the link is up like before, otherwise probes decide */
+	if (pi->state == UP
+		&& (pi->warm_state == ONLINE || pi->warm_state == OFFLINE
+			|| pi->warm_state == DEGRADED)) {
+		LOG_INF("Interface '%s' provisionally %s", pi->name,
+				get_status_str(pi->warm_state));
+		pi->state = pi->warm_state;
+		/* after the restart record, the history doesn't know it yet */
+		history_add(pi, HIST_STATE, pi->warm_state);
+		pi->provisional = true;
+	}
+	return true;
+}
+
+/* restore from path and save there every interval sec. a saved state older
+ * than max_age sec is not used */
+void state_init(const char* file, int save_interval, int age)
+{
+	path = file;
+	interval = save_interval > 0 ? save_interval : 60;
+	max_age = age > 0 ? age : 300;
+
+	state_restore();
+
+	timeout_save.cb = state_save_cb;
+	uloop_timeout_set(&timeout_save, interval * 1000);
+}
+
+void state_finish(void)
+{
+	if (path == NULL) {
+		return;
+	}
+	uloop_timeout_cancel(&timeout_save);
+	state_save();
+	path = NULL;
+}
@@ -12,12 +12,12 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
+#include "log.h"
 #include "main.h"
 
 /* keep libc includes before linux headers for musl compatibility */
 #include <netinet/in.h>
 
-#include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/if.h>
@@ -26,18 +26,20 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
-int tcp_connect(const char* ifname, int dst, int port)
+/* open non-blocking TCP socket bound to interface */
+int tcp_socket(const char* ifname)
 {
 	int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	if (fd == -1) {
-		warn("Could not open TCP socket");
+		LOG_ERR("Could not open TCP socket: %s", strerror(errno));
 		return -1;
 	}
 
 	/* bind to interface */
 	if (ifname != NULL) {
 		if (strlen(ifname) >= IFNAMSIZ) {
-			fprintf(stderr, "TCP: ifname too long");
+			LOG_ERR("TCP: ifname too long");
+			close(fd);
 			return -1;
 		}
 		struct ifreq ifr;
@@ -45,7 +47,8 @@ int tcp_connect(const char* ifname, int dst, int port)
 		int ret
 			= setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, &ifr, sizeof(ifr));
 		if (ret < 0) {
-			warn("TCP: could not bind to '%s'", ifname);
+			LOG_ERR("TCP: could not bind to '%s': %s", ifname,
+					strerror(errno));
 			close(fd);
 			return -1;
 		}
@@ -55,6 +58,15 @@ int tcp_connect(const char* ifname, int dst, int port)
 	unsigned int fl = fcntl(fd, F_GETFL, 0);
 	fl |= O_NONBLOCK;
 	fcntl(fd, F_SETFL, fl);
+	return fd;
+}
+
+int tcp_connect(const char* ifname, int dst, int port)
+{
+	int fd = tcp_socket(ifname);
+	if (fd < 0) {
+		return -1;
+	}
 
 	/* connect */
 	struct sockaddr_in addr;
@@ -65,7 +77,8 @@ int tcp_connect(const char* ifname, int dst, int port)
 
 	int ret = connect(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_in));
 	if (ret == -1 && errno != EINPROGRESS) {
-		warn("TCP: could not connect");
+		debug_error(DBG_ERR_CONNECT);
+		close(fd);
 		return -1;
 	}
 
@@ -0,0 +1,341 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "log.h"
+#include "main.h"
+
+/* keep libc includes before linux headers for musl compatibility */
+#include <netinet/in.h>
+
+#include <libubus.h>
+#include <linux/icmp.h>
+#include <linux/ip.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Microbenchmarks of the hot paths, run with "make bench"
+ *
+ * Each benchmark runs its operation in a loop, doubling the iterations until
+ * it takes at least BENCH_MIN_NS, and prints one JSON object per line:
+ *
+ *   {"name":"get_interface","interfaces":100,"iterations":4194304,
+ *    "ns_per_op":25.1,"allocs_per_op":0.00}
+ *
+ * Heap allocations are counted by wrapping malloc() and friends at link
+ * time (see the Makefile), so these are the allocations of pingcheck's own
+ * code, not those inside libubox. ubus is replaced by the stubs below, so
+ * server_status() runs without ubusd. The interface lists are built up to
+ * each size in turn, all interfaces are OFFLINE, which is the slowest case
+ * for get_global_status().
+ */
+
+#define BENCH_MIN_NS 200000000LL
+#define BENCH_FD	 100 /* of the first interface, the sockets are not real */
+
+static unsigned long num_allocs;
+static volatile unsigned long sink;
+static FILE* results;
+
+static char pkt_reply[sizeof(struct iphdr) + sizeof(struct icmphdr)];
+static char pkt_demux[sizeof(pkt_reply)];
+static char buf64[64];
+static struct ping_intf* rtt_intf;
+static int num_intfs;
+static int sock[2];
+
+/*** allocation counting ***/
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t num, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+char* __real_strdup(const char* s);
+
+void* __wrap_malloc(size_t size)
+{
+	num_allocs++;
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t num, size_t size)
+{
+	num_allocs++;
+	return __real_calloc(num, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+	num_allocs++;
+	return __real_realloc(ptr, size);
+}
+
+char* __wrap_strdup(const char* s)
+{
+	num_allocs++;
+	return __real_strdup(s);
+}
+
+/*** ubus stubs ***/
+
+static struct ubus_context ubus_ctx;
+static struct ubus_object* server_obj;
+
+struct ubus_context* ubus_connect(__attribute__((unused)) const char* path)
+{
+	return &ubus_ctx;
+}
+
+int ubus_add_object(__attribute__((unused)) struct ubus_context* ctx,
+					struct ubus_object* obj)
+{
+	server_obj = obj;
+	return 0;
+}
+
+int ubus_send_reply(__attribute__((unused)) struct ubus_context* ctx,
+					__attribute__((unused)) struct ubus_request_data* req,
+					struct blob_attr* msg)
+{
+	sink += blob_len(msg);
+	return 0;
+}
+
+/*** harness ***/
+
+static long long bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_run(const char* name, void (*fn)(unsigned long n))
+{
+	unsigned long n = 1;
+	unsigned long allocs;
+	long long ns;
+
+	fn(1); /* warm up, e.g. buffers which grow once */
+	while (true) {
+		allocs = num_allocs;
+		long long start = bench_now_ns();
+		fn(n);
+		ns = bench_now_ns() - start;
+		allocs = num_allocs - allocs;
+		if (ns >= BENCH_MIN_NS || n >= 1UL << 30) {
+			break;
+		}
+		n *= 2;
+	}
+
+	fprintf(results, "{\"name\":\"%s\",\"interfaces\":%d,\"iterations\":%lu,"
+			"\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f}\n",
+			name, num_intfs, n, (double)ns / n, (double)allocs / n);
+	fflush(results);
+}
+
+/* echo reply to a probe sent from socket fd, with IP header */
+static void bench_reply_build(char* pkt, int fd)
+{
+	struct iphdr* ip = (struct iphdr*)pkt;
+	struct icmphdr* icmp = (struct icmphdr*)(pkt + sizeof(*ip));
+
+	memset(ip, 0, sizeof(*ip));
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->protocol = IPPROTO_ICMP;
+	icmp_echo_build((char*)icmp, fd, 1);
+	icmp->type = ICMP_ECHOREPLY;
+	icmp->checksum = 0;
+	icmp->checksum = icmp_checksum(icmp, sizeof(*icmp));
+}
+
+static struct ping_intf* bench_intf_add(int idx)
+{
+	struct ping_intf* pi = calloc(1, sizeof(*pi));
+	if (pi == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	snprintf(pi->name, sizeof(pi->name), "if%05d", idx);
+	strcpy(pi->device, "eth0");
+	pi->ufd.fd = BENCH_FD + idx;
+	pi->conf_interval = 1000;
+	pi->conf_timeout = 5000;
+	pi->conf_host = htonl(0x0a000001);
+	pi->state = OFFLINE;
+	config_add_interface(pi);
+	num_intfs++;
+	return pi;
+}
+
+/*** benchmarks ***/
+
+static void bench_checksum(unsigned long n)
+{
+	struct icmphdr* icmp = (struct icmphdr*)(pkt_reply + sizeof(struct iphdr));
+	for (unsigned long i = 0; i < n; i++) {
+		sink += icmp_checksum(icmp, sizeof(*icmp));
+	}
+}
+
+static void bench_checksum_64(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		sink += icmp_checksum(buf64, sizeof(buf64));
+	}
+}
+
+/* the packet is copied each time because parsing clears the checksum */
+static void bench_parse(unsigned long n)
+{
+	char pkt[sizeof(pkt_reply)];
+	for (unsigned long i = 0; i < n; i++) {
+		memcpy(pkt, pkt_reply, sizeof(pkt));
+		sink += icmp_echo_parse(pkt, sizeof(pkt));
+	}
+}
+
+/* one send() to a socketpair and icmp_echo_receive(), with the syscalls */
+static void bench_receive(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		if (send(sock[0], pkt_reply, sizeof(pkt_reply), 0) < 0) {
+			exit(EXIT_FAILURE);
+		}
+		sink += icmp_echo_receive(sock[1]);
+	}
+}
+
+/* parse a reply for the last interface and find it */
+static void bench_demux(unsigned long n)
+{
+	char pkt[sizeof(pkt_demux)];
+	for (unsigned long i = 0; i < n; i++) {
+		memcpy(pkt, pkt_demux, sizeof(pkt));
+		sink += (unsigned long)get_interface_by_fd(
+			icmp_echo_parse(pkt, sizeof(pkt)));
+	}
+}
+
+/* recording of a probe and its reply: counters, RTT statistics, quality */
+static void bench_rtt_record(unsigned long n)
+{
+	rtt_intf->state = ONLINE;
+	for (unsigned long i = 0; i < n; i++) {
+		ping_sent(rtt_intf);
+		ping_reply(rtt_intf, 10 + i % 50);
+	}
+	rtt_intf->state = OFFLINE;
+}
+
+static void bench_get_interface(unsigned long n)
+{
+	char name[MAX_IFNAME_LEN];
+	snprintf(name, sizeof(name), "if%05d", num_intfs - 1);
+	for (unsigned long i = 0; i < n; i++) {
+		sink += (unsigned long)get_interface(name);
+	}
+}
+
+static void bench_get_global_status(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		sink += get_global_status();
+	}
+}
+
+static void bench_server_status_call(unsigned long n, struct blob_attr* msg)
+{
+	struct ubus_request_data req;
+	const struct ubus_method* m = NULL;
+
+	for (int i = 0; i < server_obj->n_methods; i++) {
+		if (strcmp(server_obj->methods[i].name, "status") == 0) {
+			m = &server_obj->methods[i];
+		}
+	}
+	memset(&req, 0, sizeof(req));
+	for (unsigned long i = 0; i < n; i++) {
+		m->handler(&ubus_ctx, server_obj, &req, "status", msg);
+	}
+}
+
+static void bench_server_status(unsigned long n)
+{
+	static struct blob_buf msg;
+	blob_buf_init(&msg, 0);
+	bench_server_status_call(n, msg.head);
+}
+
+static void bench_server_status_intf(unsigned long n)
+{
+	static struct blob_buf msg;
+	char name[MAX_IFNAME_LEN];
+	snprintf(name, sizeof(name), "if%05d", num_intfs - 1);
+	blob_buf_init(&msg, 0);
+	blobmsg_add_string(&msg, "interface", name);
+	bench_server_status_call(n, msg.head);
+}
+
+int main(__attribute__((unused)) int argc, __attribute__((unused)) char** argv)
+{
+	static const int sizes[] = {8, 100, 10000};
+
+	/* stdout is for the results only, log messages and the output of
+	 * scripts go to /dev/null */
+	results = fdopen(dup(STDOUT_FILENO), "w");
+	if (results == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	if (uloop_init() < 0 || !ubus_init() || !ubus_register_server()
+		|| socketpair(AF_UNIX, SOCK_DGRAM, 0, sock) < 0) {
+		fprintf(stderr, "bench: setup failed\n");
+		return EXIT_FAILURE;
+	}
+	intf_init();
+	scripts_init();
+
+	for (unsigned int i = 0; i < sizeof(buf64); i++) {
+		buf64[i] = i;
+	}
+	bench_reply_build(pkt_reply, BENCH_FD);
+	bench_run("checksum", bench_checksum);
+	bench_run("checksum_64", bench_checksum_64);
+	bench_run("icmp_echo_parse", bench_parse);
+	bench_run("icmp_echo_receive", bench_receive);
+
+	rtt_intf = bench_intf_add(0);
+	for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		while (num_intfs < sizes[s]) {
+			bench_intf_add(num_intfs);
+		}
+		bench_reply_build(pkt_demux, BENCH_FD + num_intfs - 1);
+		bench_run("demux", bench_demux);
+		bench_run("rtt_record", bench_rtt_record);
+		bench_run("get_interface", bench_get_interface);
+		bench_run("get_global_status", bench_get_global_status);
+		bench_run("server_status", bench_server_status);
+		bench_run("server_status_interface", bench_server_status_intf);
+	}
+
+	close(sock[0]);
+	close(sock[1]);
+	fclose(results);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,298 @@
+#!/bin/bash
+#
+# End-to-end load test of pingcheck, run with "make load" (needs root)
+#
+# Two network namespaces are connected with a veth pair: pingcheck runs in
+# one, test/responder.c in the other answers for hundreds of simulated
+# targets behind it, each with its own delay, jitter, loss, duplication or
+# reordering. Nothing leaves the box. After all targets are ONLINE, the probe
+# rate, CPU time, context switches and system calls per probe, RSS and the
+# RTT error against the injected delay are measured. Then every 10th target fails and
+# recovers, for the detection and recovery latency. The result is printed
+# as one JSON object.
+#
+# pingcheck needs a running ubusd. Usage:
+#
+#   test/load.sh [-n targets] [-i interval_ms] [-t timeout_ms]
+#                [-d duration_s] [-o option=value]...
+#
+# -o adds options to the default section, e.g. -o io_uring=1 or -o workers=2.
+# The binaries are taken from $BUILD_DIR (default build).
+
+set -e
+
+TARGETS=200
+INTERVAL=1000
+TIMEOUT=5000
+DURATION=30
+OPTIONS=()
+
+while getopts "n:i:t:d:o:h" opt; do
+	case $opt in
+	n) TARGETS=$OPTARG ;;
+	i) INTERVAL=$OPTARG ;;
+	t) TIMEOUT=$OPTARG ;;
+	d) DURATION=$OPTARG ;;
+	o) OPTIONS+=("$OPTARG") ;;
+	*)
+		sed -n '3,20s/^# \{0,1\}//p' "$0" >&2
+		exit 1
+		;;
+	esac
+done
+
+BUILD_DIR=${BUILD_DIR:-build}
+PINGCHECK=${PINGCHECK:-$BUILD_DIR/pingcheck}
+RESPONDER=${RESPONDER:-$BUILD_DIR/pingcheck-responder}
+NS_MON=pcload_mon
+NS_RESP=pcload_resp
+METRICS=10.99.0.1:9123
+DIR=$(mktemp -d /tmp/pingcheck-load.XXXXXX)
+
+cleanup() {
+	[ -n "$PC_PID" ] && kill -INT "$PC_PID" 2>/dev/null && wait "$PC_PID" || true
+	[ -n "$RESP_PID" ] && kill -INT "$RESP_PID" 2>/dev/null && wait "$RESP_PID" || true
+	ip netns del $NS_MON 2>/dev/null || true
+	ip netns del $NS_RESP 2>/dev/null || true
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+fail() {
+	echo "load: $*" >&2
+	[ -f "$DIR/pingcheck.log" ] && tail -20 "$DIR/pingcheck.log" >&2
+	exit 1
+}
+
+target_addr() {
+	echo "10.98.$(($1 / 250)).$(($1 % 250 + 1))"
+}
+
+target_delay() {
+	echo $((5 + $1 * 7 % 96))
+}
+
+# every 10th target fails during the outage
+is_outage() {
+	[ $(($1 % 10)) -eq 5 ]
+}
+
+# rules of the responder: most targets answer with exactly their delay, which
+# is compared with the measured RTT, the others duplicate, reorder or lose
+write_rules() {
+	local outage=$1 i rule
+	for ((i = 0; i < TARGETS; i++)); do
+		rule="$(target_addr $i) delay=$(target_delay $i)"
+		case $((i % 10)) in
+		1) rule="$rule dup=20" ;;
+		2) rule="$rule reorder=10" ;;
+		3) rule="$rule jitter=20 loss=5" ;;
+		esac
+		if [ "$outage" = 1 ] && is_outage $i; then
+			rule="$rule loss=100"
+		fi
+		echo "$rule"
+	done > "$DIR/rules.tmp"
+	mv "$DIR/rules.tmp" "$DIR/rules"
+}
+
+write_config() {
+	local i opt
+	{
+		echo "config default"
+		echo "	option interval ${INTERVAL}ms"
+		echo "	option timeout ${TIMEOUT}ms"
+		echo "	option ignore_ubus 1"
+		echo "	option metrics_listen $METRICS"
+		for opt in "${OPTIONS[@]}"; do
+			echo "	option ${opt%%=*} ${opt#*=}"
+		done
+		for ((i = 0; i < TARGETS; i++)); do
+			echo
+			echo "config interface"
+			echo "	option name t$i"
+			echo "	option host $(target_addr $i)"
+			echo "	option device lm0"
+		done
+	} > "$DIR/pingcheck"
+}
+
+metrics() {
+	ip netns exec $NS_MON curl -sf "http://$METRICS/metrics"
+}
+
+# voluntary and involuntary context switches of all threads
+ctx_switches() {
+	cat /proc/"$PC_PID"/task/*/status 2>/dev/null \
+		| awk '/ctxt_switches/ { n += $2 } END { print n + 0 }'
+}
+
+# sleep $1 s and print the number of system calls of pingcheck meanwhile,
+# counted with perf or, slowing pingcheck down, strace. null without both
+count_syscalls() {
+	: > "$DIR/syscalls"
+	if command -v perf > /dev/null; then
+		perf stat -x, -e raw_syscalls:sys_enter -p "$PC_PID" \
+			-o "$DIR/syscalls" -- sleep "$1" > /dev/null 2>&1 || true
+		awk -F, '/raw_syscalls/ && $1 ~ /^[0-9]+$/ { n = $1 }
+			END { print n == "" ? "null" : n }' "$DIR/syscalls"
+	elif command -v strace > /dev/null; then
+		timeout -s INT "$1" strace -c -f -p "$PC_PID" -o "$DIR/syscalls" \
+			> /dev/null 2>&1 || true
+		awk '$NF == "total" { n = $4 } END { print n == "" ? "null" : n }' \
+			"$DIR/syscalls"
+	else
+		sleep "$1"
+		echo null
+	fi
+}
+
+count_online() {
+	metrics | grep -c 'pingcheck_interface_state="ONLINE"} 1' || true
+}
+
+# append "time interface state" of all interfaces every 100 ms until $1. the
+# log can't be used, it's rate limited when many interfaces change at once
+poll_states() {
+	local t
+	while [ "${EPOCHREALTIME/./}" -lt "$1" ]; do
+		t=$EPOCHREALTIME
+		metrics | awk -v t="$t" -F'"' \
+			'/^pingcheck_interface_state.*} 1$/ { print t, $2, $4 }'
+		sleep 0.1
+	done >> "$DIR/states"
+}
+
+# end time for poll_states in $1 s
+after() {
+	echo $((${EPOCHREALTIME/./} + $1 * 1000000))
+}
+
+[ "$(id -u)" = 0 ] || fail "needs root for network namespaces"
+[ -x "$PINGCHECK" ] && [ -x "$RESPONDER" ] || fail "build first: make load"
+command -v curl > /dev/null || fail "needs curl"
+
+# topology: pingcheck on lm0 (10.99.0.1), targets in 10.98.0.0/16 routed
+# to the responder side lr0 (10.99.0.2), whose kernel drops them
+ip netns add $NS_MON
+ip netns add $NS_RESP
+ip link add lm0 netns $NS_MON type veth peer name lr0 netns $NS_RESP
+ip -n $NS_MON addr add 10.99.0.1/24 dev lm0
+ip -n $NS_RESP addr add 10.99.0.2/24 dev lr0
+for ns in $NS_MON $NS_RESP; do
+	ip -n $ns link set lo up
+done
+ip -n $NS_MON link set lm0 up
+ip -n $NS_RESP link set lr0 up
+ip -n $NS_MON route add default via 10.99.0.2
+
+write_rules 0
+write_config
+ip netns exec $NS_RESP "$RESPONDER" -i lr0 "$DIR/rules" > "$DIR/responder.json" &
+RESP_PID=$!
+ip netns exec $NS_MON "$PINGCHECK" -c "$DIR" > "$DIR/pingcheck.log" 2>&1 &
+PC_PID=$!
+
+# warm up until all targets answer
+for ((i = 0; i < 120; i++)); do
+	sleep 0.5
+	kill -0 $PC_PID 2>/dev/null || fail "pingcheck exited"
+	[ "$(count_online)" -ge "$TARGETS" ] && break
+done
+[ "$(count_online)" -ge "$TARGETS" ] || fail "not all targets ONLINE"
+
+# steady state
+metrics > "$DIR/metrics.0"
+ctx0=$(ctx_switches)
+t0=$EPOCHREALTIME
+syscalls=$(count_syscalls "$DURATION")
+metrics > "$DIR/metrics.1"
+ctx1=$(ctx_switches)
+t1=$EPOCHREALTIME
+
+# outage of every 10th target and recovery
+write_rules 1
+kill -HUP $RESP_PID
+t_fail=$EPOCHREALTIME
+poll_states "$(after $(((TIMEOUT + 2 * INTERVAL) / 1000 + 3)))"
+write_rules 0
+kill -HUP $RESP_PID
+t_recover=$EPOCHREALTIME
+poll_states "$(after $((2 * INTERVAL / 1000 + 3)))"
+
+kill -INT $PC_PID
+wait $PC_PID || true
+PC_PID=
+kill -INT $RESP_PID
+wait $RESP_PID || true
+RESP_PID=
+
+# per interface: sent, RTT sum and count before and after
+rtt_table() {
+	awk '
+	/^pingcheck_sent_total/ { match($0, /interface="[^"]*"/);
+		sent[substr($0, RSTART + 11, RLENGTH - 12)] = $2 }
+	/^pingcheck_rtt_seconds_sum/ { match($0, /interface="[^"]*"/);
+		sum[substr($0, RSTART + 11, RLENGTH - 12)] = $2 }
+	/^pingcheck_rtt_seconds_count/ { match($0, /interface="[^"]*"/);
+		cnt[substr($0, RSTART + 11, RLENGTH - 12)] = $2 }
+	/^pingcheck_state_transitions_total/ { n += $2 }
+	/^process_cpu_seconds_total/ { print "cpu", $2 }
+	/^process_resident_memory_bytes/ { print "rss", $2 }
+	END { print "transitions", n
+		for (i in sent) print i, sent[i], sum[i] + 0, cnt[i] + 0 }
+	' "$1"
+}
+rtt_table "$DIR/metrics.0" > "$DIR/rtt.0"
+rtt_table "$DIR/metrics.1" > "$DIR/rtt.1"
+for ((i = 0; i < TARGETS; i++)); do
+	echo "t$i $(target_delay $i) $((i % 10))"
+done > "$DIR/targets"
+
+awk -v t0="$t0" -v t1="$t1" -v ctx0="$ctx0" -v ctx1="$ctx1" \
+	-v t_fail="$t_fail" -v t_recover="$t_recover" \
+	-v targets="$TARGETS" -v interval="$INTERVAL" -v syscalls="$syscalls" \
+	-v responder="$(cat "$DIR/responder.json")" '
+FILENAME == ARGV[1] { delay[$1] = $2; class[$1] = $3; next }
+FILENAME == ARGV[2] { if ($1 == "cpu") cpu0 = $2;
+	else if ($1 == "transitions") trans0 = $2; else if ($1 != "rss") {
+	sent0[$1] = $2; sum0[$1] = $3; cnt0[$1] = $4 }; next }
+FILENAME == ARGV[3] { if ($1 == "cpu") cpu1 = $2; else if ($1 == "rss") rss = $2;
+	else if ($1 == "transitions") false_offline = $2 - trans0;
+	else { sent += $2 - sent0[$1];
+	if (class[$1] != 1 && class[$1] != 2 && class[$1] != 3 && $4 > cnt0[$1]) {
+		err = ($3 - sum0[$1]) * 1000 / ($4 - cnt0[$1]) - delay[$1];
+		err_sum += err; err_n++;
+		if (err < 0) err = -err;
+		if (err > err_max) err_max = err } }; next }
+# polled states: time interface state
+FILENAME == ARGV[4] {
+	name = $2; state = $3; t = $1
+	if (state == "OFFLINE" && class[name] == 5 && !(name in det)) {
+		det[name] = (t - t_fail) * 1000; ndet++ }
+	else if (state == "OFFLINE" && class[name] != 5 && !(name in fo)) {
+		fo[name] = 1; false_offline++ }
+	else if (state == "ONLINE" && class[name] == 5 && t >= t_recover \
+		&& !(name in rec)) {
+		rec[name] = (t - t_recover) * 1000; nrec++ }
+}
+function stats(a, n,   k, min, max, s) {
+	if (n == 0) return "null"
+	min = -1
+	for (k in a) { s += a[k]; if (min < 0 || a[k] < min) min = a[k]; if (a[k] > max) max = a[k] }
+	return sprintf("{\"min\":%.0f,\"mean\":%.0f,\"max\":%.0f}", min, s / n, max)
+}
+END {
+	secs = t1 - t0
+	printf "{\"targets\":%d,\"interval_ms\":%d,\"probes\":%d,", targets, interval, sent
+	printf "\"probes_per_s\":%.1f,", sent / secs
+	printf "\"cpu_us_per_probe\":%.2f,", sent ? (cpu1 - cpu0) * 1e6 / sent : 0
+	printf "\"ctx_switches_per_probe\":%.3f,", sent ? (ctx1 - ctx0) / sent : 0
+	if (syscalls == "null" || !sent) printf "\"syscalls_per_probe\":null,"
+	else printf "\"syscalls_per_probe\":%.3f,", syscalls / sent
+	printf "\"rss_kb\":%d,", rss / 1024
+	printf "\"rtt_error_ms\":{\"mean\":%.2f,\"max_abs\":%.2f},", err_n ? err_sum / err_n : 0, err_max
+	printf "\"outage_targets\":%d,\"detected\":%d,", int((targets + 4) / 10), ndet
+	printf "\"detection_ms\":%s,\"recovery_ms\":%s,", stats(det, ndet), stats(rec, nrec)
+	printf "\"false_offline\":%d,\"responder\":%s}\n", false_offline, responder
+}' "$DIR/targets" "$DIR/rtt.0" "$DIR/rtt.1" "$DIR/states"
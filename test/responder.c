@@ -0,0 +1,557 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#define _GNU_SOURCE /* ppoll */
+
+/* keep libc includes before linux headers for musl compatibility */
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/icmp.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Userspace responder for load tests (see test/load.sh)
+ *
+ * Answers ICMP echo requests, TCP SYNs and UDP datagrams to simulated targets
+ * which are routed to the device but not assigned to it, so the kernel drops
+ * them and only this program answers, with per target delay, jitter, loss,
+ * duplication and reordering. It reads from and writes to the device with a
+ * packet socket. The rules file has one line per target or network, the first
+ * matching one is used:
+ *
+ *   10.98.0.1 delay=20 jitter=5 loss=1 dup=0 reorder=0 hold=1000
+ *   10.98.0.0/16 delay=10
+ *
+ * delay and jitter are in ms, loss, dup and reorder in percent. Reordered
+ * replies are held back by another hold ms, so later ones overtake them.
+ * SIGHUP reloads the file, e.g. to start an outage with loss=100. On exit
+ * the counters are printed as JSON.
+ */
+
+#define MAX_FRAME	 1514
+#define DEFAULT_HOLD 1000 /* ms */
+
+struct rule {
+	uint32_t addr; /* network byte order */
+	uint32_t mask;
+	int delay;	 /* ms */
+	int jitter;	 /* ms */
+	int loss;	 /* percent */
+	int dup;	 /* percent */
+	int reorder; /* percent */
+	int hold;	 /* ms */
+};
+
+struct reply {
+	long long due; /* us */
+	int len;
+	unsigned char buf[MAX_FRAME];
+};
+
+static struct rule* rules;
+static int num_rules;
+static const char* rules_file;
+
+/* min heap by due time */
+static struct reply** queue;
+static int queue_len;
+static int queue_size;
+
+static volatile sig_atomic_t reload;
+static volatile sig_atomic_t stop;
+
+static unsigned long cnt_received;
+static unsigned long cnt_replied;
+static unsigned long cnt_lost;
+static unsigned long cnt_duplicated;
+static unsigned long cnt_reordered;
+static unsigned long cnt_unknown;
+
+static long long now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*** rules ***/
+
+static bool rule_parse(char* line, struct rule* r)
+{
+	char* tok = strtok(line, " \t\n");
+	if (tok == NULL || tok[0] == '#') {
+		return false;
+	}
+
+	memset(r, 0, sizeof(*r));
+	r->hold = DEFAULT_HOLD;
+	int len = 32;
+	char* slash = strchr(tok, '/');
+	if (slash != NULL) {
+		*slash = '\0';
+		len = atoi(slash + 1);
+	}
+	if (inet_pton(AF_INET, tok, &r->addr) != 1 || len < 0 || len > 32) {
+		fprintf(stderr, "responder: invalid address '%s'\n", tok);
+		return false;
+	}
+	r->mask = len == 0 ? 0 : htonl(0xffffffffU << (32 - len));
+	r->addr &= r->mask;
+
+	while ((tok = strtok(NULL, " \t\n")) != NULL) {
+		int val;
+		char key[16];
+		if (sscanf(tok, "%15[a-z]=%d", key, &val) != 2 || val < 0) {
+			fprintf(stderr, "responder: invalid option '%s'\n", tok);
+		} else if (strcmp(key, "delay") == 0) {
+			r->delay = val;
+		} else if (strcmp(key, "jitter") == 0) {
+			r->jitter = val;
+		} else if (strcmp(key, "loss") == 0) {
+			r->loss = val;
+		} else if (strcmp(key, "dup") == 0) {
+			r->dup = val;
+		} else if (strcmp(key, "reorder") == 0) {
+			r->reorder = val;
+		} else if (strcmp(key, "hold") == 0) {
+			r->hold = val;
+		} else {
+			fprintf(stderr, "responder: unknown option '%s'\n", key);
+		}
+	}
+	return true;
+}
+
+static bool rules_load(void)
+{
+	char line[256];
+	struct rule* new = NULL;
+	int num = 0;
+	int size = 0;
+
+	FILE* f = fopen(rules_file, "r");
+	if (f == NULL) {
+		fprintf(stderr, "responder: can't open '%s': %s\n", rules_file,
+				strerror(errno));
+		return false;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (num == size) {
+			size = size > 0 ? size * 2 : 64;
+			struct rule* tmp = realloc(new, size * sizeof(*new));
+			if (tmp == NULL) {
+				free(new);
+				fclose(f);
+				return false;
+			}
+			new = tmp;
+		}
+		if (rule_parse(line, &new[num])) {
+			num++;
+		}
+	}
+	fclose(f);
+
+	free(rules);
+	rules = new;
+	num_rules = num;
+	return true;
+}
+
+static struct rule* rule_find(uint32_t addr)
+{
+	for (int i = 0; i < num_rules; i++) {
+		if ((addr & rules[i].mask) == rules[i].addr) {
+			return &rules[i];
+		}
+	}
+	return NULL;
+}
+
+/*** queue ***/
+
+static void queue_swap(int a, int b)
+{
+	struct reply* tmp = queue[a];
+	queue[a] = queue[b];
+	queue[b] = tmp;
+}
+
+static bool queue_push(struct reply* r)
+{
+	if (queue_len == queue_size) {
+		int size = queue_size > 0 ? queue_size * 2 : 1024;
+		struct reply** tmp = realloc(queue, size * sizeof(*queue));
+		if (tmp == NULL) {
+			return false;
+		}
+		queue = tmp;
+		queue_size = size;
+	}
+	int i = queue_len++;
+	queue[i] = r;
+	while (i > 0 && queue[(i - 1) / 2]->due > queue[i]->due) {
+		queue_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	return true;
+}
+
+static struct reply* queue_pop(void)
+{
+	struct reply* r = queue[0];
+	queue[0] = queue[--queue_len];
+	int i = 0;
+	while (true) {
+		int min = i;
+		int l = 2 * i + 1;
+		if (l < queue_len && queue[l]->due < queue[min]->due) {
+			min = l;
+		}
+		if (l + 1 < queue_len && queue[l + 1]->due < queue[min]->due) {
+			min = l + 1;
+		}
+		if (min == i) {
+			break;
+		}
+		queue_swap(i, min);
+		i = min;
+	}
+	return r;
+}
+
+/*** packets ***/
+
+static uint32_t csum_add(uint32_t sum, const void* data, int len)
+{
+	const uint16_t* p = data;
+	while (len > 1) {
+		sum += *p++;
+		len -= 2;
+	}
+	if (len == 1) {
+		sum += *(const uint8_t*)p;
+	}
+	return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return ~sum;
+}
+
+/* checksum of TCP and UDP, with the pseudo header */
+static uint16_t csum_l4(struct iphdr* ip, void* l4, int len)
+{
+	uint16_t proto = htons(ip->protocol);
+	uint16_t l4len = htons(len);
+	uint32_t sum = csum_add(0, &ip->saddr, 8);
+	sum = csum_add(sum, &proto, 2);
+	sum = csum_add(sum, &l4len, 2);
+	return csum_fold(csum_add(sum, l4, len));
+}
+
+/* turn the request in buf into the reply in place, returns its length or 0
+ * if there is nothing to answer */
+static int reply_build(unsigned char* buf, int len)
+{
+	struct ethhdr* eth = (struct ethhdr*)buf;
+	struct iphdr* ip = (struct iphdr*)(buf + sizeof(*eth));
+	int off = sizeof(*eth) + ip->ihl * 4;
+	int l4len = ntohs(ip->tot_len) - ip->ihl * 4;
+	unsigned char mac[ETH_ALEN];
+	uint32_t addr;
+
+	if (l4len <= 0 || off + l4len > len) {
+		return 0;
+	}
+
+	if (ip->protocol == IPPROTO_ICMP) {
+		struct icmphdr* icmp = (struct icmphdr*)(buf + off);
+		if (l4len < (int)sizeof(*icmp) || icmp->type != ICMP_ECHO) {
+			return 0;
+		}
+		icmp->type = ICMP_ECHOREPLY;
+		icmp->checksum = 0;
+		icmp->checksum = csum_fold(csum_add(0, icmp, l4len));
+	} else if (ip->protocol == IPPROTO_TCP) {
+		struct tcphdr* tcp = (struct tcphdr*)(buf + off);
+		if (l4len < (int)sizeof(*tcp)) {
+			return 0;
+		}
+		uint16_t port = tcp->source;
+		tcp->source = tcp->dest;
+		tcp->dest = port;
+		if (tcp->syn && !tcp->ack) {
+			/* accept the connection, without options */
+			tcp->ack_seq = htonl(ntohl(tcp->seq) + 1);
+			tcp->seq = htonl(random());
+			tcp->ack = 1;
+		} else if (tcp->fin || tcp->psh) {
+			/* the connection is not needed anymore */
+			tcp->seq = tcp->ack_seq;
+			tcp->ack_seq = 0;
+			tcp->syn = tcp->fin = tcp->psh = tcp->ack = tcp->urg = 0;
+			tcp->rst = 1;
+		} else {
+			return 0;
+		}
+		tcp->doff = sizeof(*tcp) / 4;
+		tcp->window = htons(65535);
+		tcp->urg_ptr = 0;
+		l4len = sizeof(*tcp);
+		tcp->check = 0;
+		ip->tot_len = htons(ip->ihl * 4 + l4len);
+	} else if (ip->protocol == IPPROTO_UDP) {
+		struct udphdr* udp = (struct udphdr*)(buf + off);
+		if (l4len < (int)sizeof(*udp)) {
+			return 0;
+		}
+		uint16_t port = udp->source;
+		udp->source = udp->dest;
+		udp->dest = port;
+		udp->check = 0; /* optional with IPv4 */
+	} else {
+		return 0;
+	}
+
+	memcpy(mac, eth->h_source, ETH_ALEN);
+	memcpy(eth->h_source, eth->h_dest, ETH_ALEN);
+	memcpy(eth->h_dest, mac, ETH_ALEN);
+	addr = ip->saddr;
+	ip->saddr = ip->daddr;
+	ip->daddr = addr;
+	ip->ttl = 64;
+	ip->check = 0;
+	ip->check = csum_fold(csum_add(0, ip, ip->ihl * 4));
+	if (ip->protocol == IPPROTO_TCP) {
+		struct tcphdr* tcp = (struct tcphdr*)(buf + off);
+		tcp->check = csum_l4(ip, tcp, l4len);
+	}
+	return off + l4len;
+}
+
+static bool chance(int percent)
+{
+	return percent > 0 && random() % 100 < percent;
+}
+
+static void receive(int fd)
+{
+	struct sockaddr_ll sll;
+	socklen_t sll_len;
+	struct reply* r = NULL;
+	int len;
+
+	while (true) {
+		if (r == NULL && (r = malloc(sizeof(*r))) == NULL) {
+			return;
+		}
+		sll_len = sizeof(sll);
+		len = recvfrom(fd, r->buf, sizeof(r->buf), MSG_DONTWAIT,
+					   (struct sockaddr*)&sll, &sll_len);
+		if (len <= 0) {
+			break;
+		}
+		/* packet sockets also see what we send */
+		if (sll.sll_pkttype == PACKET_OUTGOING
+			|| len < (int)(sizeof(struct ethhdr) + sizeof(struct iphdr))) {
+			continue;
+		}
+		struct iphdr* ip = (struct iphdr*)(r->buf + sizeof(struct ethhdr));
+		if (ip->version != 4 || ip->ihl < 5) {
+			continue;
+		}
+		struct rule* rule = rule_find(ip->daddr);
+		if (rule == NULL) {
+			cnt_unknown++;
+			continue;
+		}
+		cnt_received++;
+		r->len = reply_build(r->buf, len);
+		if (r->len == 0) {
+			continue;
+		}
+		if (chance(rule->loss)) {
+			cnt_lost++;
+			continue;
+		}
+
+		long long delay = rule->delay;
+		if (rule->jitter > 0) {
+			delay += random() % (rule->jitter + 1);
+		}
+		if (chance(rule->reorder)) {
+			delay += rule->hold;
+			cnt_reordered++;
+		}
+		r->due = now_us() + delay * 1000;
+		if (chance(rule->dup)) {
+			struct reply* d = malloc(sizeof(*d));
+			if (d != NULL) {
+				memcpy(d, r, sizeof(*d));
+				if (queue_push(d)) {
+					cnt_duplicated++;
+				} else {
+					free(d);
+				}
+			}
+		}
+		if (!queue_push(r)) {
+			continue;
+		}
+		r = NULL;
+	}
+	free(r);
+}
+
+static void send_due(int fd, int ifindex)
+{
+	long long now = now_us();
+
+	while (queue_len > 0 && queue[0]->due <= now) {
+		struct reply* r = queue_pop();
+		struct ethhdr* eth = (struct ethhdr*)r->buf;
+		struct sockaddr_ll sll;
+
+		memset(&sll, 0, sizeof(sll));
+		sll.sll_family = AF_PACKET;
+		sll.sll_ifindex = ifindex;
+		sll.sll_protocol = htons(ETH_P_IP);
+		sll.sll_halen = ETH_ALEN;
+		memcpy(sll.sll_addr, eth->h_dest, ETH_ALEN);
+		if (sendto(fd, r->buf, r->len, 0, (struct sockaddr*)&sll, sizeof(sll))
+			> 0) {
+			cnt_replied++;
+		}
+		free(r);
+	}
+}
+
+static void sig_handler(int signo)
+{
+	if (signo == SIGHUP) {
+		reload = 1;
+	} else {
+		stop = 1;
+	}
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr,
+			"Usage: %s -i device rules_file\n"
+			"  answers ICMP echo, TCP SYN and UDP to the targets in the file\n",
+			name);
+}
+
+int main(int argc, char** argv)
+{
+	const char* dev = NULL;
+	struct sockaddr_ll sll;
+	struct sigaction sa;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			dev = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (dev == NULL || optind != argc - 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	rules_file = argv[optind];
+	if (!rules_load()) {
+		return EXIT_FAILURE;
+	}
+
+	int ifindex = if_nametoindex(dev);
+	int fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+	if (ifindex == 0 || fd < 0) {
+		fprintf(stderr, "responder: can't open '%s': %s\n", dev,
+				strerror(errno));
+		return EXIT_FAILURE;
+	}
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_IP);
+	sll.sll_ifindex = ifindex;
+	if (bind(fd, (struct sockaddr*)&sll, sizeof(sll)) < 0) {
+		fprintf(stderr, "responder: can't bind to '%s': %s\n", dev,
+				strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_handler;
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	srandom(2015);
+
+	while (!stop) {
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		struct timespec ts;
+		struct timespec* timeout = NULL;
+		if (queue_len > 0) {
+			/* with us resolution, the delay is compared with the RTT */
+			long long us = queue[0]->due - now_us();
+			us = us > 0 ? us : 0;
+			ts.tv_sec = us / 1000000;
+			ts.tv_nsec = (us % 1000000) * 1000;
+			timeout = &ts;
+		}
+		if (ppoll(&pfd, 1, timeout, NULL) > 0) {
+			receive(fd);
+		}
+		send_due(fd, ifindex);
+		if (reload) {
+			reload = 0;
+			rules_load();
+		}
+	}
+
+	printf("{\"received\":%lu,\"replied\":%lu,\"lost\":%lu,"
+		   "\"duplicated\":%lu,\"reordered\":%lu,\"unknown\":%lu}\n",
+		   cnt_received, cnt_replied, cnt_lost, cnt_duplicated,
+		   cnt_reordered, cnt_unknown);
+	close(fd);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,654 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "log.h"
+#include "main.h"
+
+/* keep libc includes before linux headers for musl compatibility */
+#include <netinet/in.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Deterministic simulation of the probe logic, run with "make sim"
+ *
+ * Everything runs on a virtual clock: this program defines the uloop timeout
+ * and fd functions itself, so they replace the ones of libubox, and
+ * clock_set_source() gives the same time to the probe logic. The sockets of
+ * the probes, the gateway and traces are replaced with ping_set_io(), replies
+ * are timeouts on the virtual clock. A day of probes takes well below a
+ * second.
+ *
+ * Each scenario describes the path to the target in phases of loss and RTT,
+ * or of outages which pingcheck must detect. The state changes are taken
+ * from the calls of the scripts and checked for detection and recovery
+ * latency, false OFFLINE states and the number of script runs.
+ *
+ * Only the main loop with ICMP is simulated: worker threads, io_uring and XDP
+ * are never initialised here, so they stay disabled, and TCP connects fail.
+ * netlink and scripts are replaced by the stubs below, every interface has a
+ * default route via SIM_GATEWAY.
+ */
+
+#define SIM_BOOT	   1000		  /* s, monotonic time at the start */
+#define SIM_EPOCH	   1700000000 /* s, wall clock time at the start */
+#define SIM_GATEWAY	   0x0a000001 /* 10.0.0.1, hop 1 */
+#define SIM_HOPS	   3		  /* TTL at which probes reach the target */
+#define SIM_MAX_FDS	   1024
+#define SIM_MAX_EVENTS 1024
+
+struct sim_phase {
+	int start;		/* s from the start of the scenario */
+	int loss;		/* percent of lost probes to the target */
+	int rtt;		/* ms */
+	int jitter;		/* ms, added at random */
+	bool link_down; /* the gateway and all hops don't answer either */
+	int detect;		/* ms, outage must be detected within, 0 if none */
+};
+
+struct sim_scenario {
+	const char* name;
+	int duration; /* s */
+	int interval; /* ms */
+	int timeout;  /* ms */
+	double phi;
+	int gw_interval; /* ms */
+	int gw_timeout;	 /* ms */
+	int recover;	 /* ms, max. time to ONLINE after an outage */
+	int scripts;	 /* expected runs of the state scripts */
+	int last_hop;	 /* expected trace result at the end, -1 for any */
+	const struct sim_phase* phases;
+	int num_phases;
+};
+
+/* reply to a probe, queued on the socket when it's due */
+struct sim_pkt {
+	struct uloop_timeout t;
+	int fd;
+	unsigned int gen;
+	int seq;
+	unsigned int from;
+	bool reached; /* echo reply from the target, else time exceeded */
+};
+
+struct sim_sock {
+	unsigned int gen; /* of the fd number, for replies to closed sockets */
+	struct uloop_fd* ufd;
+	struct list_head rx;
+	int ttl; /* 0 for default */
+};
+
+struct sim_event {
+	long long ms; /* since the start of the scenario */
+	enum online_state state;
+};
+
+static long long sim_now; /* ms */
+static long long sim_start;
+static LIST_HEAD(sim_timeouts);
+static struct sim_sock socks[SIM_MAX_FDS];
+static const struct sim_scenario* scn;
+static unsigned int rnd_state;
+static struct sim_event events[SIM_MAX_EVENTS];
+static int num_events;
+static int num_scripts;
+static FILE* results;
+
+/*** virtual uloop ***/
+
+static long long sim_tv_ms(const struct timeval* tv)
+{
+	return (long long)tv->tv_sec * 1000 + tv->tv_usec / 1000;
+}
+
+int uloop_timeout_add(struct uloop_timeout* t)
+{
+	struct uloop_timeout* tmp;
+	struct list_head* h = &sim_timeouts;
+
+	if (t->pending) {
+		return -1;
+	}
+	/* sorted by time, after the ones due at the same time */
+	list_for_each_entry(tmp, &sim_timeouts, list)
+	{
+		if (sim_tv_ms(&tmp->time) > sim_tv_ms(&t->time)) {
+			h = &tmp->list;
+			break;
+		}
+	}
+	list_add_tail(&t->list, h);
+	t->pending = true;
+	return 0;
+}
+
+int uloop_timeout_set(struct uloop_timeout* t, int msecs)
+{
+	long long ms = sim_now + (msecs > 0 ? msecs : 0);
+
+	if (t->pending) {
+		uloop_timeout_cancel(t);
+	}
+	t->time.tv_sec = ms / 1000;
+	t->time.tv_usec = (ms % 1000) * 1000;
+	return uloop_timeout_add(t);
+}
+
+int uloop_timeout_cancel(struct uloop_timeout* t)
+{
+	if (!t->pending) {
+		return -1;
+	}
+	list_del(&t->list);
+	t->pending = false;
+	return 0;
+}
+
+int uloop_timeout_remaining(struct uloop_timeout* t)
+{
+	return t->pending ? (int)(sim_tv_ms(&t->time) - sim_now) : -1;
+}
+
+int uloop_fd_add(struct uloop_fd* ufd, unsigned int flags)
+{
+	if (ufd->fd < 0 || ufd->fd >= SIM_MAX_FDS) {
+		return -1;
+	}
+	socks[ufd->fd].ufd = ufd;
+	ufd->flags = flags;
+	ufd->registered = true;
+	return 0;
+}
+
+int uloop_fd_delete(struct uloop_fd* ufd)
+{
+	if (ufd->fd >= 0 && ufd->fd < SIM_MAX_FDS) {
+		socks[ufd->fd].ufd = NULL;
+	}
+	ufd->registered = false;
+	return 0;
+}
+
+/* run all timeouts due until end, including the replies */
+static void sim_run_until(long long end)
+{
+	while (!list_empty(&sim_timeouts)) {
+		struct uloop_timeout* t
+			= list_first_entry(&sim_timeouts, struct uloop_timeout, list);
+		long long due = sim_tv_ms(&t->time);
+		if (due > end) {
+			break;
+		}
+		if (due > sim_now) {
+			sim_now = due;
+		}
+		uloop_timeout_cancel(t);
+		if (t->cb != NULL) {
+			t->cb(t);
+		}
+	}
+	sim_now = end;
+}
+
+static int sim_clock(clockid_t clk, struct timespec* ts)
+{
+	long long ms = sim_now;
+
+	ms += (clk == CLOCK_REALTIME ? SIM_EPOCH : SIM_BOOT) * 1000LL;
+	ts->tv_sec = ms / 1000;
+	ts->tv_nsec = (ms % 1000) * 1000000;
+	return 0;
+}
+
+/*** network ***/
+
+/* deterministic, every scenario starts with the same seed */
+static unsigned int sim_rand(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static const struct sim_phase* sim_phase_at(long long ms)
+{
+	const struct sim_phase* ph = &scn->phases[0];
+	for (int i = 1; i < scn->num_phases; i++) {
+		if (scn->phases[i].start * 1000LL <= ms) {
+			ph = &scn->phases[i];
+		}
+	}
+	return ph;
+}
+
+static void sim_pkt_cb(struct uloop_timeout* t)
+{
+	struct sim_pkt* p = container_of(t, struct sim_pkt, t);
+	struct sim_sock* s = &socks[p->fd];
+
+	if (p->gen != s->gen || s->ufd == NULL) {
+		free(p); /* socket was closed meanwhile */
+		return;
+	}
+	list_add_tail(&p->t.list, &s->rx);
+
+	/* like epoll, call the handler while something can be received */
+	while (s->ufd != NULL && !list_empty(&s->rx)) {
+		struct list_head* first = s->rx.next;
+		s->ufd->cb(s->ufd, ULOOP_READ);
+		if (s->rx.next == first) {
+			break;
+		}
+	}
+}
+
+static struct sim_pkt* sim_pkt_pop(int fd)
+{
+	if (fd < 0 || fd >= SIM_MAX_FDS || list_empty(&socks[fd].rx)) {
+		return NULL;
+	}
+	struct sim_pkt* p
+		= list_first_entry(&socks[fd].rx, struct sim_pkt, t.list);
+	list_del(&p->t.list);
+	return p;
+}
+
+static int sim_icmp_init(__attribute__((unused)) const char* ifname)
+{
+	/* a real fd, so that closing it does no harm */
+	int fd = open("/dev/null", O_RDONLY);
+	if (fd < 0 || fd >= SIM_MAX_FDS) {
+		return -1;
+	}
+	struct sim_sock* s = &socks[fd];
+	struct sim_pkt* p;
+	if (s->rx.next == NULL) {
+		INIT_LIST_HEAD(&s->rx); /* first use */
+	}
+	while ((p = sim_pkt_pop(fd)) != NULL) {
+		free(p); /* not received before the fd was closed */
+	}
+	s->gen++;
+	s->ufd = NULL;
+	s->ttl = 0;
+	return fd;
+}
+
+static bool sim_icmp_echo_send(int fd, int dst, int cnt)
+{
+	const struct sim_phase* ph = sim_phase_at(sim_now - sim_start);
+	struct sim_sock* s = &socks[fd];
+	int rtt = ph->rtt + (ph->jitter > 0 ? sim_rand() % (ph->jitter + 1) : 0);
+	bool lost = (int)(sim_rand() % 100) < ph->loss;
+	unsigned int from = htonl(SIM_GATEWAY);
+	int hop = s->ttl > 0 && s->ttl < SIM_HOPS ? s->ttl : 0;
+
+	if (ph->link_down) {
+		return true;
+	} else if ((unsigned int)dst == from || hop == 1) {
+		rtt = 1; /* the gateway always answers while the link is up */
+	} else if (hop > 1) {
+		/* routers further away answer while the upstream works */
+		if (ph->loss >= 100) {
+			return true;
+		}
+		from = htonl(SIM_GATEWAY + hop - 1);
+	} else if (lost) {
+		return true;
+	} else {
+		from = dst;
+	}
+
+	struct sim_pkt* p = calloc(1, sizeof(*p));
+	if (p == NULL) {
+		return false;
+	}
+	p->fd = fd;
+	p->gen = s->gen;
+	p->seq = cnt;
+	p->from = from;
+	p->reached = hop == 0;
+	p->t.cb = sim_pkt_cb;
+	uloop_timeout_set(&p->t, rtt);
+	return true;
+}
+
+static int sim_icmp_echo_receive(int fd)
+{
+	struct sim_pkt* p = sim_pkt_pop(fd);
+	if (p == NULL) {
+		return -1;
+	}
+	bool reached = p->reached;
+	free(p);
+	return reached ? fd : -1;
+}
+
+static bool sim_icmp_set_ttl(int fd, int ttl)
+{
+	socks[fd].ttl = ttl;
+	return true;
+}
+
+static int sim_icmp_trace_receive(int fd, unsigned int* from, bool* reached)
+{
+	struct sim_pkt* p = sim_pkt_pop(fd);
+	if (p == NULL) {
+		return -1;
+	}
+	int seq = p->seq;
+	*from = p->from;
+	*reached = p->reached;
+	free(p);
+	return seq;
+}
+
+static int sim_tcp_connect(__attribute__((unused)) const char* ifname,
+						   __attribute__((unused)) int dst,
+						   __attribute__((unused)) int port)
+{
+	return -1;
+}
+
+static bool sim_tcp_check_connect(__attribute__((unused)) int fd)
+{
+	return false;
+}
+
+static const struct ping_io sim_io = {
+	.icmp_init = sim_icmp_init,
+	.icmp_echo_send = sim_icmp_echo_send,
+	.icmp_echo_receive = sim_icmp_echo_receive,
+	.icmp_set_ttl = sim_icmp_set_ttl,
+	.icmp_trace_receive = sim_icmp_trace_receive,
+	.tcp_connect = sim_tcp_connect,
+	.tcp_check_connect = sim_tcp_check_connect,
+};
+
+/*** stubs of scripts.c and netlink.c ***/
+
+void scripts_init(void)
+{
+}
+
+void scripts_run(__attribute__((unused)) struct ping_intf* pi,
+				 enum online_state state_new)
+{
+	num_scripts++;
+	if (num_events < SIM_MAX_EVENTS) {
+		events[num_events].ms = sim_now - sim_start;
+		events[num_events].state = state_new;
+		num_events++;
+	}
+}
+
+void scripts_run_panic(void)
+{
+}
+
+void scripts_run_best(__attribute__((unused)) struct ping_intf* pi,
+					  __attribute__((unused)) const char* previous)
+{
+}
+
+void scripts_run_budget(__attribute__((unused)) struct ping_intf* pi)
+{
+}
+
+void scripts_cancel(__attribute__((unused)) struct ping_intf* pi)
+{
+}
+
+void scripts_finish(void)
+{
+}
+
+bool netlink_init(void)
+{
+	return true;
+}
+
+int netlink_link_carrier(__attribute__((unused)) const char* dev)
+{
+	return -1; /* no link information */
+}
+
+bool netlink_has_default_route(__attribute__((unused)) const char* dev)
+{
+	return true;
+}
+
+uint32_t netlink_default_gateway(__attribute__((unused)) const char* dev)
+{
+	return htonl(SIM_GATEWAY);
+}
+
+int netlink_link_addrs(__attribute__((unused)) const char* dev,
+					   __attribute__((unused)) uint32_t* addrs,
+					   __attribute__((unused)) int max)
+{
+	return 0;
+}
+
+bool netlink_link_stats(__attribute__((unused)) const char* dev,
+						__attribute__((unused)) uint64_t* rx_packets)
+{
+	return false;
+}
+
+void netlink_finish(void)
+{
+}
+
+/*** scenarios ***/
+
+/* random loss, never OFFLINE */
+static const struct sim_phase lossy[] = {
+	{.start = 0, .loss = 5, .rtt = 40, .jitter = 60},
+};
+
+/* a broken link and a broken upstream */
+static const struct sim_phase outage[] = {
+	{.start = 0, .loss = 1, .rtt = 30, .jitter = 40},
+	{.start = 1800, .link_down = true, .detect = 6000},
+	{.start = 1920, .loss = 1, .rtt = 30, .jitter = 40},
+	{.start = 3600, .loss = 100, .detect = 6000},
+	{.start = 3900, .loss = 1, .rtt = 30, .jitter = 40},
+};
+
+/* drops shorter than the timeout */
+static const struct sim_phase drops[] = {
+	{.start = 0, .rtt = 20, .jitter = 10},
+	{.start = 300, .loss = 100},
+	{.start = 303, .rtt = 20, .jitter = 10},
+	{.start = 600, .loss = 100},
+	{.start = 603, .rtt = 20, .jitter = 10},
+	{.start = 900, .link_down = true},
+	{.start = 903, .rtt = 20, .jitter = 10},
+	{.start = 1200, .loss = 100},
+	{.start = 1203, .rtt = 20, .jitter = 10},
+};
+
+/* slow host probes, the gateway finds a broken link quickly. the trace of
+ * the upstream outage ends at the gateway */
+static const struct sim_phase gateway[] = {
+	{.start = 0, .rtt = 30, .jitter = 10},
+	{.start = 600, .link_down = true, .detect = 1500},
+	{.start = 660, .rtt = 30, .jitter = 10},
+	{.start = 1200, .loss = 100, .detect = 21000},
+	{.start = 1320, .rtt = 30, .jitter = 10},
+};
+
+/* phi accrual detector with a lot of jitter */
+static const struct sim_phase phi[] = {
+	{.start = 0, .loss = 1, .rtt = 50, .jitter = 200},
+	{.start = 1800, .link_down = true, .detect = 11000},
+	{.start = 1920, .loss = 1, .rtt = 50, .jitter = 200},
+};
+
+#define PHASES(p) .phases = p, .num_phases = sizeof(p) / sizeof(p[0])
+
+static const struct sim_scenario scenarios[] = {
+	{.name = "lossy", .duration = 86400, .interval = 1000, .timeout = 5000,
+	 .recover = 2000, .scripts = 1, .last_hop = -1, PHASES(lossy)},
+	{.name = "outage", .duration = 7200, .interval = 1000, .timeout = 5000,
+	 .recover = 2000, .scripts = 5, .last_hop = -1, PHASES(outage)},
+	{.name = "drops", .duration = 1800, .interval = 1000, .timeout = 5000,
+	 .recover = 2000, .scripts = 1, .last_hop = -1, PHASES(drops)},
+	{.name = "gateway", .duration = 1500, .interval = 5000, .timeout = 20000,
+	 .gw_interval = 200, .gw_timeout = 1000, .recover = 6000, .scripts = 5,
+	 .last_hop = 1, PHASES(gateway)},
+	{.name = "phi", .duration = 7200, .interval = 1000, .timeout = 10000,
+	 .phi = 8, .recover = 2000, .scripts = 3, .last_hop = -1, PHASES(phi)},
+};
+
+/*** checks ***/
+
+/* rel is "<=" or "==", only for the output */
+static bool sim_check(bool ok, const char* what, long long val,
+					  const char* rel, long long limit)
+{
+	fprintf(results, "  %-28s %8lld %s %-8lld %s\n", what, val, rel, limit,
+			ok ? "ok" : "FAIL");
+	return ok;
+}
+
+/* first event at or after from with state (or any other than OFFLINE if
+ * online), -1 if none */
+static long long sim_event_after(long long from, bool online)
+{
+	for (int i = 0; i < num_events; i++) {
+		if (events[i].ms >= from
+			&& (events[i].state == OFFLINE) != online) {
+			return events[i].ms;
+		}
+	}
+	return -1;
+}
+
+static bool sim_evaluate(struct ping_intf* pi)
+{
+	bool ok = true;
+	int false_offline = 0;
+	char what[64];
+
+	for (int i = 0; i < scn->num_phases; i++) {
+		const struct sim_phase* ph = &scn->phases[i];
+		long long start = ph->start * 1000LL;
+		long long end = i + 1 < scn->num_phases
+							? scn->phases[i + 1].start * 1000LL
+							: scn->duration * 1000LL;
+		if (ph->detect == 0) {
+			continue;
+		}
+		long long off = sim_event_after(start, false);
+		long long latency = off >= 0 && off < end ? off - start : -1;
+		snprintf(what, sizeof(what), "detection at %d s [ms]", ph->start);
+		ok &= sim_check(latency >= 0 && latency <= ph->detect, what, latency,
+						"<=", ph->detect);
+		long long on = sim_event_after(end, true);
+		snprintf(what, sizeof(what), "recovery at %lld s [ms]", end / 1000);
+		ok &= sim_check(on >= 0 && on - end <= scn->recover, what,
+						on >= 0 ? on - end : -1, "<=", scn->recover);
+	}
+
+	for (int i = 0; i < num_events; i++) {
+		if (events[i].state == OFFLINE
+			&& sim_phase_at(events[i].ms)->detect == 0) {
+			false_offline++;
+		}
+	}
+	ok &= sim_check(false_offline == 0, "false OFFLINE", false_offline, "==",
+					0);
+	fprintf(results, "  %-28s %8.3f\n", "false OFFLINE per hour",
+			false_offline * 3600.0 / scn->duration);
+	ok &= sim_check(num_scripts == scn->scripts, "script runs", num_scripts,
+					"==", scn->scripts);
+	if (scn->last_hop >= 0) {
+		ok &= sim_check(pi->trace.last_hop == scn->last_hop, "last hop",
+						pi->trace.last_hop, "==", scn->last_hop);
+	}
+	return ok;
+}
+
+static bool sim_run(const struct sim_scenario* s)
+{
+	struct ping_intf* pi = calloc(1, sizeof(*pi));
+	if (pi == NULL) {
+		return false;
+	}
+
+	scn = s;
+	rnd_state = 2015;
+	num_events = 0;
+	num_scripts = 0;
+	sim_start = sim_now;
+
+	snprintf(pi->name, sizeof(pi->name), "sim_%s", s->name);
+	strcpy(pi->conf_device, "sim0");
+	strcpy(pi->conf_hostname, "192.0.2.1");
+	pi->conf_ignore_ubus = true;
+	pi->conf_proto = ICMP;
+	pi->conf_interval = s->interval;
+	pi->conf_timeout = s->timeout;
+	pi->conf_phi = s->phi;
+	pi->conf_gw_interval = s->gw_interval;
+	pi->conf_gw_timeout = s->gw_timeout;
+	config_add_interface(pi);
+
+	if (ping_init(pi)) {
+		ping_burst(pi);
+	}
+	sim_run_until(sim_start + s->duration * 1000LL);
+	ping_stop(pi);
+
+	fprintf(results, "%s: %d s, %u probes, %u replies\n", s->name,
+			s->duration, pi->cnt_sent, pi->cnt_succ);
+	bool ok = sim_evaluate(pi);
+	pi->state = DOWN; /* stays in the list, but doesn't count anymore */
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	bool ok = true;
+
+	/* log messages only with -v, stdout is for the results */
+	results = fdopen(dup(STDOUT_FILENO), "w");
+	if (results == NULL
+		|| (!(argc > 1 && strcmp(argv[1], "-v") == 0)
+			&& freopen("/dev/null", "w", stdout) == NULL)) {
+		return EXIT_FAILURE;
+	}
+
+	clock_set_source(sim_clock);
+	ping_set_io(&sim_io);
+	intf_init();
+
+	for (unsigned int i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]);
+		 i++) {
+		ok &= sim_run(&scenarios[i]);
+	}
+
+	fprintf(results, "%s\n", ok ? "PASS" : "FAIL");
+	fclose(results);
+	log_close();
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
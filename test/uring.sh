@@ -0,0 +1,47 @@
+#!/bin/bash
+#
+# Probe I/O with epoll against io_uring, run with "make bench-uring" (needs
+# root, like test/load.sh)
+#
+# test/load.sh runs twice with the same targets, with option io_uring off and
+# on. CPU time, context switches and system calls are scaled to 10000 probes
+# and printed with the reduction by io_uring as one JSON object. System calls
+# are counted with perf or strace, they are null without both.
+#
+# The default of 100 targets every 100 ms (1000 probes/s) is about the most
+# the main thread handles: every ICMP socket receives every reply, so the
+# work grows with the square of the number of targets, with both epoll and
+# io_uring. Arguments are passed to test/load.sh.
+
+set -e
+
+ARGS=(-n 100 -i 100 -d 20 "$@")
+
+run() {
+	"$(dirname "$0")/load.sh" "${ARGS[@]}" -o io_uring="$1" | tail -1
+}
+
+epoll=$(run 0)
+uring=$(run 1)
+
+awk -v e="$epoll" -v u="$uring" '
+function get(json, key,   n) {
+	n = length(key) + 3
+	if (!match(json, "\"" key "\":[^,}]*")) return "null"
+	return substr(json, RSTART + n, RLENGTH - n)
+}
+# value per probe of both runs, scaled to 10000 probes times f
+function compare(key, f,   a, b, s) {
+	a = get(e, key); b = get(u, key)
+	if (a == "null" || b == "null") return "null"
+	s = sprintf("{\"epoll\":%.0f,\"io_uring\":%.0f,", a * 10000 * f, b * 10000 * f)
+	return s sprintf("\"reduction_pct\":%.1f}", a > 0 ? (a - b) * 100 / a : 0)
+}
+END {
+	printf "{\"targets\":%s,\"interval_ms\":%s,", get(e, "targets"), get(e, "interval_ms")
+	printf "\"probes_per_s\":{\"epoll\":%s,\"io_uring\":%s},",
+		get(e, "probes_per_s"), get(u, "probes_per_s")
+	printf "\"cpu_ms_per_10k_probes\":%s,", compare("cpu_us_per_probe", 0.001)
+	printf "\"ctx_switches_per_10k_probes\":%s,", compare("ctx_switches_per_probe", 1)
+	printf "\"syscalls_per_10k_probes\":%s}\n", compare("syscalls_per_probe", 1)
+}' < /dev/null
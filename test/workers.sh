@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# Scaling of option workers, run with "make bench-workers" (needs root, like
+# test/load.sh)
+#
+# test/load.sh runs once for each number of worker threads with the same
+# targets and prints one JSON object per run with the probe rate, the CPU
+# time and context switches per probe and the RTT error. When every reply is
+# received by only one worker, the CPU time per probe stays the same with
+# more workers, so the probe rate can grow with the cores.
+#
+# Usage: test/workers.sh [-w "1 2 4"] [load.sh arguments]
+#
+# The default is 1000 targets every 100 ms (10000 probes/s).
+
+set -e
+
+WORKERS="1 2 4"
+if [ "$1" = "-w" ]; then
+	WORKERS=$2
+	shift 2
+fi
+ARGS=(-n 1000 -i 100 -d 20 "$@")
+
+for n in $WORKERS; do
+	"$(dirname "$0")/load.sh" "${ARGS[@]}" -o workers="$n" | tail -1 \
+		| awk -v n="$n" '{
+		printf "{\"workers\":%d", n
+		split("targets probes_per_s cpu_us_per_probe ctx_switches_per_probe rtt_error_ms", k)
+		for (i = 1; i <= 5; i++)
+			if (match($0, "\"" k[i] "\":({[^}]*}|[^,}]*)"))
+				printf ",%s", substr($0, RSTART, RLENGTH)
+		print "}"
+	}'
+done
@@ -0,0 +1,168 @@
+#!/bin/bash
+#
+# Test of option xdp, run with "make test-xdp" (needs root)
+#
+# pingcheck probes targets behind a veth pair, answered by test/responder.c
+# in a second network namespace, with option xdp. Checks that the program is
+# attached to the device, that the replies are counted in the XDP map (the
+# pingcheck_xdp_replies metric) and that they are dropped there: they arrive
+# on the veth, but the ICMP stack of the namespace doesn't see a single echo
+# reply, so no socket receives them. Prints the checks and PASS or FAIL.
+#
+# pingcheck needs a running ubusd. Usage:
+#
+#   test/xdp.sh [-n targets] [-d duration_s]
+
+set -e
+
+TARGETS=10
+DURATION=5
+INTERVAL=200
+
+while getopts "n:d:h" opt; do
+	case $opt in
+	n) TARGETS=$OPTARG ;;
+	d) DURATION=$OPTARG ;;
+	*)
+		sed -n '3,14s/^# \{0,1\}//p' "$0" >&2
+		exit 1
+		;;
+	esac
+done
+
+BUILD_DIR=${BUILD_DIR:-build}
+PINGCHECK=${PINGCHECK:-$BUILD_DIR/pingcheck}
+RESPONDER=${RESPONDER:-$BUILD_DIR/pingcheck-responder}
+NS_MON=pcxdp_mon
+NS_RESP=pcxdp_resp
+METRICS=10.99.1.1:9124
+DIR=$(mktemp -d /tmp/pingcheck-xdp.XXXXXX)
+FAILED=0
+
+cleanup() {
+	[ -n "$PC_PID" ] && kill -INT "$PC_PID" 2>/dev/null && wait "$PC_PID" || true
+	[ -n "$RESP_PID" ] && kill -INT "$RESP_PID" 2>/dev/null && wait "$RESP_PID" || true
+	ip netns del $NS_MON 2>/dev/null || true
+	ip netns del $NS_RESP 2>/dev/null || true
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+fail() {
+	echo "xdp: $*" >&2
+	[ -f "$DIR/pingcheck.log" ] && tail -20 "$DIR/pingcheck.log" >&2
+	exit 1
+}
+
+# check name value relation limit
+check() {
+	local ok=ok
+	if ! awk -v a="$2" -v b="$4" -v r="$3" 'BEGIN {
+		exit !((r == "==" && a == b) || (r == ">=" && a >= b)) }'; then
+		ok=FAIL
+		FAILED=1
+	fi
+	printf '  %-30s %8s %s %-8s %s\n' "$1" "$2" "$3" "$4" "$ok"
+}
+
+metrics() {
+	ip netns exec $NS_MON curl -sf "http://$METRICS/metrics"
+}
+
+# sum of a metric over all interfaces
+metric_sum() {
+	metrics | awk -v m="$1" '$1 ~ "^" m "{" { n += $2 } END { print n + 0 }'
+}
+
+# echo replies which reached the ICMP stack of the monitor namespace
+icmp_echo_replies() {
+	ip netns exec $NS_MON cat /proc/net/snmp | awk '
+	$1 == "Icmp:" && !hdr { for (i = 2; i <= NF; i++) if ($i == "InEchoReps") col = i; hdr = 1; next }
+	$1 == "Icmp:" { print $col }'
+}
+
+rx_packets() {
+	ip netns exec $NS_MON cat /sys/class/net/lm0/statistics/rx_packets
+}
+
+[ "$(id -u)" = 0 ] || fail "needs root for network namespaces"
+[ -x "$PINGCHECK" ] && [ -x "$RESPONDER" ] || fail "build first: make test-xdp"
+command -v curl > /dev/null || fail "needs curl"
+
+ip netns add $NS_MON
+ip netns add $NS_RESP
+ip link add lm0 netns $NS_MON type veth peer name lr0 netns $NS_RESP
+ip -n $NS_MON addr add 10.99.1.1/24 dev lm0
+ip -n $NS_RESP addr add 10.99.1.2/24 dev lr0
+for ns in $NS_MON $NS_RESP; do
+	ip -n $ns link set lo up
+done
+ip -n $NS_MON link set lm0 up
+ip -n $NS_RESP link set lr0 up
+ip -n $NS_MON route add default via 10.99.1.2
+
+{
+	echo "config default"
+	echo "	option interval ${INTERVAL}ms"
+	echo "	option timeout 2"
+	echo "	option ignore_ubus 1"
+	echo "	option xdp 1"
+	echo "	option metrics_listen $METRICS"
+	for ((i = 0; i < TARGETS; i++)); do
+		echo
+		echo "config interface"
+		echo "	option name t$i"
+		echo "	option host 10.97.0.$((i + 1))"
+		echo "	option device lm0"
+	done
+} > "$DIR/pingcheck"
+for ((i = 0; i < TARGETS; i++)); do
+	echo "10.97.0.$((i + 1)) delay=5"
+done > "$DIR/rules"
+
+ip netns exec $NS_RESP "$RESPONDER" -i lr0 "$DIR/rules" > /dev/null &
+RESP_PID=$!
+ip netns exec $NS_MON "$PINGCHECK" -c "$DIR" > "$DIR/pingcheck.log" 2>&1 &
+PC_PID=$!
+
+for ((i = 0; i < 40; i++)); do
+	sleep 0.5
+	kill -0 $PC_PID 2>/dev/null || fail "pingcheck exited"
+	[ "$(metrics | grep -c 'pingcheck_interface_state="ONLINE"} 1')" \
+		-ge "$TARGETS" ] && break
+done
+grep -q "XDP: attached to 'lm0'" "$DIR/pingcheck.log" \
+	|| fail "XDP not attached, kernel without XDP or bpf() support?"
+
+xdp0=$(metric_sum pingcheck_xdp_replies_total)
+succ0=$(metric_sum pingcheck_success_total)
+icmp0=$(icmp_echo_replies)
+rx0=$(rx_packets)
+sleep "$DURATION"
+xdp1=$(metric_sum pingcheck_xdp_replies_total)
+succ1=$(metric_sum pingcheck_success_total)
+icmp1=$(icmp_echo_replies)
+rx1=$(rx_packets)
+online=$(metrics | grep -c 'pingcheck_interface_state="ONLINE"} 1' || true)
+
+# 80% of the probes, for the time to the first and from the last probe
+expected=$((TARGETS * DURATION * 1000 / INTERVAL * 8 / 10))
+
+echo "xdp: $TARGETS targets every $INTERVAL ms for $DURATION s"
+check "interfaces ONLINE" "$online" "==" "$TARGETS"
+if ip -n $NS_MON link show lm0 | grep -q "prog/xdp"; then
+	check "program attached to lm0" 1 "==" 1
+else
+	check "program attached to lm0" 0 "==" 1
+fi
+check "replies counted by XDP" $((xdp1 - xdp0)) ">=" "$expected"
+check "successful probes" $((succ1 - succ0)) ">=" "$expected"
+check "packets received on lm0" $((rx1 - rx0)) ">=" $((xdp1 - xdp0))
+check "echo replies reaching sockets" $((icmp1 - icmp0)) "==" 0
+
+if [ $FAILED = 0 ]; then
+	echo PASS
+else
+	echo FAIL
+	exit 1
+fi
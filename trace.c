@@ -0,0 +1,186 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "log.h"
+#include "main.h"
+
+/* keep libc includes before linux headers for musl compatibility */
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Fault localisation
+ *
+ * When an interface loses probes or goes offline, send echo requests to the
+ * target with TTL 1, 2, ... from a separate socket, like traceroute. Routers
+ * on the way answer with "time exceeded", so the highest TTL which answered
+ * is the last hop which is still reachable, e.g. 1 for the modem and 2 for
+ * the ISP gateway. This is rate limited, only one run per TRACE_INTERVAL.
+ */
+
+#define TRACE_MAX_HOPS 8
+#define TRACE_STEP_MS  200	 /* between probes */
+#define TRACE_WAIT_MS  1000	 /* for answers after the last probe */
+#define TRACE_INTERVAL 60000 /* ms between runs */
+#define TRACE_MAX_AGE  120	 /* s, older results are not passed to scripts */
+
+static void trace_close(struct trace_state* tr)
+{
+	uloop_timeout_cancel(&tr->timeout);
+	if (tr->ufd.fd > 0) {
+		uloop_fd_delete(&tr->ufd);
+		close(tr->ufd.fd);
+		tr->ufd.fd = 0;
+	}
+}
+
+static void trace_finish(struct ping_intf* pi)
+{
+	struct trace_state* tr = &pi->trace;
+
+	trace_close(tr);
+	tr->last_hop = tr->hop;
+	tr->last_addr = tr->addr;
+	tr->last_reached = tr->reached;
+	tr->last_time = clock_time();
+
+	if (tr->reached) {
+		LOG_NOTI("Interface '%s': target reachable at hop %d", pi->name,
+				 tr->hop);
+	} else if (tr->hop > 0) {
+		LOG_NOTI("Interface '%s': last answering hop %d (%s)", pi->name,
+				 tr->hop, trace_addr_str(pi));
+	} else {
+		LOG_NOTI("Interface '%s': no hop answering", pi->name);
+	}
+}
+
+static void trace_fd_cb(struct uloop_fd* fd,
+						__attribute__((unused)) unsigned int events)
+{
+	struct ping_intf* pi = container_of(fd, struct ping_intf, trace.ufd);
+	struct trace_state* tr = &pi->trace;
+	unsigned int from;
+	bool reached;
+	int ttl;
+
+	while ((ttl = probe_io->icmp_trace_receive(fd->fd, &from, &reached))
+		   >= 0) {
+		if (ttl == 0 || ttl > TRACE_MAX_HOPS) {
+			continue;
+		}
+		budget_icmp(pi);
+		if (reached) {
+			/* TTLs after this one will also reach the target */
+			if (!tr->reached || ttl < tr->hop) {
+				tr->hop = ttl;
+				tr->addr = from;
+			}
+			tr->reached = true;
+		} else if (!tr->reached && ttl > tr->hop) {
+			tr->hop = ttl;
+			tr->addr = from;
+		}
+	}
+
+	if (tr->reached) {
+		trace_finish(pi);
+	}
+}
+
+static void trace_timeout_cb(struct uloop_timeout* t)
+{
+	struct ping_intf* pi = container_of(t, struct ping_intf, trace.timeout);
+	struct trace_state* tr = &pi->trace;
+
+	if (tr->ttl > TRACE_MAX_HOPS || tr->reached) {
+		trace_finish(pi);
+		return;
+	}
+
+	if (!probe_io->icmp_set_ttl(tr->ufd.fd, tr->ttl)) {
+		LOG_ERR("Could not set TTL for '%s': %s", pi->name, strerror(errno));
+		trace_finish(pi);
+		return;
+	}
+	if (probe_io->icmp_echo_send(tr->ufd.fd, pi->conf_host, tr->ttl)) {
+		budget_icmp(pi);
+	}
+	tr->ttl++;
+	uloop_timeout_set(t, tr->ttl > TRACE_MAX_HOPS ? TRACE_WAIT_MS
+												  : TRACE_STEP_MS);
+}
+
+/* start a run if none is running and the last was long enough ago */
+void trace_start(struct ping_intf* pi)
+{
+	struct trace_state* tr = &pi->trace;
+	struct timespec now;
+
+	clock_now(CLOCK_MONOTONIC, &now);
+	if (tr->ufd.fd > 0 || pi->conf_host == 0 || pi->budget.exhausted
+		|| (tr->start.tv_sec != 0
+			&& timespec_diff_ms(tr->start, now) < TRACE_INTERVAL)) {
+		return;
+	}
+
+	int fd = probe_io->icmp_init(pi->device[0] != '\0' ? pi->device : NULL);
+	if (fd < 0) {
+		return;
+	}
+	tr->ufd.fd = fd;
+	tr->ufd.cb = trace_fd_cb;
+	if (uloop_fd_add(&tr->ufd, ULOOP_READ) < 0) {
+		close(fd);
+		tr->ufd.fd = 0;
+		return;
+	}
+
+	LOG_INF("Interface '%s': looking for last answering hop", pi->name);
+	tr->start = now;
+	tr->ttl = 1;
+	tr->hop = 0;
+	tr->addr = 0;
+	tr->reached = false;
+	tr->timeout.cb = trace_timeout_cb;
+	trace_timeout_cb(&tr->timeout);
+}
+
+void trace_stop(struct ping_intf* pi)
+{
+	trace_close(&pi->trace);
+}
+
+/* seconds since the last run finished, -1 if never or too long ago to say
+ * anything about the current problem */
+int trace_age(struct ping_intf* pi)
+{
+	if (pi->trace.last_time == 0) {
+		return -1;
+	}
+	time_t age = clock_time() - pi->trace.last_time;
+	return age >= 0 && age <= TRACE_MAX_AGE ? (int)age : -1;
+}
+
+/* address of the last answering hop, empty if none */
+const char* trace_addr_str(struct ping_intf* pi)
+{
+	struct in_addr in = {.s_addr = pi->trace.last_addr};
+	return pi->trace.last_hop > 0 ? inet_ntoa(in) : "";
+}
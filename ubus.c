@@ -14,111 +14,40 @@
  */
 #include "log.h"
 #include "main.h"
+#include <arpa/inet.h>
 #include <libubus.h>
+#include <time.h>
 #include <unistd.h>
 
 static struct ubus_context* ctx;
 
-/*** network interface events ***/
-
-static struct ubus_event_handler interface_event_handler;
-
-enum {
-	EVT_INTF,
-	EVT_ACTN,
-};
-
-static const struct blobmsg_policy event_policy[] = {
-	[EVT_INTF] = {.name = "interface", .type = BLOBMSG_TYPE_STRING},
-	[EVT_ACTN] = {.name = "action", .type = BLOBMSG_TYPE_STRING},
-};
-
-static void ubus_receive_interface_event(
-	__attribute__((unused)) struct ubus_context* ctx,
-	__attribute__((unused)) struct ubus_event_handler* ev,
-	__attribute__((unused)) const char* type, struct blob_attr* msg)
-{
-	const char* interface = NULL;
-	const char* action = NULL;
-	struct blob_attr* tb[ARRAY_SIZE(event_policy)];
-
-	blobmsg_parse(event_policy, ARRAY_SIZE(event_policy), tb, blob_data(msg),
-				  blob_len(msg));
-
-	if (tb[EVT_INTF] && tb[EVT_ACTN]) {
-		interface = blobmsg_get_string(tb[EVT_INTF]);
-		action = blobmsg_get_string(tb[EVT_ACTN]);
-		notify_interface(interface, action);
-	}
-}
-
-bool ubus_listen_network_events(void)
-{
-	/* ubus event listener */
-	memset(&interface_event_handler, 0, sizeof(interface_event_handler));
-	interface_event_handler.cb = ubus_receive_interface_event;
-	int ret = ubus_register_event_handler(ctx, &interface_event_handler,
-										  "network.interface");
-	if (ret < 0) {
-		return false;
-	}
-
-	ubus_add_uloop(ctx);
-	return true;
-}
-
-/*** generic result callback: just copies msg to last_result_msg ***/
-
-static struct blob_attr* last_result_msg;
-
-static void ubus_result_cb(__attribute__((unused)) struct ubus_request* req,
-						   __attribute__((unused)) int type,
-						   struct blob_attr* msg)
-{
-	if (!msg) {
-		return;
-	}
-
-	unsigned int len = blob_raw_len(msg);
-	last_result_msg = malloc(len);
-	memcpy(last_result_msg, msg, len);
-	// client needs to free(last_result_msg);
-}
-
 /*** network interface status ***/
 
-static bool ubus_interface_status(const char* name)
-{
-	uint32_t id;
-	int ret;
-	char idstr[32];
-
-	ret = snprintf(idstr, sizeof(idstr), "network.interface.%s", name);
-	if (ret <= 0 || (unsigned int)ret >= sizeof(idstr)) { // error or truncated
-		return false;
-	}
-
-	ret = ubus_lookup_id(ctx, idstr, &id);
-	if (ret) {
-		return false;
-	}
+/*
+ * Interface status is requested asynchronously from netifd and kept in a
+ * cache, which is updated from the network.interface events. This way a
+ * busy netifd does not block probing, and most ping_init() calls can be
+ * answered directly from the cache.
+ */
 
-	ret = ubus_invoke(ctx, id, "status", NULL, ubus_result_cb, NULL,
-					  UBUS_TIMEOUT);
-	if (ret < 0) {
-		return false;
-	}
+struct ifstatus {
+	struct avl_node avl;
+	char name[MAX_IFNAME_LEN];
+	char device[MAX_IFNAME_LEN];
+	int status; /* see ubus_interface_get_status() */
+	bool valid;
+	bool pending;
+	struct ubus_request req;
+	struct uloop_timeout timeout;
+};
 
-	// client needs to free(last_result_msg);
-	return true;
-}
+static AVL_TREE(ifstatus_cache, avl_strcmp, false, NULL);
 
 enum {
 	IFSTAT_UP,
 	IFSTAT_DEVICE,
 	IFSTAT_L3DEVICE,
 	IFSTAT_ROUTE,
-	IFSTAT_TARGET,
 };
 
 static const struct blobmsg_policy ifstat_policy[] = {
@@ -136,37 +65,23 @@ static const struct blobmsg_policy route_policy[] = {
 	[ROUTE_TARGET] = {.name = "target", .type = BLOBMSG_TYPE_STRING},
 };
 
-/*
- * checks interface is up and default route goes thru it
- *
- * returns: -1 error or not found
- * 	     0 down
- * 	     1 up but no default route
- * 	     2 default route exists
- */
-int ubus_interface_get_status(const char* name, char* device, size_t device_len)
+/* parse interface status reply in place, returns status and sets device */
+static int ubus_interface_parse_status(struct blob_attr* msg, char* device,
+									   size_t device_len)
 {
-	int ret;
 	const char* dev;
 	const char* route;
-
-	ret = ubus_interface_status(name);
-	if (!ret) {
-		return -1;
-	}
-
 	struct blob_attr* tb[ARRAY_SIZE(ifstat_policy)];
-	blobmsg_parse(ifstat_policy, ARRAY_SIZE(ifstat_policy), tb,
-				  blob_data(last_result_msg), blob_len(last_result_msg));
+
+	blobmsg_parse(ifstat_policy, ARRAY_SIZE(ifstat_policy), tb, blob_data(msg),
+				  blob_len(msg));
 
 	// up
 	if (!tb[IFSTAT_UP]) {
-		ret = -1;
-		goto exit; // error
+		return -1; // error
 	}
 	if (!blobmsg_get_bool(tb[IFSTAT_UP])) {
-		ret = 0;
-		goto exit; // down
+		return 0; // down
 	}
 
 	// device
@@ -175,20 +90,17 @@ int ubus_interface_get_status(const char* name, char* device, size_t device_len)
 	} else if (tb[IFSTAT_DEVICE]) {
 		dev = blobmsg_get_string(tb[IFSTAT_DEVICE]);
 	} else {
-		ret = -1;
-		goto exit; // error
+		return -1; // error
 	}
 	if (strlen(dev) >= device_len) {
 		LOG_ERR("ubus_interface_get_status: device_len too short");
-		ret = -1;
-		goto exit; // error
+		return -1; // error
 	}
 	strcpy(device, dev);
 
-	// routes
+	/* routes of netifd, only used when netlink doesn't know the device */
 	if (!tb[IFSTAT_ROUTE]) {
-		ret = 1;
-		goto exit; // up, no route
+		return 1; // up, no route
 	}
 	int len = blobmsg_data_len(tb[IFSTAT_ROUTE]);
 	struct blob_attr* arr = blobmsg_data(tb[IFSTAT_ROUTE]);
@@ -201,16 +113,237 @@ int ubus_interface_get_status(const char* name, char* device, size_t device_len)
 		if (tb2[ROUTE_TARGET]) {
 			route = blobmsg_get_string(tb2[ROUTE_TARGET]);
 			if (route != NULL && strcmp(route, "0.0.0.0") == 0) {
-				ret = 2;
-				goto exit; // default route found
+				return 2; // default route found
 			}
 		}
 	}
+	return 1;
+}
+
+static void ubus_interface_status_data_cb(struct ubus_request* req,
+										  __attribute__((unused)) int type,
+										  struct blob_attr* msg)
+{
+	struct ifstatus* ifs = container_of(req, struct ifstatus, req);
+	if (msg != NULL) {
+		ifs->status = ubus_interface_parse_status(msg, ifs->device,
+												  sizeof(ifs->device));
+	}
+}
+
+static void ubus_interface_status_complete_cb(struct ubus_request* req,
+											  int ret)
+{
+	struct ifstatus* ifs = container_of(req, struct ifstatus, req);
+
+	uloop_timeout_cancel(&ifs->timeout);
+	ifs->pending = false;
+	if (ret != UBUS_STATUS_OK) {
+		ifs->status = -1;
+	}
+	ifs->valid = true;
+	notify_interface_status(ifs->name);
+}
+
+/* uloop timeout callback when netifd did not answer in time */
+static void uto_interface_status_cb(struct uloop_timeout* t)
+{
+	struct ifstatus* ifs = container_of(t, struct ifstatus, timeout);
+
+	LOG_ERR("Interface '%s' status request timed out", ifs->name);
+	ubus_abort_request(ctx, &ifs->req);
+	ifs->pending = false;
+	ifs->status = -1;
+	ifs->valid = true;
+	notify_interface_status(ifs->name);
+}
+
+/* start asynchronous status request, result is cached */
+static bool ubus_interface_status_request(struct ifstatus* ifs)
+{
+	uint32_t id;
+	int ret;
+	char idstr[32];
+
+	if (ifs->pending) {
+		ubus_abort_request(ctx, &ifs->req);
+		uloop_timeout_cancel(&ifs->timeout);
+		ifs->pending = false;
+	}
+
+	ret = snprintf(idstr, sizeof(idstr), "network.interface.%s", ifs->name);
+	if (ret <= 0 || (unsigned int)ret >= sizeof(idstr)) { // error or truncated
+		return false;
+	}
+
+	/* this only asks ubusd, not netifd */
+	ret = ubus_lookup_id(ctx, idstr, &id);
+	if (ret) {
+		return false;
+	}
+
+	ret = ubus_invoke_async(ctx, id, "status", NULL, &ifs->req);
+	if (ret) {
+		return false;
+	}
+
+	ifs->status = -1; /* until we get a valid reply */
+	ifs->req.data_cb = ubus_interface_status_data_cb;
+	ifs->req.complete_cb = ubus_interface_status_complete_cb;
+	ubus_complete_request_async(ctx, &ifs->req);
+	ifs->pending = true;
+
+	ifs->timeout.cb = uto_interface_status_cb;
+	uloop_timeout_set(&ifs->timeout, UBUS_TIMEOUT);
+	return true;
+}
+
+static struct ifstatus* ubus_interface_status_get(const char* name)
+{
+	struct ifstatus* ifs;
+
+	ifs = avl_find_element(&ifstatus_cache, name, ifs, avl);
+	if (ifs != NULL) {
+		return ifs;
+	}
+
+	if (strlen(name) >= MAX_IFNAME_LEN) {
+		return NULL;
+	}
+	ifs = calloc(1, sizeof(*ifs));
+	if (ifs == NULL) {
+		return NULL;
+	}
+	strcpy(ifs->name, name);
+	ifs->avl.key = ifs->name;
+	avl_insert(&ifstatus_cache, &ifs->avl);
+	return ifs;
+}
+
+/* update cache from network.interface events */
+static void ubus_interface_status_event(const char* name, const char* action)
+{
+	struct ifstatus* ifs;
+
+	/* only interfaces we have asked for before are cached */
+	ifs = avl_find_element(&ifstatus_cache, name, ifs, avl);
+	if (ifs == NULL) {
+		return;
+	}
+
+	if (strcmp(action, "ifdown") == 0) {
+		if (ifs->pending) {
+			ubus_abort_request(ctx, &ifs->req);
+			uloop_timeout_cancel(&ifs->timeout);
+			ifs->pending = false;
+		}
+		ifs->status = 0;
+		ifs->valid = true;
+	} else if (strcmp(action, "ifup") == 0
+			   || strcmp(action, "ifupdate") == 0) {
+		/* device and routes may have changed */
+		ifs->valid = false;
+		ubus_interface_status_request(ifs);
+	}
+}
+
+/*
+ * checks interface is up, gets its device and if netifd has a default route
+ * through it
+ *
+ * returns: -2 status requested, notify_interface_status() is called when
+ *	       it is available
+ * 	    -1 error or not found
+ * 	     0 down
+ * 	     1 up but no default route
+ * 	     2 default route exists
+ */
+int ubus_interface_get_status(const char* name, char* device, size_t device_len)
+{
+	struct ifstatus* ifs = ubus_interface_status_get(name);
+	if (ifs == NULL) {
+		return -1;
+	}
+
+	if (!ifs->valid) {
+		if (ifs->pending || ubus_interface_status_request(ifs)) {
+			return -2;
+		}
+		return -1;
+	}
+
+	if (ifs->status > 0) {
+		if (strlen(ifs->device) >= device_len) {
+			LOG_ERR("ubus_interface_get_status: device_len too short");
+			return -1;
+		}
+		strcpy(device, ifs->device);
+	}
+	return ifs->status;
+}
+
+/*** network interface events ***/
+
+static struct ubus_event_handler interface_event_handler;
+
+enum {
+	EVT_INTF,
+	EVT_ACTN,
+};
+
+static const struct blobmsg_policy event_policy[] = {
+	[EVT_INTF] = {.name = "interface", .type = BLOBMSG_TYPE_STRING},
+	[EVT_ACTN] = {.name = "action", .type = BLOBMSG_TYPE_STRING},
+};
+
+static void ubus_receive_interface_event(
+	__attribute__((unused)) struct ubus_context* ctx,
+	__attribute__((unused)) struct ubus_event_handler* ev,
+	__attribute__((unused)) const char* type, struct blob_attr* msg)
+{
+	const char* interface = NULL;
+	const char* action = NULL;
+	struct blob_attr* tb[ARRAY_SIZE(event_policy)];
+
+	blobmsg_parse(event_policy, ARRAY_SIZE(event_policy), tb, blob_data(msg),
+				  blob_len(msg));
+
+	if (tb[EVT_INTF] && tb[EVT_ACTN]) {
+		interface = blobmsg_get_string(tb[EVT_INTF]);
+		action = blobmsg_get_string(tb[EVT_ACTN]);
+		ubus_interface_status_event(interface, action);
+		notify_interface(interface, action);
+	}
+}
+
+static uloop_fd_handler ubus_sock_cb;
+
+static void ubus_sock_cb_debug(struct uloop_fd* fd, unsigned int events)
+{
+	long long start;
 
-exit:
-	free(last_result_msg);
-	last_result_msg = NULL;
-	return ret;
+	debug_cb_start(&start);
+	ubus_sock_cb(fd, events);
+	debug_cb_end(DBG_CB_UBUS, start, NULL);
+}
+
+bool ubus_listen_network_events(void)
+{
+	/* ubus event listener */
+	memset(&interface_event_handler, 0, sizeof(interface_event_handler));
+	interface_event_handler.cb = ubus_receive_interface_event;
+	int ret = ubus_register_event_handler(ctx, &interface_event_handler,
+										  "network.interface");
+	if (ret < 0) {
+		return false;
+	}
+
+	ubus_add_uloop(ctx);
+
+	/* measure ubus processing for the debug method */
+	ubus_sock_cb = ctx->sock.cb;
+	ctx->sock.cb = ubus_sock_cb_debug;
+	return true;
 }
 
 /*** server ***/
@@ -246,6 +379,9 @@ static int server_status(struct ubus_context* ctx,
 			return -1;
 		}
 		blobmsg_add_string(&b, "status", get_status_str(pi->state));
+		if (pi->provisional) {
+			blobmsg_add_u8(&b, "provisional", true);
+		}
 		blobmsg_add_string(&b, "interface", pi->name);
 		blobmsg_add_string(&b, "device", pi->device);
 		blobmsg_add_u32(&b, "percent",
@@ -255,27 +391,83 @@ static int server_status(struct ubus_context* ctx,
 		blobmsg_add_u32(&b, "success", pi->cnt_succ);
 		blobmsg_add_u32(&b, "last_rtt", pi->last_rtt);
 		blobmsg_add_u32(&b, "max_rtt", pi->max_rtt);
+		if (pi->conf_phi > 0) {
+			blobmsg_add_double(&b, "phi", phi_value(pi));
+		}
+		blobmsg_add_double(&b, "score", pi->quality.score);
+		blobmsg_add_u32(&b, "loss", pi->quality.loss);
+		blobmsg_add_u32(&b, "latency", pi->quality.latency);
+		blobmsg_add_u32(&b, "jitter", pi->quality.jitter);
+		blobmsg_add_u32(&b, "p95", pi->quality.p95);
+		if (pi->conf_passive > 0) {
+			void* tbl = blobmsg_open_table(&b, "passive");
+			blobmsg_add_u8(&b, "healthy", pi->passive.healthy);
+			blobmsg_add_u32(&b, "rx_packets", pi->passive.rx_delta);
+			blobmsg_add_u32(&b, "tcp_active", pi->passive.tcp_active);
+			blobmsg_add_u32(&b, "tcp_stalled", pi->passive.tcp_stalled);
+			blobmsg_add_u32(&b, "skipped", pi->passive.cnt_skipped);
+			blobmsg_close_table(&b, tbl);
+		}
+		if (pi->conf_gw_interval > 0) {
+			void* tbl = blobmsg_open_table(&b, "gateway");
+			struct in_addr in = {.s_addr = pi->gateway.addr};
+			blobmsg_add_string(&b, "address", inet_ntoa(in));
+			blobmsg_add_u8(&b, "answering", pi->gateway.up);
+			blobmsg_add_u32(&b, "sent", pi->gateway.cnt_sent);
+			blobmsg_add_u32(&b, "failures", pi->gateway.cnt_fail);
+			blobmsg_add_u32(&b, "last_rtt", pi->gateway.last_rtt);
+			blobmsg_close_table(&b, tbl);
+		}
+		if (pi->conf_budget > 0) {
+			void* tbl = blobmsg_open_table(&b, "budget");
+			blobmsg_add_u64(&b, "limit", pi->conf_budget);
+			blobmsg_add_string(&b, "unit",
+							   pi->conf_budget_packets ? "packets" : "bytes");
+			blobmsg_add_u64(&b, "used_bytes", pi->budget.used_bytes);
+			blobmsg_add_u64(&b, "used_packets", pi->budget.used_packets);
+			blobmsg_add_u8(&b, "exhausted", pi->budget.exhausted);
+			blobmsg_add_u32(&b, "interval", pi->budget.interval);
+			blobmsg_add_u64(&b, "period_end", pi->budget.period_end);
+			blobmsg_close_table(&b, tbl);
+		}
+		if (pi->trace.last_time != 0) {
+			void* tbl = blobmsg_open_table(&b, "last_hop");
+			blobmsg_add_u32(&b, "hop", pi->trace.last_hop);
+			blobmsg_add_string(&b, "address", trace_addr_str(pi));
+			blobmsg_add_u8(&b, "target_reached", pi->trace.last_reached);
+			blobmsg_add_u64(&b, "time", pi->trace.last_time);
+			blobmsg_close_table(&b, tbl);
+		}
 	} else {
 		/* global status / summary */
-		int num;
 		void* arr;
-		const char* dest[MAX_NUM_INTERFACES];
+		struct ping_intf* pi;
 
 		blobmsg_add_string(&b, "status", get_status_str(get_global_status()));
 
 		arr = blobmsg_open_array(&b, "online_interfaces");
-		num = get_online_interface_names(dest, MAX_NUM_INTERFACES);
-		for (int i = 0; i < MAX_NUM_INTERFACES && i < num; i++) {
-			blobmsg_add_string(&b, NULL, dest[i]);
+		for_each_interface(pi) {
+			if (pi->state == ONLINE) {
+				blobmsg_add_string(&b, NULL, pi->name);
+			}
+		}
+		blobmsg_close_array(&b, arr);
+
+		arr = blobmsg_open_array(&b, "degraded_interfaces");
+		for_each_interface(pi) {
+			if (pi->state == DEGRADED) {
+				blobmsg_add_string(&b, NULL, pi->name);
+			}
 		}
 		blobmsg_close_array(&b, arr);
 
 		arr = blobmsg_open_array(&b, "known_interfaces");
-		num = get_all_interface_names(dest, MAX_NUM_INTERFACES);
-		for (int i = 0; i < MAX_NUM_INTERFACES && i < num; i++) {
-			blobmsg_add_string(&b, NULL, dest[i]);
+		for_each_interface(pi) {
+			blobmsg_add_string(&b, NULL, pi->name);
 		}
 		blobmsg_close_array(&b, arr);
+
+		quality_blob(&b);
 	}
 
 	if (tb[PINGCHECK_RESET] && blobmsg_get_bool(tb[PINGCHECK_RESET])) {
@@ -310,9 +502,118 @@ static int server_reset(__attribute__((unused)) struct ubus_context* ctx,
 	return 0;
 }
 
+enum { HISTORY_INTF, HISTORY_RES, HISTORY_START, HISTORY_END, __HISTORY_MAX };
+
+static const struct blobmsg_policy history_policy[] = {
+	[HISTORY_INTF] = {.name = "interface", .type = BLOBMSG_TYPE_STRING},
+	[HISTORY_RES] = {.name = "resolution", .type = BLOBMSG_TYPE_STRING},
+	[HISTORY_START] = {.name = "start", .type = BLOBMSG_TYPE_INT32},
+	[HISTORY_END] = {.name = "end", .type = BLOBMSG_TYPE_INT32},
+};
+
+static void server_history_point(void* ctx, uint64_t time, double rtt,
+								 double loss)
+{
+	struct blob_buf* buf = ctx;
+	void* arr = blobmsg_open_array(buf, NULL);
+	blobmsg_add_u64(buf, NULL, time);
+	blobmsg_add_double(buf, NULL, rtt);
+	blobmsg_add_double(buf, NULL, loss);
+	blobmsg_close_array(buf, arr);
+}
+
+/* unix time in seconds to ms, negative values are relative to now */
+static uint64_t server_history_time(struct blob_attr* attr, uint64_t def)
+{
+	if (attr == NULL) {
+		return def;
+	}
+	int64_t t = (int32_t)blobmsg_get_u32(attr);
+	if (t < 0) {
+		t += time(NULL);
+	}
+	return t > 0 ? (uint64_t)t * 1000 : 0;
+}
+
+static int server_history(struct ubus_context* ctx,
+						  __attribute__((unused)) struct ubus_object* obj,
+						  struct ubus_request_data* req,
+						  __attribute__((unused)) const char* method,
+						  struct blob_attr* msg)
+{
+	struct blob_attr* tb[__HISTORY_MAX];
+	int res = SERIES_1MIN;
+
+	blobmsg_parse(history_policy, ARRAY_SIZE(history_policy), tb,
+				  blob_data(msg), blob_len(msg));
+
+	if (!tb[HISTORY_INTF]) {
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+	struct ping_intf* pi = get_interface(blobmsg_get_string(tb[HISTORY_INTF]));
+	if (pi == NULL) {
+		return UBUS_STATUS_NOT_FOUND;
+	}
+	if (tb[HISTORY_RES]) {
+		res = series_res_from_str(blobmsg_get_string(tb[HISTORY_RES]));
+		if (res < 0) {
+			return UBUS_STATUS_INVALID_ARGUMENT;
+		}
+	}
+	uint64_t start = server_history_time(tb[HISTORY_START], 0);
+	uint64_t end = server_history_time(tb[HISTORY_END], UINT64_MAX);
+
+	blob_buf_init(&b, 0);
+	blobmsg_add_string(&b, "interface", pi->name);
+	blobmsg_add_u32(&b, "memory", series_memory(pi));
+	void* arr = blobmsg_open_array(&b, "points");
+	series_query(pi, res, start, end, server_history_point, &b);
+	blobmsg_close_array(&b, arr);
+
+	ubus_send_reply(ctx, req, b.head);
+	return 0;
+}
+
+static int server_reload(__attribute__((unused)) struct ubus_context* ctx,
+						 __attribute__((unused)) struct ubus_object* obj,
+						 __attribute__((unused)) struct ubus_request_data* req,
+						 __attribute__((unused)) const char* method,
+						 __attribute__((unused)) struct blob_attr* msg)
+{
+	return config_reload() ? UBUS_STATUS_OK : UBUS_STATUS_UNKNOWN_ERROR;
+}
+
+static int server_debug(struct ubus_context* ctx,
+						__attribute__((unused)) struct ubus_object* obj,
+						struct ubus_request_data* req,
+						__attribute__((unused)) const char* method,
+						__attribute__((unused)) struct blob_attr* msg)
+{
+	blob_buf_init(&b, 0);
+	debug_blob(&b);
+	ubus_send_reply(ctx, req, b.head);
+	return 0;
+}
+
+static int server_compare(struct ubus_context* ctx,
+						  __attribute__((unused)) struct ubus_object* obj,
+						  struct ubus_request_data* req,
+						  __attribute__((unused)) const char* method,
+						  __attribute__((unused)) struct blob_attr* msg)
+{
+	blob_buf_init(&b, 0);
+	compare_blob(&b);
+	ubus_send_reply(ctx, req, b.head);
+	return 0;
+}
+
 static const struct ubus_method server_methods[] = {
 	UBUS_METHOD("status", server_status, intf_policy),
 	UBUS_METHOD("reset", server_reset, reset_policy),
+	UBUS_METHOD("history", server_history, history_policy),
+	UBUS_METHOD_NOARG("reload", server_reload),
+	UBUS_METHOD_NOARG("debug", server_debug),
+	UBUS_METHOD_NOARG("compare", server_compare),
 };
 
 static struct ubus_object_type server_object_type
@@ -350,7 +651,19 @@ bool ubus_init(void)
 
 void ubus_finish(void)
 {
-	free(last_result_msg);
+	struct ifstatus* ifs;
+	struct ifstatus* tmp;
+
+	avl_for_each_element_safe(&ifstatus_cache, ifs, avl, tmp)
+	{
+		if (ifs->pending && ctx != NULL) {
+			ubus_abort_request(ctx, &ifs->req);
+		}
+		uloop_timeout_cancel(&ifs->timeout);
+		avl_delete(&ifstatus_cache, &ifs->avl);
+		free(ifs);
+	}
+
 	if (ctx == NULL) {
 		return;
 	}
@@ -15,12 +15,21 @@
 #include "log.h"
 #include "main.h"
 #include <arpa/inet.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <uci.h>
 
+/* directory of the config files, NULL for the default /etc/config */
+static const char* config_dir;
+
+void uci_config_dir(const char* dir)
+{
+	config_dir = dir;
+}
+
 /** analogous to uci_lookup_option_string from uci.h, returns -1 when not found
  */
 static int uci_lookup_option_int(struct uci_context* uci, struct uci_section* s,
@@ -30,11 +39,84 @@ static int uci_lookup_option_int(struct uci_context* uci, struct uci_section* s,
 	return str == NULL ? -1 : atoi(str);
 }
 
-int uci_config_pingcheck(struct ping_intf* intf, int len)
+/** like uci_lookup_option_int for decimal numbers */
+static double uci_lookup_option_double(struct uci_context* uci,
+									   struct uci_section* s, const char* name)
+{
+	const char* str = uci_lookup_option_string(uci, s, name);
+	return str == NULL ? -1 : atof(str);
+}
+
+/*
+ * time option in seconds, fractions like "0.3" and milliseconds with "ms"
+ * suffix like "300ms" are allowed. returns ms or -1 when not found or invalid,
+ * invalid values are logged because the default is used instead
+ */
+static int uci_lookup_option_ms(struct uci_context* uci, struct uci_section* s,
+								const char* name)
+{
+	const char* str = uci_lookup_option_string(uci, s, name);
+	char* end;
+
+	if (str == NULL) {
+		return -1;
+	}
+	double val = strtod(str, &end);
+	if (end == str || val < 0 || val > INT_MAX / 1000
+		|| (*end != '\0' && strcmp(end, "s") != 0 && strcmp(end, "ms") != 0)) {
+		LOG_ERR("UCI: invalid time '%s' for '%s', using default", str, name);
+		return -1;
+	}
+	if (strcmp(end, "ms") == 0) {
+		return val + 0.5;
+	}
+	return val * 1000 + 0.5;
+}
+
+/*
+ * traffic budget in bytes with optional "k", "M" or "G" suffix (powers of
+ * 1000), or in packets with "p" suffix like "5000p". returns the amount and
+ * sets packets, or -1 when not found or invalid
+ */
+static long long uci_lookup_option_budget(struct uci_context* uci,
+										  struct uci_section* s,
+										  const char* name, bool* packets)
+{
+	const char* str = uci_lookup_option_string(uci, s, name);
+	char* end;
+
+	if (str == NULL) {
+		return -1;
+	}
+	double val = strtod(str, &end);
+	if (end == str || val < 0) {
+		return -1;
+	}
+	*packets = false;
+	if (strcmp(end, "p") == 0) {
+		*packets = true;
+	} else if (strcmp(end, "k") == 0) {
+		val *= 1e3;
+	} else if (strcmp(end, "M") == 0) {
+		val *= 1e6;
+	} else if (strcmp(end, "G") == 0) {
+		val *= 1e9;
+	} else if (*end != '\0') {
+		return -1;
+	}
+	return val > LLONG_MAX ? -1 : (long long)val;
+}
+
+/*
+ * read config, adding every complete and enabled interface with
+ * config_add_interface(). returns the number of interfaces or -1 on error
+ */
+int uci_config_pingcheck(struct ping_conf* conf)
 {
 	struct uci_context* uci;
 	struct uci_package* p;
 	struct uci_element* e;
+	struct ping_intf* pi;
 	const char* str;
 	int val;
 	int idx = 0;
@@ -46,24 +128,49 @@ int uci_config_pingcheck(struct ping_intf* intf, int len)
 	int default_panic_to = -1; // don't use
 	bool default_ignore_ubus = false;
 	bool default_disabled = false;
+	double default_phi = 0;
+	int default_gw_interval = 0;
+	int default_gw_timeout = 0;
+	int default_passive = 0;
+	int default_burst = 0;
+	int default_burst_interval = 200;
+	long long default_budget = 0;
+	bool default_budget_packets = false;
+	int default_slo_loss = 0;
+	int default_slo_latency = 0;
+	int default_slo_jitter = 0;
+	int default_slo_hysteresis = 20;
+	bool default_budget_month = false;
+	long long budget;
+	bool packets;
+	double phi;
 
 	uci = uci_alloc_context();
 	if (uci == NULL) {
-		return 0;
+		return -1;
+	}
+	if (config_dir != NULL && uci_set_confdir(uci, config_dir) != UCI_OK) {
+		LOG_ERR("UCI: invalid config directory '%s'", config_dir);
+		uci_free_context(uci);
+		return -1;
 	}
 
 	if (uci_load(uci, "pingcheck", &p)) {
 		uci_free_context(uci);
-		return 0;
+		return -1;
 	}
 
+	/* also without "default" section */
+	conf->score_latency = conf->score_jitter = conf->score_loss = -1;
+	conf->score_percentile = conf->score_hysteresis = -1;
+
 	uci_foreach_element(&p->sections, e)
 	{
 		struct uci_section* s = uci_to_section(e);
 		if (strcmp(s->type, "default") == 0) {
 			/* default values, most useful when first in file */
-			default_interval = uci_lookup_option_int(uci, s, "interval");
-			default_timeout = uci_lookup_option_int(uci, s, "timeout");
+			default_interval = uci_lookup_option_ms(uci, s, "interval");
+			default_timeout = uci_lookup_option_ms(uci, s, "timeout");
 			default_hostname = uci_lookup_option_string(uci, s, "host");
 			default_panic_to = uci_lookup_option_int(uci, s, "panic");
 			str = uci_lookup_option_string(uci, s, "protocol");
@@ -82,6 +189,85 @@ int uci_config_pingcheck(struct ping_intf* intf, int len)
 			if (val > 0) {
 				default_disabled = true;
 			}
+			phi = uci_lookup_option_double(uci, s, "phi_threshold");
+			if (phi > 0) {
+				default_phi = phi;
+			}
+			val = uci_lookup_option_ms(uci, s, "gateway_interval");
+			if (val > 0) {
+				default_gw_interval = val;
+			}
+			val = uci_lookup_option_ms(uci, s, "gateway_timeout");
+			if (val > 0) {
+				default_gw_timeout = val;
+			}
+			val = uci_lookup_option_int(uci, s, "passive_packets");
+			if (val > 0) {
+				default_passive = val;
+			}
+			val = uci_lookup_option_int(uci, s, "burst");
+			if (val > 0) {
+				default_burst = val;
+			}
+			val = uci_lookup_option_ms(uci, s, "burst_interval");
+			if (val > 0) {
+				default_burst_interval = val;
+			}
+			budget = uci_lookup_option_budget(uci, s, "budget", &packets);
+			if (budget >= 0) {
+				default_budget = budget;
+				default_budget_packets = packets;
+			}
+			str = uci_lookup_option_string(uci, s, "budget_period");
+			if (str != NULL) {
+				default_budget_month = strcmp(str, "month") == 0;
+			}
+			val = uci_lookup_option_int(uci, s, "slo_loss");
+			if (val > 0) {
+				default_slo_loss = val;
+			}
+			val = uci_lookup_option_int(uci, s, "slo_latency");
+			if (val > 0) {
+				default_slo_latency = val;
+			}
+			val = uci_lookup_option_int(uci, s, "slo_jitter");
+			if (val > 0) {
+				default_slo_jitter = val;
+			}
+			val = uci_lookup_option_int(uci, s, "slo_hysteresis");
+			if (val >= 0 && val < 100) {
+				default_slo_hysteresis = val;
+			}
+			str = uci_lookup_option_string(uci, s, "metrics_listen");
+			if (str != NULL) {
+				strncpy(conf->metrics_listen, str, MAX_HOSTNAME_LEN - 1);
+			}
+			str = uci_lookup_option_string(uci, s, "state_file");
+			if (str != NULL) {
+				strncpy(conf->state_file, str, MAX_HOSTNAME_LEN - 1);
+			}
+			conf->state_interval
+				= uci_lookup_option_int(uci, s, "state_interval");
+			conf->state_max_age = uci_lookup_option_int(uci, s, "state_max_age");
+			str = uci_lookup_option_string(uci, s, "history_file");
+			if (str != NULL) {
+				strncpy(conf->history_file, str, MAX_HOSTNAME_LEN - 1);
+			}
+			conf->history_size = uci_lookup_option_int(uci, s, "history_size");
+			conf->history_flush
+				= uci_lookup_option_int(uci, s, "history_flush");
+			conf->series = uci_lookup_option_int(uci, s, "series") > 0;
+			conf->workers = uci_lookup_option_int(uci, s, "workers");
+			conf->io_uring = uci_lookup_option_int(uci, s, "io_uring") > 0;
+			conf->xdp = uci_lookup_option_int(uci, s, "xdp") > 0;
+			conf->score_latency
+				= uci_lookup_option_int(uci, s, "score_latency");
+			conf->score_jitter = uci_lookup_option_int(uci, s, "score_jitter");
+			conf->score_loss = uci_lookup_option_int(uci, s, "score_loss");
+			conf->score_percentile
+				= uci_lookup_option_int(uci, s, "score_percentile");
+			conf->score_hysteresis
+				= uci_lookup_option_int(uci, s, "score_hysteresis");
 		} else if (strcmp(s->type, "interface") == 0) {
 			/* interface config, needs at least name */
 			str = uci_lookup_option_string(uci, s, "name");
@@ -92,63 +278,151 @@ int uci_config_pingcheck(struct ping_intf* intf, int len)
 				LOG_ERR("UCI: Interface name too long");
 				continue;
 			}
-			strcpy(intf[idx].name, str);
+			pi = calloc(1, sizeof(*pi));
+			if (pi == NULL) {
+				break;
+			}
+			strcpy(pi->name, str);
 
-			val = uci_lookup_option_int(uci, s, "interval");
-			intf[idx].conf_interval = val > 0 ? val : default_interval;
+			val = uci_lookup_option_ms(uci, s, "interval");
+			pi->conf_interval = val > 0 ? val : default_interval;
 
-			val = uci_lookup_option_int(uci, s, "timeout");
-			intf[idx].conf_timeout = val > 0 ? val : default_timeout;
+			val = uci_lookup_option_ms(uci, s, "timeout");
+			pi->conf_timeout = val > 0 ? val : default_timeout;
 
 			val = uci_lookup_option_int(uci, s, "panic");
-			intf[idx].conf_panic_timeout = val > 0 ? val : default_panic_to;
+			pi->conf_panic_timeout = val > 0 ? val : default_panic_to;
 
 			str = uci_lookup_option_string(uci, s, "host");
 			if (str != NULL)
-				strncpy(intf[idx].conf_hostname, str, MAX_HOSTNAME_LEN);
+				strncpy(pi->conf_hostname, str, MAX_HOSTNAME_LEN);
 			else if (default_hostname != NULL)
-				strncpy(intf[idx].conf_hostname, default_hostname,
+				strncpy(pi->conf_hostname, default_hostname,
 						MAX_HOSTNAME_LEN);
 
 			str = uci_lookup_option_string(uci, s, "protocol");
 			if (str != NULL && strcmp(str, "tcp") == 0) {
-				intf[idx].conf_proto = TCP;
+				pi->conf_proto = TCP;
 			} else if (str != NULL && strcmp(str, "icmp") == 0) {
-				intf[idx].conf_proto = ICMP;
+				pi->conf_proto = ICMP;
 			} else {
-				intf[idx].conf_proto = default_proto;
+				pi->conf_proto = default_proto;
 			}
 
 			val = uci_lookup_option_int(uci, s, "tcp_port");
-			intf[idx].conf_tcp_port = val > 0 ? val : default_tcp_port;
+			pi->conf_tcp_port = val > 0 ? val : default_tcp_port;
 
 			val = uci_lookup_option_int(uci, s, "ignore_ubus");
-			intf[idx].conf_ignore_ubus = val > 0 ? true : default_ignore_ubus;
+			pi->conf_ignore_ubus = val > 0 ? true : default_ignore_ubus;
+
+			str = uci_lookup_option_string(uci, s, "device");
+			if (str != NULL) {
+				strncpy(pi->conf_device, str, MAX_IFNAME_LEN - 1);
+			}
 
 			val = uci_lookup_option_int(uci, s, "disabled");
-			intf[idx].conf_disabled = val > 0 ? true : default_disabled;
+			pi->conf_disabled = val > 0 ? true : default_disabled;
 
-			if (intf[idx].conf_interval <= 0 || intf[idx].conf_timeout <= 0
-				|| intf[idx].conf_hostname[0] == '\0') {
-				LOG_ERR("UCI: interface '%s' config not complete",
-						intf[idx].name);
+			str = uci_lookup_option_string(uci, s, "compare");
+			if (str != NULL) {
+				strncpy(pi->conf_compare, str, MAX_IFNAME_LEN - 1);
+			}
+
+			phi = uci_lookup_option_double(uci, s, "phi_threshold");
+			pi->conf_phi = phi >= 0 ? phi : default_phi;
+
+			val = uci_lookup_option_int(uci, s, "passive_packets");
+			pi->conf_passive = val >= 0 ? val : default_passive;
+
+			val = uci_lookup_option_int(uci, s, "burst");
+			pi->conf_burst = val >= 0 ? val : default_burst;
+			val = uci_lookup_option_ms(uci, s, "burst_interval");
+			pi->conf_burst_interval = val > 0 ? val : default_burst_interval;
+			if (pi->conf_burst_interval < MIN_INTERVAL_ICMP) {
+				LOG_ERR("UCI: interface '%s' burst_interval below %d ms",
+						pi->name, MIN_INTERVAL_ICMP);
+				pi->conf_burst_interval = MIN_INTERVAL_ICMP;
+			}
+			if (pi->conf_burst > 0 && pi->conf_proto == TCP) {
+				/* the next connect would abort the previous one */
+				LOG_ERR("UCI: interface '%s' burst only works with ICMP",
+						pi->name);
+				pi->conf_burst = 0;
+			}
+
+			budget = uci_lookup_option_budget(uci, s, "budget", &packets);
+			if (budget >= 0) {
+				pi->conf_budget = budget;
+				pi->conf_budget_packets = packets;
+			} else {
+				pi->conf_budget = default_budget;
+				pi->conf_budget_packets = default_budget_packets;
+			}
+			str = uci_lookup_option_string(uci, s, "budget_period");
+			pi->conf_budget_month = str != NULL ? strcmp(str, "month") == 0
+												: default_budget_month;
+
+			val = uci_lookup_option_int(uci, s, "slo_loss");
+			pi->conf_slo_loss = val >= 0 ? val : default_slo_loss;
+			val = uci_lookup_option_int(uci, s, "slo_latency");
+			pi->conf_slo_latency = val >= 0 ? val : default_slo_latency;
+			val = uci_lookup_option_int(uci, s, "slo_jitter");
+			pi->conf_slo_jitter = val >= 0 ? val : default_slo_jitter;
+			val = uci_lookup_option_int(uci, s, "slo_hysteresis");
+			pi->conf_slo_hysteresis
+				= val >= 0 && val < 100 ? val : default_slo_hysteresis;
+
+			val = uci_lookup_option_ms(uci, s, "gateway_interval");
+			pi->conf_gw_interval = val >= 0 ? val : default_gw_interval;
+			val = uci_lookup_option_ms(uci, s, "gateway_timeout");
+			pi->conf_gw_timeout = val > 0 ? val : default_gw_timeout;
+			if (pi->conf_gw_timeout <= 0) {
+				/* three probes lost */
+				pi->conf_gw_timeout = pi->conf_gw_interval * 3;
+			}
+			if (pi->conf_gw_interval > 0
+				&& pi->conf_gw_interval < MIN_INTERVAL_ICMP) {
+				LOG_ERR("UCI: interface '%s' gateway_interval below %d ms",
+						pi->name, MIN_INTERVAL_ICMP);
+				pi->conf_gw_interval = MIN_INTERVAL_ICMP;
+			}
+
+			/* don't flood the link or the server */
+			int min_interval
+				= pi->conf_proto == TCP ? MIN_INTERVAL_TCP : MIN_INTERVAL_ICMP;
+
+			/* would go OFFLINE between every two probes */
+			if (pi->conf_timeout > 0 && pi->conf_timeout < pi->conf_interval) {
+				LOG_ERR("UCI: interface '%s' timeout below interval %d ms",
+						pi->name, pi->conf_interval);
+				pi->conf_timeout = pi->conf_interval;
+			}
+
+			if (pi->conf_interval <= 0 || pi->conf_timeout <= 0
+				|| pi->conf_hostname[0] == '\0') {
+				LOG_ERR("UCI: interface '%s' config not complete", pi->name);
+				free(pi);
 				continue;
-			} else if (intf[idx].conf_disabled) {
-				LOG_NOTI("UCI: interface '%s' is disabled", intf[idx].name);
+			} else if (pi->conf_interval < min_interval) {
+				LOG_ERR("UCI: interface '%s' interval below %d ms", pi->name,
+						min_interval);
+				free(pi);
+				continue;
+			} else if (pi->conf_disabled) {
+				LOG_NOTI("UCI: interface '%s' is disabled", pi->name);
+				free(pi);
 				continue;
 			} else {
-				LOG_INF("Configured interface '%s' interval %d timeout %d host "
+				LOG_INF("Configured interface '%s' interval %dms timeout %dms host "
 						"%s %s (%d) ignore_ubus %d",
-						intf[idx].name, intf[idx].conf_interval,
-						intf[idx].conf_timeout, intf[idx].conf_hostname,
-						intf[idx].conf_proto == TCP ? "TCP" : "ICMP",
-						intf[idx].conf_tcp_port, intf[idx].conf_ignore_ubus);
+						pi->name, pi->conf_interval, pi->conf_timeout,
+						pi->conf_hostname,
+						pi->conf_proto == TCP ? "TCP" : "ICMP",
+						pi->conf_tcp_port, pi->conf_ignore_ubus);
 			}
 
-			if (++idx > len) {
-				LOG_ERR("UCI: Can not handle more than %d interfaces", len);
-				return 0;
-			}
+			config_add_interface(pi);
+			idx++;
 		}
 	}
 
@@ -0,0 +1,577 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "log.h"
+#include "main.h"
+
+/* keep libc includes before linux headers for musl compatibility */
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * io_uring backend for probe I/O
+ *
+ * ICMP replies are received with one multishot recvmsg per socket into a
+ * ring of provided buffers, echo requests are sent with sendmsg and TCP
+ * probes use connect operations. Submissions are collected and submitted
+ * together once per uloop iteration, completions are signalled to uloop by
+ * an eventfd.
+ *
+ * This uses the kernel interface directly, so we don't depend on liburing.
+ */
+
+#define URING_ENTRIES  256
+#define URING_BUFS	   64 /* power of 2 */
+#define URING_BUF_SIZE 256
+#define URING_BGID	   0
+
+enum uring_req_type { REQ_RECV, REQ_SEND, REQ_CONNECT };
+
+struct uring_req {
+	enum uring_req_type type;
+	struct ping_intf* pi; /* NULL after the interface was stopped */
+	struct list_head cancel_list; /* when the cancel could not be queued */
+	bool cancel_pending;
+	int fd;
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_in addr;
+	char buf[64]; /* echo request */
+};
+
+static struct {
+	int fd;
+	void* sq_ptr;
+	size_t sq_len;
+	void* cq_ptr;
+	size_t cq_len;
+	struct io_uring_sqe* sqes;
+	size_t sqes_len;
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	unsigned int sq_entries;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_cqe* cqes;
+	unsigned int to_submit;
+	struct io_uring_buf_ring* br;
+	size_t br_len;
+	char* bufs;
+	struct uloop_fd efd;
+	struct uloop_timeout submit;
+} ring = {.fd = -1};
+
+static LIST_HEAD(cancel_pending);
+
+/*** low level ***/
+
+static void uring_submit(void)
+{
+	while (ring.to_submit > 0) {
+		int ret = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, 0, 0,
+						  NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG_ERR("io_uring submit failed: %s", strerror(errno));
+			ring.to_submit = 0; /* retried with the next submission */
+			return;
+		}
+		ring.to_submit -= ret;
+		if (ret == 0) {
+			return;
+		}
+	}
+}
+
+static struct io_uring_sqe* uring_get_sqe(void)
+{
+	unsigned int tail = *ring.sq_tail;
+
+	if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE)
+		>= ring.sq_entries) {
+		uring_submit(); /* full, submit now */
+		if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE)
+			>= ring.sq_entries) {
+			return NULL;
+		}
+	}
+
+	unsigned int idx = tail & *ring.sq_mask;
+	struct io_uring_sqe* sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[idx] = idx;
+	return sqe;
+}
+
+/* make sqe from uring_get_sqe() visible and schedule submission */
+static void uring_queue(void)
+{
+	__atomic_store_n(ring.sq_tail, *ring.sq_tail + 1, __ATOMIC_RELEASE);
+	ring.to_submit++;
+	if (!ring.submit.pending) {
+		uloop_timeout_set(&ring.submit, 0);
+	}
+}
+
+static void uring_buf_return(unsigned int bid)
+{
+	unsigned short tail = ring.br->tail;
+	struct io_uring_buf* buf = &ring.br->bufs[tail & (URING_BUFS - 1)];
+	buf->addr = (unsigned long)(ring.bufs + bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	__atomic_store_n(&ring.br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static bool uring_recv_arm(struct uring_req* req)
+{
+	struct io_uring_sqe* sqe = uring_get_sqe();
+	if (sqe == NULL) {
+		return false;
+	}
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = req->fd;
+	sqe->addr = (unsigned long)&req->msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = (unsigned long)req;
+	uring_queue();
+	return true;
+}
+
+static bool uring_cancel_queue(struct uring_req* req)
+{
+	struct io_uring_sqe* sqe = uring_get_sqe();
+	if (sqe == NULL) {
+		return false;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long)req;
+	sqe->user_data = 0; /* no completion handling */
+	uring_queue();
+	return true;
+}
+
+static void uring_cancel_req(struct uring_req* req)
+{
+	req->pi = NULL; /* freed when its last completion arrives */
+	if (!uring_cancel_queue(req)) {
+		/* a multishot receive would never end, try again later */
+		list_add_tail(&req->cancel_list, &cancel_pending);
+		req->cancel_pending = true;
+		uloop_timeout_set(&ring.submit, 10);
+	}
+}
+
+/* queue cancels which didn't fit into the submission queue before */
+static void uring_cancel_retry(void)
+{
+	struct uring_req* req;
+	struct uring_req* tmp;
+
+	list_for_each_entry_safe(req, tmp, &cancel_pending, cancel_list) {
+		if (!uring_cancel_queue(req)) {
+			uloop_timeout_set(&ring.submit, 10);
+			return;
+		}
+		list_del(&req->cancel_list);
+		req->cancel_pending = false;
+	}
+}
+
+/* uloop timeout callback: submit everything queued in this loop iteration
+ * and retry cancels */
+static void uring_submit_cb(__attribute__((unused)) struct uloop_timeout* t)
+{
+	uring_submit();
+	uring_cancel_retry(); /* queues another submission */
+}
+
+static void uring_req_free(struct uring_req* req)
+{
+	if (req->cancel_pending) {
+		list_del(&req->cancel_list);
+	}
+	free(req);
+}
+
+/*** completions ***/
+
+static void uring_complete_recv(struct uring_req* req, struct io_uring_cqe* cqe)
+{
+	struct ping_intf* pi = req->pi;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		char* buf = ring.bufs + bid * URING_BUF_SIZE;
+		struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*)buf;
+
+		if (pi != NULL && cqe->res >= (int)sizeof(*out)) {
+			char* payload = buf + sizeof(*out) + out->namelen + out->controllen;
+			int len = cqe->res - (payload - buf);
+			if ((int)out->payloadlen < len) {
+				len = out->payloadlen;
+			}
+			/* raw sockets get copies of all replies, only count our own */
+			if (icmp_echo_parse(payload, len) == req->fd) {
+				struct timespec time_recv;
+				clock_now(CLOCK_MONOTONIC, &time_recv);
+				ping_reply(pi, timespec_diff_ms(pi->time_sent, time_recv));
+			}
+		}
+		uring_buf_return(bid);
+	}
+
+	if (cqe->flags & IORING_CQE_F_MORE) {
+		return;
+	}
+
+	/* multishot receive ended */
+	pi = req->pi;
+	if (pi == NULL) {
+		uring_req_free(req);
+	} else if (cqe->res >= 0 || cqe->res == -ENOBUFS) {
+		uring_recv_arm(req);
+	} else {
+		LOG_ERR("io_uring receive on '%s' failed: %s", pi->name,
+				strerror(-cqe->res));
+		pi->uring_recv = NULL;
+		uring_req_free(req);
+	}
+}
+
+static void uring_complete_connect(struct uring_req* req,
+								   struct io_uring_cqe* cqe)
+{
+	struct ping_intf* pi = req->pi;
+
+	if (pi != NULL) {
+		budget_tcp_close(pi, req->fd, cqe->res == 0);
+	}
+	close(req->fd);
+	if (pi != NULL) {
+		pi->uring_conn = NULL;
+		if (cqe->res == 0) {
+			struct timespec time_recv;
+			clock_now(CLOCK_MONOTONIC, &time_recv);
+			ping_reply(pi, timespec_diff_ms(pi->time_sent, time_recv));
+		}
+	}
+	uring_req_free(req);
+}
+
+/* uloop callback for the completion eventfd */
+static void uring_fd_handler(struct uloop_fd* fd,
+							 __attribute__((unused)) unsigned int events)
+{
+	uint64_t v;
+	if (read(fd->fd, &v, sizeof(v)) < 0) {
+		/* spurious */
+	}
+
+	unsigned int head = *ring.cq_head;
+	while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+		struct uring_req* req = (struct uring_req*)(unsigned long)cqe->user_data;
+
+		if (req != NULL) {
+			switch (req->type) {
+			case REQ_RECV:
+				uring_complete_recv(req, cqe);
+				break;
+			case REQ_SEND:
+				if (cqe->res < 0) {
+					LOG_ERR("io_uring send on fd %d failed: %s", req->fd,
+							strerror(-cqe->res));
+				}
+				free(req);
+				break;
+			case REQ_CONNECT:
+				uring_complete_connect(req, cqe);
+				break;
+			}
+		}
+		head++;
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+/*** API ***/
+
+bool uring_enabled(void)
+{
+	return ring.fd >= 0;
+}
+
+/* start receiving on the ICMP socket in pi->ufd.fd */
+bool uring_recv_start(struct ping_intf* pi)
+{
+	struct uring_req* req = calloc(1, sizeof(*req));
+	if (req == NULL) {
+		return false;
+	}
+	req->type = REQ_RECV;
+	req->pi = pi;
+	req->fd = pi->ufd.fd;
+	/* no address and control data, only the packet */
+	if (!uring_recv_arm(req)) {
+		free(req);
+		return false;
+	}
+	pi->uring_recv = req;
+	return true;
+}
+
+bool uring_icmp_send(struct ping_intf* pi)
+{
+	struct uring_req* req = calloc(1, sizeof(*req));
+	if (req == NULL) {
+		return false;
+	}
+	req->type = REQ_SEND;
+	req->fd = pi->ufd.fd;
+	req->addr.sin_family = AF_INET;
+	req->addr.sin_addr.s_addr = pi->conf_host;
+	req->iov.iov_base = req->buf;
+	req->iov.iov_len = icmp_echo_build(req->buf, pi->ufd.fd, pi->cnt_sent);
+	req->msg.msg_name = &req->addr;
+	req->msg.msg_namelen = sizeof(req->addr);
+	req->msg.msg_iov = &req->iov;
+	req->msg.msg_iovlen = 1;
+
+	struct io_uring_sqe* sqe = uring_get_sqe();
+	if (sqe == NULL) {
+		free(req);
+		return false;
+	}
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = req->fd;
+	sqe->addr = (unsigned long)&req->msg;
+	sqe->len = 1;
+	sqe->user_data = (unsigned long)req;
+	uring_queue();
+	return true;
+}
+
+/* start TCP connect, a still pending one is cancelled (timed out) */
+bool uring_tcp_connect(struct ping_intf* pi)
+{
+	if (pi->uring_conn != NULL) {
+		budget_tcp_close(pi, pi->uring_conn->fd, false);
+		uring_cancel_req(pi->uring_conn);
+		pi->uring_conn = NULL;
+	}
+
+	struct uring_req* req = calloc(1, sizeof(*req));
+	if (req == NULL) {
+		return false;
+	}
+	req->fd = tcp_socket(pi->device);
+	if (req->fd < 0) {
+		free(req);
+		return false;
+	}
+	req->type = REQ_CONNECT;
+	req->pi = pi;
+	req->addr.sin_family = AF_INET;
+	req->addr.sin_port = htons(pi->conf_tcp_port);
+	req->addr.sin_addr.s_addr = pi->conf_host;
+
+	struct io_uring_sqe* sqe = uring_get_sqe();
+	if (sqe == NULL) {
+		close(req->fd);
+		free(req);
+		return false;
+	}
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = req->fd;
+	sqe->addr = (unsigned long)&req->addr;
+	sqe->off = sizeof(req->addr); /* addrlen */
+	sqe->user_data = (unsigned long)req;
+	uring_queue();
+	pi->uring_conn = req;
+	return true;
+}
+
+/* cancel all operations of interface before its socket is closed */
+void uring_cancel(struct ping_intf* pi)
+{
+	if (pi->uring_recv != NULL) {
+		uring_cancel_req(pi->uring_recv);
+		pi->uring_recv = NULL;
+	}
+	if (pi->uring_conn != NULL) {
+		uring_cancel_req(pi->uring_conn);
+		pi->uring_conn = NULL;
+	}
+}
+
+bool uring_init(void)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CLAMP;
+	ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring.fd < 0) {
+		goto error;
+	}
+
+	/* map submission and completion rings */
+	ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_len > ring.sq_len) {
+			ring.sq_len = ring.cq_len;
+		}
+		ring.cq_len = ring.sq_len;
+	}
+	ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+					   ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ptr == MAP_FAILED) {
+		ring.sq_ptr = NULL;
+		goto error;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring.cq_ptr = ring.sq_ptr;
+	} else {
+		ring.cq_ptr = mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE,
+						   MAP_SHARED, ring.fd, IORING_OFF_CQ_RING);
+		if (ring.cq_ptr == MAP_FAILED) {
+			ring.cq_ptr = NULL;
+			goto error;
+		}
+	}
+	ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+					 ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) {
+		ring.sqes = NULL;
+		goto error;
+	}
+
+	char* sq = ring.sq_ptr;
+	char* cq = ring.cq_ptr;
+	ring.sq_head = (unsigned int*)(sq + p.sq_off.head);
+	ring.sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned int*)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned int*)(sq + p.sq_off.array);
+	ring.sq_entries = p.sq_entries;
+	ring.cq_head = (unsigned int*)(cq + p.cq_off.head);
+	ring.cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned int*)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	/* provided buffer ring for received packets */
+	ring.br_len = URING_BUFS * sizeof(struct io_uring_buf);
+	ring.br = mmap(NULL, ring.br_len, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring.br == MAP_FAILED) {
+		ring.br = NULL;
+		goto error;
+	}
+	ring.bufs = malloc(URING_BUFS * URING_BUF_SIZE);
+	if (ring.bufs == NULL) {
+		goto error;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)ring.br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING,
+				&reg, 1)
+		< 0) {
+		goto error;
+	}
+	for (unsigned int i = 0; i < URING_BUFS; i++) {
+		uring_buf_return(i);
+	}
+
+	/* completions wake up uloop */
+	ring.efd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring.efd.fd < 0
+		|| syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_EVENTFD,
+				   &ring.efd.fd, 1)
+			   < 0) {
+		goto error;
+	}
+	ring.efd.cb = uring_fd_handler;
+	uloop_fd_add(&ring.efd, ULOOP_READ);
+	ring.submit.cb = uring_submit_cb;
+
+	LOG_INF("Using io_uring for probes");
+	return true;
+
+error:
+	LOG_ERR("Could not set up io_uring: %s", strerror(errno));
+	uring_finish();
+	return false;
+}
+
+void uring_finish(void)
+{
+	if (ring.efd.fd > 0) {
+		uloop_fd_delete(&ring.efd);
+		close(ring.efd.fd);
+		ring.efd.fd = 0;
+	}
+	uloop_timeout_cancel(&ring.submit);
+	struct uring_req* req;
+	struct uring_req* tmp;
+	list_for_each_entry_safe(req, tmp, &cancel_pending, cancel_list) {
+		uring_req_free(req);
+	}
+	if (ring.fd >= 0) {
+		/* closing the ring cancels outstanding requests */
+		close(ring.fd);
+		ring.fd = -1;
+	}
+	if (ring.sqes != NULL) {
+		munmap(ring.sqes, ring.sqes_len);
+		ring.sqes = NULL;
+	}
+	if (ring.cq_ptr != NULL && ring.cq_ptr != ring.sq_ptr) {
+		munmap(ring.cq_ptr, ring.cq_len);
+	}
+	ring.cq_ptr = NULL;
+	if (ring.sq_ptr != NULL) {
+		munmap(ring.sq_ptr, ring.sq_len);
+		ring.sq_ptr = NULL;
+	}
+	if (ring.br != NULL) {
+		munmap(ring.br, ring.br_len);
+		ring.br = NULL;
+	}
+	free(ring.bufs);
+	ring.bufs = NULL;
+}
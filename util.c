@@ -12,10 +12,77 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
+#include "main.h"
+#include <stdio.h>
+#include <sys/resource.h>
 #include <time.h>
+#include <unistd.h>
+
+/* time source of the probe logic, can be replaced e.g. for simulations */
+static int (*clock_source)(clockid_t clk, struct timespec* ts) = clock_gettime;
+
+int clock_now(clockid_t clk, struct timespec* ts)
+{
+	return clock_source(clk, ts);
+}
+
+/* set time source, NULL restores the system clock */
+void clock_set_source(int (*source)(clockid_t clk, struct timespec* ts))
+{
+	clock_source = source != NULL ? source : clock_gettime;
+}
+
+/* wall clock seconds from the time source, like time(NULL) */
+time_t clock_time(void)
+{
+	struct timespec ts;
+	clock_source(CLOCK_REALTIME, &ts);
+	return ts.tv_sec;
+}
 
 long timespec_diff_ms(struct timespec start, struct timespec end)
 {
 	return (end.tv_sec - start.tv_sec) * 1000
 		   + (end.tv_nsec - start.tv_nsec) / 1000000;
 }
+
+void timespec_add_ms(struct timespec* t, long ms)
+{
+	t->tv_sec += ms / 1000;
+	t->tv_nsec += (ms % 1000) * 1000000;
+	if (t->tv_nsec >= 1000000000) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000;
+	}
+}
+
+bool timespec_before(const struct timespec* a, const struct timespec* b)
+{
+	return a->tv_sec < b->tv_sec
+		   || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* CPU time and memory used by pingcheck, e.g. for load tests */
+bool process_usage(unsigned long* cpu_ms, unsigned long* rss_kb)
+{
+	struct rusage ru;
+	unsigned long pages;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0) {
+		return false;
+	}
+	*cpu_ms = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000
+			  + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000;
+
+	/* current RSS, rusage only has the maximum */
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f == NULL) {
+		return false;
+	}
+	if (fscanf(f, "%*u %lu", &pages) != 1) {
+		pages = 0;
+	}
+	fclose(f);
+	*rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+	return true;
+}
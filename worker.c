@@ -0,0 +1,669 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "log.h"
+#include "main.h"
+/* keep libc includes before linux headers for musl compatibility */
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <net/if.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Worker threads for ICMP probing of many targets
+ *
+ * Each worker owns a shard of the ICMP interfaces, and sends and receives on
+ * its own epoll loop. Commands from the main thread and results back to it
+ * are passed in single producer single consumer rings without locks. The
+ * main thread is woken up by an eventfd in uloop and keeps doing all state
+ * handling, ubus and scripts.
+ *
+ * Every raw ICMP socket gets a copy of every echo reply, so a socket per
+ * target would cost each reply once per target. Instead each worker has one
+ * socket which is not bound to a device, chooses the outgoing device per
+ * probe and tells replies apart by their echo id. The echo ids above
+ * ICMP_ID_WORKER are split into a range of slots per worker, and a socket
+ * filter lets the kernel pass only replies in its own range to each worker,
+ * so every reply is received and parsed once, whatever the number of
+ * workers. The echo id of a target is ICMP_ID_WORKER + slot_base + slot.
+ *
+ * Commands which don't fit into a full ring wait in a queue of the main
+ * thread until the worker has drained the ring and wakes up the main thread.
+ */
+
+#define RING_SIZE    4096 /* power of 2 */
+#define MAX_WORKERS  64
+#define MAX_EVENTS   64
+#define MAX_SLOTS    (0x10000 - ICMP_ID_WORKER)
+#define EV_CMD       UINT32_MAX
+#define EV_SOCK      (UINT32_MAX - 1)
+
+/* slot of a target which could not be removed from its worker, so it may
+ * still be probing and the slot must not be used again */
+#define SLOT_LOST ((struct ping_intf*)-1)
+
+enum worker_msg_type {
+	CMD_ADD,	/* value: ifindex, host, interval */
+	CMD_DEL,
+	CMD_UPDATE, /* host, interval */
+	RES_SENT,
+	RES_REPLY, /* value: RTT in ms */
+	RES_ERROR, /* could not send, e.g. host not resolved */
+	RES_ADD_FAILED,
+};
+
+struct worker_msg {
+	uint8_t type;
+	uint32_t slot;
+	uint32_t gen;
+	int32_t value;
+	int32_t host;
+	int32_t interval; /* ms */
+};
+
+/* head and tail on separate cache lines to avoid false sharing */
+struct ring {
+	unsigned int head; /* written by producer only */
+	char pad1[60];
+	unsigned int tail; /* written by consumer only */
+	char pad2[60];
+	struct worker_msg msgs[RING_SIZE];
+};
+
+struct worker_target {
+	bool active;
+	int ifindex;
+	uint32_t gen;
+	int host;
+	int interval;
+	unsigned int cnt;
+	int heap_idx;
+	struct timespec next_send;
+	struct timespec time_sent;
+};
+
+struct worker {
+	pthread_t thread;
+	struct ring cmd; /* main -> worker */
+	struct ring res; /* worker -> main */
+	int cmd_efd;
+	int notify;		 /* main thread eventfd has been written */
+	int cmd_blocked; /* main thread has commands waiting for the ring */
+	unsigned int dropped;
+	unsigned int slot_base; /* first echo id is ICMP_ID_WORKER + slot_base */
+
+	/* owned by worker thread */
+	int epfd;
+	int sock;
+	struct worker_target* targets; /* by slot, sparse */
+	unsigned int num_targets;
+	unsigned int* heap; /* slots sorted by next_send */
+	unsigned int heap_len;
+
+	/* owned by main thread */
+	unsigned int load;
+	struct ping_intf** slots;
+	unsigned int num_slots;
+	unsigned int max_slots;
+	struct worker_msg* pending; /* commands which didn't fit into the ring */
+	unsigned int num_pending;
+};
+
+static struct worker* workers;
+static int num_workers;
+static int stop;
+static uint32_t gen_next;
+static struct uloop_fd res_ufd;
+
+/*** rings ***/
+
+static bool ring_push(struct ring* r, const struct worker_msg* m)
+{
+	unsigned int head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= RING_SIZE) {
+		return false; /* full */
+	}
+	r->msgs[head & (RING_SIZE - 1)] = *m;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool ring_pop(struct ring* r, struct worker_msg* m)
+{
+	unsigned int tail = r->tail;
+	if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+		return false; /* empty */
+	}
+	*m = r->msgs[tail & (RING_SIZE - 1)];
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void efd_signal(int fd)
+{
+	uint64_t v = 1;
+	if (write(fd, &v, sizeof(v)) < 0) {
+		/* counter overflow is impossible, ignore */
+	}
+}
+
+/*** worker thread ***/
+
+/* binary min-heap of target slots by next_send */
+static void heap_swap(struct worker* w, unsigned int i, unsigned int j)
+{
+	unsigned int tmp = w->heap[i];
+	w->heap[i] = w->heap[j];
+	w->heap[j] = tmp;
+	w->targets[w->heap[i]].heap_idx = i;
+	w->targets[w->heap[j]].heap_idx = j;
+}
+
+static bool heap_less(struct worker* w, unsigned int i, unsigned int j)
+{
+	return timespec_before(&w->targets[w->heap[i]].next_send,
+					 &w->targets[w->heap[j]].next_send);
+}
+
+static void heap_fix(struct worker* w, unsigned int i)
+{
+	while (i > 0 && heap_less(w, i, (i - 1) / 2)) {
+		heap_swap(w, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	while (true) {
+		unsigned int min = i;
+		unsigned int l = 2 * i + 1;
+		unsigned int r = 2 * i + 2;
+		if (l < w->heap_len && heap_less(w, l, min)) {
+			min = l;
+		}
+		if (r < w->heap_len && heap_less(w, r, min)) {
+			min = r;
+		}
+		if (min == i) {
+			break;
+		}
+		heap_swap(w, i, min);
+		i = min;
+	}
+}
+
+static void heap_remove(struct worker* w, unsigned int i)
+{
+	w->heap_len--;
+	if (i < w->heap_len) {
+		heap_swap(w, i, w->heap_len);
+		heap_fix(w, i);
+	}
+}
+
+static void worker_post(struct worker* w, const struct worker_msg* m)
+{
+	if (!ring_push(&w->res, m)) {
+		__atomic_fetch_add(&w->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	/* only wake up main thread once until it has drained the rings */
+	if (!__atomic_exchange_n(&w->notify, 1, __ATOMIC_ACQ_REL)) {
+		efd_signal(res_ufd.fd);
+	}
+}
+
+static void worker_result(struct worker* w, int type, unsigned int slot,
+						  int value)
+{
+	struct worker_msg m = {.type = type,
+						   .slot = slot,
+						   .gen = w->targets[slot].gen,
+						   .value = value};
+	worker_post(w, &m);
+}
+
+static bool worker_target_add(struct worker* w, const struct worker_msg* m)
+{
+	if (m->slot >= w->num_targets) {
+		unsigned int num = m->slot + 64;
+		void* t = realloc(w->targets, num * sizeof(*w->targets));
+		void* h = realloc(w->heap, num * sizeof(*w->heap));
+		if (t != NULL) {
+			w->targets = t;
+		}
+		if (h != NULL) {
+			w->heap = h;
+		}
+		if (t == NULL || h == NULL) {
+			return false;
+		}
+		memset(&w->targets[w->num_targets], 0,
+			   (num - w->num_targets) * sizeof(*w->targets));
+		w->num_targets = num;
+	}
+
+	struct worker_target* t = &w->targets[m->slot];
+	memset(t, 0, sizeof(*t));
+	t->active = true;
+	t->ifindex = m->value;
+	t->gen = m->gen;
+	t->host = m->host;
+	t->interval = m->interval;
+
+	/* first probe right away */
+	clock_gettime(CLOCK_MONOTONIC, &t->next_send);
+	t->heap_idx = w->heap_len++;
+	w->heap[t->heap_idx] = m->slot;
+	heap_fix(w, t->heap_idx);
+	return true;
+}
+
+static void worker_commands(struct worker* w)
+{
+	struct worker_msg m;
+	uint64_t v;
+
+	if (read(w->cmd_efd, &v, sizeof(v)) < 0) {
+		/* nothing to read, check ring anyways */
+	}
+
+	while (ring_pop(&w->cmd, &m)) {
+		struct worker_target* t
+			= m.slot < w->num_targets ? &w->targets[m.slot] : NULL;
+		switch (m.type) {
+		case CMD_ADD:
+			if (!worker_target_add(w, &m)) {
+				/* out of memory, the main thread probes it instead */
+				m.type = RES_ADD_FAILED;
+				worker_post(w, &m);
+			}
+			break;
+		case CMD_DEL:
+			if (t != NULL && t->active && t->gen == m.gen) {
+				t->active = false;
+				heap_remove(w, t->heap_idx);
+			}
+			break;
+		case CMD_UPDATE:
+			if (t != NULL && t->active && t->gen == m.gen) {
+				t->host = m.host;
+				t->interval = m.interval;
+			}
+			break;
+		}
+	}
+
+	/* there is room in the ring again */
+	if (__atomic_exchange_n(&w->cmd_blocked, 0, __ATOMIC_ACQ_REL)) {
+		efd_signal(res_ufd.fd);
+	}
+}
+
+static void worker_receive(struct worker* w)
+{
+	char buf[500];
+	struct timespec now;
+	int len;
+
+	while ((len = recv(w->sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		/* the socket filter only passes our echo ids, but it may be
+		 * missing, then the socket gets copies of all replies */
+		unsigned int slot
+			= icmp_echo_parse(buf, len) - ICMP_ID_WORKER - w->slot_base;
+		if (slot >= w->num_targets || !w->targets[slot].active) {
+			continue;
+		}
+		struct worker_target* t = &w->targets[slot];
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		worker_result(w, RES_REPLY, slot,
+					  timespec_diff_ms(t->time_sent, now));
+	}
+}
+
+/* send all probes which are due, returns ms until the next one or -1 */
+static int worker_send(struct worker* w)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	while (w->heap_len > 0) {
+		unsigned int slot = w->heap[0];
+		struct worker_target* t = &w->targets[slot];
+
+		if (timespec_before(&now, &t->next_send)) {
+			return timespec_diff_ms(now, t->next_send) + 1;
+		}
+
+		if (t->host != 0
+			&& icmp_echo_send_ifindex(w->sock, t->ifindex,
+									  ICMP_ID_WORKER + w->slot_base + slot,
+									  t->host, t->cnt++)) {
+			t->time_sent = now;
+			worker_result(w, RES_SENT, slot, 0);
+		} else {
+			worker_result(w, RES_ERROR, slot, 0);
+		}
+
+		timespec_add_ms(&t->next_send, t->interval);
+		if (timespec_before(&t->next_send, &now)) {
+			/* fell behind, don't send a burst */
+			t->next_send = now;
+			timespec_add_ms(&t->next_send, t->interval);
+		}
+		heap_fix(w, 0);
+	}
+	return -1;
+}
+
+static void* worker_thread(void* arg)
+{
+	struct worker* w = arg;
+	struct epoll_event events[MAX_EVENTS];
+	int timeout = -1;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+		int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.u32 == EV_CMD) {
+				worker_commands(w);
+			} else {
+				worker_receive(w);
+			}
+		}
+		timeout = worker_send(w);
+	}
+
+	free(w->targets);
+	free(w->heap);
+	return NULL;
+}
+
+/*** main thread ***/
+
+/* pass commands on which didn't fit into the ring before */
+static void worker_flush(struct worker* w)
+{
+	unsigned int i = 0;
+
+	if (w->num_pending == 0) {
+		return;
+	}
+	/* set before pushing, so a worker which drains the ring after this
+	 * wakes us up again if they don't all fit */
+	__atomic_store_n(&w->cmd_blocked, 1, __ATOMIC_SEQ_CST);
+	while (i < w->num_pending && ring_push(&w->cmd, &w->pending[i])) {
+		i++;
+	}
+	if (i > 0) {
+		w->num_pending -= i;
+		memmove(w->pending, &w->pending[i],
+				w->num_pending * sizeof(*w->pending));
+		efd_signal(w->cmd_efd);
+	}
+}
+
+/* the worker could not take the interface, probe it on the main thread */
+static void worker_add_failed(struct worker* w, struct ping_intf* pi)
+{
+	LOG_ERR("Worker %d could not add '%s', probing on main thread",
+			(int)(w - workers) + 1, pi->name);
+	pi->worker_failed = true;
+	ping_stop(pi);
+	ping_init(pi);
+}
+
+static void worker_results_cb(struct uloop_fd* fd,
+							  __attribute__((unused)) unsigned int events)
+{
+	struct worker_msg m;
+	uint64_t v;
+
+	if (read(fd->fd, &v, sizeof(v)) < 0) {
+		/* spurious */
+	}
+
+	for (int i = 0; i < num_workers; i++) {
+		struct worker* w = &workers[i];
+		worker_flush(w);
+		/* clear before draining, so later results signal again */
+		__atomic_store_n(&w->notify, 0, __ATOMIC_RELEASE);
+		while (ring_pop(&w->res, &m)) {
+			struct ping_intf* pi
+				= m.slot < w->num_slots ? w->slots[m.slot] : NULL;
+			if (pi == NULL || pi == SLOT_LOST || pi->worker_gen != m.gen) {
+				continue; /* stale result from a removed interface */
+			}
+			switch (m.type) {
+			case RES_SENT:
+				ping_sent(pi);
+				break;
+			case RES_REPLY:
+				ping_reply(pi, m.value);
+				break;
+			case RES_ERROR:
+				ping_send_error(pi);
+				break;
+			case RES_ADD_FAILED:
+				worker_add_failed(w, pi);
+				break;
+			}
+		}
+	}
+}
+
+static bool worker_command(struct ping_intf* pi, int type, int value)
+{
+	struct worker* w = &workers[pi->worker - 1];
+	struct worker_msg m = {.type = type,
+						   .slot = pi->worker_slot,
+						   .gen = pi->worker_gen,
+						   .value = value,
+						   .host = pi->conf_host,
+						   .interval = pi->conf_interval};
+
+	/* keep the order behind commands which are still waiting */
+	if (w->num_pending == 0 && ring_push(&w->cmd, &m)) {
+		efd_signal(w->cmd_efd);
+		return true;
+	}
+
+	/* the ring is full, don't block the main thread but queue it here */
+	void* p = realloc(w->pending, (w->num_pending + 1) * sizeof(m));
+	if (p == NULL) {
+		LOG_ERR("Worker %d command queue full", pi->worker);
+		return false;
+	}
+	w->pending = p;
+	w->pending[w->num_pending++] = m;
+	worker_flush(w);
+	return true;
+}
+
+bool worker_enabled(void)
+{
+	return num_workers > 0;
+}
+
+/* hand ICMP interface over to the least loaded worker thread */
+bool worker_add(struct ping_intf* pi)
+{
+	struct worker* w = &workers[0];
+	unsigned int slot;
+	int ifindex = 0;
+
+	if (pi->device[0] != '\0') {
+		ifindex = if_nametoindex(pi->device);
+		if (ifindex == 0) {
+			LOG_ERR("Could not find device '%s'", pi->device);
+			return false;
+		}
+	}
+
+	for (int i = 1; i < num_workers; i++) {
+		if (workers[i].load < w->load) {
+			w = &workers[i];
+		}
+	}
+
+	for (slot = 0; slot < w->num_slots; slot++) {
+		if (w->slots[slot] == NULL) {
+			break;
+		}
+	}
+	if (slot == w->num_slots) {
+		unsigned int num = w->num_slots + 64;
+		if (num > w->max_slots) {
+			num = w->max_slots;
+		}
+		if (slot == num) {
+			LOG_ERR("Too many interfaces for worker threads");
+			return false;
+		}
+		void* s = realloc(w->slots, num * sizeof(*w->slots));
+		if (s == NULL) {
+			return false;
+		}
+		w->slots = s;
+		memset(&w->slots[w->num_slots], 0,
+			   (num - w->num_slots) * sizeof(*w->slots));
+		w->num_slots = num;
+	}
+
+	pi->worker = w - workers + 1;
+	pi->worker_slot = slot;
+	pi->worker_gen = ++gen_next;
+	if (!worker_command(pi, CMD_ADD, ifindex)) {
+		pi->worker = 0;
+		return false;
+	}
+	w->slots[slot] = pi;
+	w->load++;
+	return true;
+}
+
+/* pass changed host or interval on to the worker */
+void worker_update(struct ping_intf* pi)
+{
+	if (pi->worker > 0) {
+		worker_command(pi, CMD_UPDATE, 0);
+	}
+}
+
+void worker_remove(struct ping_intf* pi)
+{
+	if (pi->worker <= 0) {
+		return;
+	}
+	struct worker* w = &workers[pi->worker - 1];
+	if (worker_command(pi, CMD_DEL, 0)) {
+		w->slots[pi->worker_slot] = NULL;
+	} else {
+		/* the worker may keep probing with this echo id */
+		LOG_ERR("Worker could not remove '%s'", pi->name);
+		w->slots[pi->worker_slot] = SLOT_LOST;
+	}
+	w->load--;
+	pi->worker = 0;
+}
+
+bool worker_init(int num)
+{
+	if (num > MAX_WORKERS) {
+		num = MAX_WORKERS;
+	}
+
+	res_ufd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (res_ufd.fd < 0) {
+		return false;
+	}
+	res_ufd.cb = worker_results_cb;
+	uloop_fd_add(&res_ufd, ULOOP_READ);
+
+	workers = calloc(num, sizeof(*workers));
+	if (workers == NULL) {
+		return false;
+	}
+
+	for (int i = 0; i < num; i++) {
+		struct worker* w = &workers[i];
+		w->max_slots = MAX_SLOTS / num;
+		w->slot_base = i * w->max_slots;
+		w->epfd = epoll_create1(EPOLL_CLOEXEC);
+		w->cmd_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		w->sock = icmp_init(NULL);
+		if (w->sock >= 0) {
+			/* replies of all targets of the worker queue up here */
+			int size = 1 << 20;
+			setsockopt(w->sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+			/* without it, all workers get all replies but it still works */
+			icmp_filter_echo_ids(w->sock, ICMP_ID_WORKER + w->slot_base,
+								 w->max_slots);
+		}
+		struct epoll_event ev = {.events = EPOLLIN, .data.u32 = EV_CMD};
+		struct epoll_event sev = {.events = EPOLLIN, .data.u32 = EV_SOCK};
+		if (w->epfd < 0 || w->cmd_efd < 0 || w->sock < 0
+			|| epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->cmd_efd, &ev) < 0
+			|| epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->sock, &sev) < 0
+			|| pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+			LOG_ERR("Could not start worker %d", i + 1);
+			if (w->epfd >= 0) {
+				close(w->epfd);
+			}
+			if (w->cmd_efd >= 0) {
+				close(w->cmd_efd);
+			}
+			if (w->sock >= 0) {
+				close(w->sock);
+			}
+			break;
+		}
+		num_workers++;
+	}
+
+	LOG_INF("Started %d worker threads", num_workers);
+	return num_workers > 0;
+}
+
+void worker_finish(void)
+{
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	for (int i = 0; i < num_workers; i++) {
+		struct worker* w = &workers[i];
+		efd_signal(w->cmd_efd);
+		pthread_join(w->thread, NULL);
+		if (w->dropped > 0) {
+			LOG_NOTI("Worker %d dropped %u results", i + 1, w->dropped);
+		}
+		close(w->cmd_efd);
+		close(w->epfd);
+		close(w->sock);
+		free(w->slots);
+		free(w->pending);
+	}
+	free(workers);
+	workers = NULL;
+	num_workers = 0;
+	if (res_ufd.fd > 0) {
+		uloop_fd_delete(&res_ufd);
+		close(res_ufd.fd);
+		res_ufd.fd = 0;
+	}
+}
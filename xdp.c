@@ -0,0 +1,373 @@
+/* pingcheck - Check connectivity of interfaces in OpenWRT
+ *
+ * Copyright (C) 2015 Bruno Randolf <br1@einfach.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "log.h"
+#include "main.h"
+
+/* keep libc includes before linux headers for musl compatibility */
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * XDP reply accounting
+ *
+ * An eBPF program on the XDP ingress hook of the monitored devices looks up
+ * every ICMP echo reply by source address and echo id in a hash map. Replies
+ * to our probes are counted there with the kernel time they arrived and
+ * dropped, so they never wake up the daemon. The map is read in batches
+ * every XDP_TICK ms and new replies are passed to ping_reply(). Anything
+ * else, including replies with IP options or VLAN tags, goes on to the
+ * sockets as usual.
+ *
+ * The program is assembled here and loaded with the bpf() system call, so
+ * neither clang nor libbpf are needed. Needs Linux 5.9 or later.
+ */
+
+#define XDP_TICK	 10 /* ms */
+#define XDP_ENTRIES	 65536
+#define XDP_BATCH	 256
+#define XDP_MAX_DEVS 64
+#define XDP_LOG_SIZE 65536
+
+/* Ethernet, IPv4 header without options, ICMP echo header */
+#define XDP_OFF_IP	 ETH_HLEN
+#define XDP_OFF_ICMP (XDP_OFF_IP + 20)
+#define XDP_HDR_LEN	 (XDP_OFF_ICMP + 8)
+
+/* placeholder for jumps to the end of the program, see xdp_prog_load() */
+#define XDP_JPASS 0x7fff
+
+#define INSN(c, d, s, o, i)                                                   \
+	((struct bpf_insn){                                                       \
+		.code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i)})
+
+struct xdp_key {
+	uint32_t addr; /* source address of the reply */
+	uint16_t id;   /* echo id, network byte order like addr */
+	uint16_t pad;
+};
+
+struct xdp_val {
+	uint64_t replies; /* counted by the program */
+	uint64_t time;	  /* CLOCK_MONOTONIC of the last reply, in ns */
+	uint64_t pi;	  /* struct ping_intf*, only used by us */
+};
+
+static int prog_fd = -1;
+static int map_fd = -1;
+static struct uloop_timeout timeout_tick;
+
+static struct {
+	int ifindex;
+	int link_fd;
+} devs[XDP_MAX_DEVS];
+static int num_devs;
+
+static int xdp_sys(enum bpf_cmd cmd, union bpf_attr* attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static bool xdp_map_create(void)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_HASH;
+	attr.key_size = sizeof(struct xdp_key);
+	attr.value_size = sizeof(struct xdp_val);
+	attr.max_entries = XDP_ENTRIES;
+	map_fd = xdp_sys(BPF_MAP_CREATE, &attr);
+	if (map_fd < 0) {
+		LOG_ERR("XDP: could not create map: %s", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static bool xdp_prog_load(void)
+{
+	static char log_buf[XDP_LOG_SIZE];
+	union bpf_attr attr;
+
+	struct bpf_insn prog[] = {
+		/* r2 = data, r3 = data_end */
+		INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1,
+			 offsetof(struct xdp_md, data), 0),
+		INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1,
+			 offsetof(struct xdp_md, data_end), 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+		INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, XDP_HDR_LEN),
+		INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, XDP_JPASS, 0),
+
+		/* IPv4 without options, ICMP echo reply */
+		INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2,
+			 offsetof(struct ethhdr, h_proto), 0),
+		INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, XDP_JPASS,
+			 htons(ETH_P_IP)),
+		INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, XDP_OFF_IP, 0),
+		INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, XDP_JPASS, 0x45),
+		INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2,
+			 XDP_OFF_IP + 9, 0),
+		INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, XDP_JPASS,
+			 IPPROTO_ICMP),
+		INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, XDP_OFF_ICMP,
+			 0),
+		INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, XDP_JPASS,
+			 ICMP_ECHOREPLY),
+
+		/* key on the stack: source address and echo id */
+		INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_5, BPF_REG_2,
+			 XDP_OFF_IP + 12, 0),
+		INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_5, -8, 0),
+		INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2,
+			 XDP_OFF_ICMP + 4, 0),
+		INSN(BPF_STX | BPF_MEM | BPF_H, BPF_REG_10, BPF_REG_5, -4, 0),
+		INSN(BPF_ST | BPF_MEM | BPF_H, BPF_REG_10, 0, -2, 0),
+
+		/* r0 = bpf_map_lookup_elem(map, key) */
+		INSN(BPF_LD | BPF_IMM | BPF_DW, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0,
+			 map_fd),
+		INSN(0, 0, 0, 0, 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+		INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+		INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+		INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, XDP_JPASS, 0),
+
+		/* one of ours: count it with the time and drop it */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_0, 0, 0),
+		INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ktime_get_ns),
+		INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_6, BPF_REG_0,
+			 offsetof(struct xdp_val, time), 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 1),
+		INSN(BPF_STX | BPF_ATOMIC | BPF_DW, BPF_REG_6, BPF_REG_1,
+			 offsetof(struct xdp_val, replies), BPF_ADD),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_DROP),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+
+		/* not ours */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	int cnt = sizeof(prog) / sizeof(prog[0]);
+
+	for (int i = 0; i < cnt; i++) {
+		if (BPF_CLASS(prog[i].code) == BPF_JMP && prog[i].off == XDP_JPASS) {
+			prog[i].off = cnt - 2 - i - 1;
+		}
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uintptr_t)prog;
+	attr.insn_cnt = cnt;
+	attr.license = (uintptr_t) "GPL";
+	attr.log_buf = (uintptr_t)log_buf;
+	attr.log_size = sizeof(log_buf);
+	attr.log_level = 1;
+	prog_fd = xdp_sys(BPF_PROG_LOAD, &attr);
+	if (prog_fd < 0) {
+		LOG_ERR("XDP: could not load program: %s", strerror(errno));
+		LOG_DBG("XDP: verifier log: %s", log_buf);
+		return false;
+	}
+	return true;
+}
+
+/* attach the program to the device, if not done yet */
+static bool xdp_attach(const char* device)
+{
+	union bpf_attr attr;
+
+	int ifindex = if_nametoindex(device);
+	if (ifindex == 0) {
+		return false;
+	}
+	for (int i = 0; i < num_devs; i++) {
+		if (devs[i].ifindex == ifindex) {
+			return true;
+		}
+	}
+	if (num_devs == XDP_MAX_DEVS) {
+		LOG_ERR("XDP: too many devices, not attaching to '%s'", device);
+		return false;
+	}
+
+	/* the kernel chooses native XDP or generic mode */
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = prog_fd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	int fd = xdp_sys(BPF_LINK_CREATE, &attr);
+	if (fd < 0) {
+		LOG_ERR("XDP: could not attach to '%s': %s", device, strerror(errno));
+		return false;
+	}
+	LOG_INF("XDP: attached to '%s'", device);
+	devs[num_devs].ifindex = ifindex;
+	devs[num_devs].link_fd = fd;
+	num_devs++;
+	return true;
+}
+
+static void xdp_key_get(struct ping_intf* pi, struct xdp_key* key)
+{
+	memset(key, 0, sizeof(*key));
+	key->addr = pi->conf_host;
+	key->id = icmp_echo_id(pi->ufd.fd);
+}
+
+static void xdp_reply(struct xdp_val* val)
+{
+	struct ping_intf* pi = (struct ping_intf*)(uintptr_t)val->pi;
+
+	if (pi == NULL || val->replies == pi->xdp_replies) {
+		return;
+	}
+	pi->xdp_replies = val->replies;
+
+	/* several replies in one tick are one for the state */
+	long long sent = (long long)pi->time_sent.tv_sec * 1000000000LL
+					 + pi->time_sent.tv_nsec;
+	long long rtt = ((long long)val->time - sent) / 1000000;
+	ping_reply(pi, rtt > 0 ? rtt : 0);
+}
+
+/* read all entries of the map in batches */
+static void xdp_tick_cb(struct uloop_timeout* t)
+{
+	static struct xdp_key keys[XDP_BATCH];
+	static struct xdp_val vals[XDP_BATCH];
+	union bpf_attr attr;
+	uint64_t batch;
+	bool first = true;
+
+	debug_timeout_lag(t);
+	while (true) {
+		memset(&attr, 0, sizeof(attr));
+		attr.batch.in_batch = first ? 0 : (uintptr_t)&batch;
+		attr.batch.out_batch = (uintptr_t)&batch;
+		attr.batch.keys = (uintptr_t)keys;
+		attr.batch.values = (uintptr_t)vals;
+		attr.batch.count = XDP_BATCH;
+		attr.batch.map_fd = map_fd;
+		int ret = xdp_sys(BPF_MAP_LOOKUP_BATCH, &attr);
+		if (ret < 0 && errno != ENOENT) {
+			LOG_ERR("XDP: could not read map: %s", strerror(errno));
+			break;
+		}
+		for (unsigned int i = 0; i < attr.batch.count; i++) {
+			xdp_reply(&vals[i]);
+		}
+		if (ret < 0) { /* ENOENT: no more entries */
+			break;
+		}
+		first = false;
+	}
+	uloop_timeout_set(t, XDP_TICK);
+}
+
+bool xdp_init(void)
+{
+	if (!xdp_map_create()) {
+		return false;
+	}
+	if (!xdp_prog_load()) {
+		close(map_fd);
+		map_fd = -1;
+		return false;
+	}
+	timeout_tick.cb = xdp_tick_cb;
+	uloop_timeout_set(&timeout_tick, XDP_TICK);
+	return true;
+}
+
+bool xdp_enabled(void)
+{
+	return prog_fd >= 0;
+}
+
+/* called before sending a probe, registers the interface with its current
+ * target and socket. only changes cost a system call */
+void xdp_update(struct ping_intf* pi)
+{
+	union bpf_attr attr;
+	struct xdp_key key;
+	struct xdp_val val;
+	uint64_t packed;
+
+	xdp_key_get(pi, &key);
+	memcpy(&packed, &key, sizeof(packed));
+	if (packed == pi->xdp_key || pi->conf_host == 0 || pi->device[0] == '\0'
+		|| !xdp_attach(pi->device)) {
+		return;
+	}
+	xdp_remove(pi);
+
+	memset(&val, 0, sizeof(val));
+	val.pi = (uintptr_t)pi;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uintptr_t)&key;
+	attr.value = (uintptr_t)&val;
+	attr.flags = BPF_ANY;
+	if (xdp_sys(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+		LOG_ERR("XDP: could not add '%s': %s", pi->name, strerror(errno));
+		return;
+	}
+	pi->xdp_key = packed;
+	pi->xdp_replies = 0;
+}
+
+void xdp_remove(struct ping_intf* pi)
+{
+	union bpf_attr attr;
+
+	if (pi->xdp_key == 0) {
+		return;
+	}
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uintptr_t)&pi->xdp_key;
+	xdp_sys(BPF_MAP_DELETE_ELEM, &attr);
+	pi->xdp_key = 0;
+}
+
+void xdp_finish(void)
+{
+	uloop_timeout_cancel(&timeout_tick);
+	/* closing the links detaches the program */
+	for (int i = 0; i < num_devs; i++) {
+		close(devs[i].link_fd);
+	}
+	num_devs = 0;
+	if (prog_fd >= 0) {
+		close(prog_fd);
+		prog_fd = -1;
+	}
+	if (map_fd >= 0) {
+		close(map_fd);
+		map_fd = -1;
+	}
+}